@@ -29,6 +29,8 @@
 #include "aegis/channel.hpp"
 #include "aegis/guild.hpp"
 #include "aegis/core.hpp"
+#include "aegis/snapshot.hpp"
+#include "aegis/message_cache.hpp"
 
 #include "aegis/impl/core.cpp"
 #include "aegis/impl/user.cpp"
@@ -44,6 +46,8 @@
 #include "aegis/channel.hpp"
 #include "aegis/guild.hpp"
 #include "aegis/core.hpp"
+#include "aegis/snapshot.hpp"
+#include "aegis/message_cache.hpp"
 
 #include "aegis/gateway/events/channel_create.hpp"
 #include "aegis/gateway/events/channel_delete.hpp"
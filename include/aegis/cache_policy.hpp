@@ -0,0 +1,85 @@
+//
+// cache_policy.hpp
+// ****************
+//
+// Copyright (c) 2019 Sharon W (sharon at aegis dot gg)
+//
+// Distributed under the MIT License. (See accompanying file LICENSE)
+//
+
+#pragma once
+
+#include "aegis/config.hpp"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace aegis
+{
+
+/// What the caches keep, chosen at runtime
+/**
+ * Roles are always cached as permission checks need them. By default everything else is
+ * cached too, matching the behaviour without a policy.
+ *
+ * @code{.cpp}
+ * aegis::core bot(aegis::create_bot_t().cache(aegis::cache_policy()
+ *     .member_guild_limit(1000)
+ *     .presences(false)
+ *     .user_ttl(std::chrono::minutes(30))
+ *     .emojis(false)
+ *     .messages(50)));
+ * @endcode
+ */
+struct cache_policy
+{
+    /// Cache guild members. Users still exist while events refer to them
+    cache_policy & members(const bool param) noexcept { _members = param; return *this; }
+    /// Only cache members of guilds with at most this many members. 0 for no limit
+    cache_policy & member_guild_limit(const uint32_t param) noexcept { _member_guild_limit = param; return *this; }
+    /// Apply PRESENCE_UPDATE and the presences of GUILD_CREATE to the cache. Events are still dispatched
+    cache_policy & presences(const bool param) noexcept { _presences = param; return *this; }
+    /// Evict users no event referred to for this long. 0 to keep them
+    cache_policy & user_ttl(const std::chrono::minutes param) noexcept { _user_ttl = param; return *this; }
+    /// Evict the least recently seen users beyond this many. 0 for no limit
+    cache_policy & user_limit(const std::size_t param) noexcept { _user_limit = param; return *this; }
+    /// Cache the channels of guilds
+    cache_policy & channels(const bool param) noexcept { _channels = param; return *this; }
+    /// Cache the emojis of guilds
+    cache_policy & emojis(const bool param) noexcept { _emojis = param; return *this; }
+    /// Keep this many recent messages per channel to attach to update, delete and reaction events. 0 to keep none
+    cache_policy & messages(const std::size_t param) noexcept { _messages = param; return *this; }
+    /// Estimated memory all kept messages may use together. 0 for no limit
+    cache_policy & message_memory(const std::size_t param) noexcept { _message_memory = param; return *this; }
+    /// Remember the computed permissions of up to this many member and channel pairs per guild. 0 to disable
+    cache_policy & permissions(const std::size_t param) noexcept { _permissions = param; return *this; }
+
+    /// Check whether members of a guild are cached
+    /**
+     * @param member_count Member count of the guild
+     * @returns true if members are cached
+     */
+    bool cache_members(const uint32_t member_count) const noexcept
+    {
+        return _members && (_member_guild_limit == 0 || member_count <= _member_guild_limit);
+    }
+
+    /// Check whether users are evicted at all
+    bool evicts_users() const noexcept
+    {
+        return _user_ttl.count() > 0 || _user_limit > 0;
+    }
+
+    bool _members{ true };
+    uint32_t _member_guild_limit{ 0 };
+    bool _presences{ true };
+    std::chrono::minutes _user_ttl{ 0 };
+    std::size_t _user_limit{ 0 };
+    bool _channels{ true };
+    bool _emojis{ true };
+    std::size_t _messages{ 0 };
+    std::size_t _message_memory{ 64 * 1024 * 1024 };
+    std::size_t _permissions{ 4096 };
+};
+
+}
@@ -15,6 +15,10 @@
 #include "aegis/ratelimit/ratelimit.hpp"
 #include "aegis/permission.hpp"
 #include "aegis/snowflake.hpp"
+#include "aegis/flat_map.hpp"
+#include "aegis/slab.hpp"
+#include "aegis/intern.hpp"
+#include "aegis/permission_cache.hpp"
 #include "aegis/gateway/objects/permission_overwrite.hpp"
 #include "aegis/gateway/objects/channel.hpp"
 #include <shared_mutex>
@@ -162,6 +166,10 @@ public:
      */
     AEGIS_DECL channel(const snowflake channel_id, const snowflake guild_id, core * _bot, asio::io_context & _io, ratelimit::ratelimit_mgr & _ratelimit);
 
+    /// Channels are allocated from a slab. See aegis::slab
+    static void * operator new(std::size_t size) { return slab<channel>::instance().allocate(size); }
+    static void operator delete(void * p, std::size_t size) noexcept { slab<channel>::instance().deallocate(p, size); }
+
     /// Get a reference to the guild object this channel belongs to
     /**
      * @throws aegis::exception Thrown on failure.
@@ -183,8 +191,7 @@ public:
     std::string get_name() const noexcept
     {
         std::shared_lock<shared_mutex> l(_m);
-        std::string _name = name;
-        return std::move(_name);
+        return name.value();
     }
 
     /// Get the type of this channel
@@ -579,6 +586,7 @@ public:
 private:
     friend class guild;
     friend class core;
+    friend class snapshot;
 
     /// requires the caller to handle locking
     AEGIS_DECL void _load_with_guild(guild & _guild, const json & obj, shards::shard * _shard);
@@ -591,14 +599,15 @@ private:
     snowflake parent_id; /**< snowflake of the parent channel */
 #if !defined(AEGIS_DISABLE_ALL_CACHE)
     snowflake last_message_id = 0; /**< Snowflake of the last message sent in this channel */
-    std::string name; /**< String of the name of this channel */
+    interned_string name; /**< String of the name of this channel */
     std::string topic; /**< String of the topic of this channel */
     bool _nsfw = false;
     uint32_t position = 0; /**< Position of channel in guild channel list */
     gateway::objects::channel::channel_type type = gateway::objects::channel::channel_type::Text; /**< Type of channel */
     uint16_t bitrate = 0; /**< Bit rate of voice channel */
     uint16_t user_limit = 0; /**< User limit of voice channel */
-    std::unordered_map<int64_t, gateway::objects::permission_overwrite> overrides; /**< Snowflake map of user/role to permission overrides */
+    flat_map<int64_t, gateway::objects::permission_overwrite, snowflake_hash> overrides; /**< Snowflake map of user/role to permission overrides */
+    std::atomic<uint64_t> _perm_generation{ permission_cache::next_generation() }; /**< Replaced whenever overrides change. See aegis::permission_cache */
     uint16_t rate_limit_per_user = 0; /**< Limit of how many seconds sent messages must have between each */
 #endif
     asio::io_context & _io_context;
@@ -0,0 +1,228 @@
+//
+// concurrent_map.hpp
+// ******************
+//
+// Copyright (c) 2019 Sharon W (sharon at aegis dot gg)
+//
+// Distributed under the MIT License. (See accompanying file LICENSE)
+//
+
+#pragma once
+
+#include "aegis/config.hpp"
+#include "aegis/flat_map.hpp"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <utility>
+
+namespace aegis
+{
+
+#if (AEGIS_HAS_STD_SHARED_MUTEX == 1)
+using shared_mutex = std::shared_mutex;
+#else
+using shared_mutex = std::shared_timed_mutex;
+#endif
+
+/// Lock-striped map owning its values
+/**
+ * Keys are spread over a fixed amount of stripes, each a flat_map behind its own
+ * shared_mutex. Lookups take a shared lock on one stripe only, and find_or_create() only
+ * takes the exclusive lock when the key is missing, so threads working on different entries
+ * rarely contend.
+ *
+ * Values are heap allocated and never move while in the map. Pointers returned stay valid
+ * until the entry is extracted.
+ */
+template<typename Key, typename T, typename Hash = std::hash<Key>, std::size_t Stripes = 64>
+class concurrent_map
+{
+public:
+    using key_type = Key;
+    using mapped_type = T;
+    using value_ptr = std::unique_ptr<T>;
+
+    static constexpr std::size_t stripe_count = Stripes;
+
+    concurrent_map() = default;
+    concurrent_map(const concurrent_map &) = delete;
+    concurrent_map & operator=(const concurrent_map &) = delete;
+
+    /// Find a value
+    /**
+     * @param key Key to look up
+     * @returns Pointer to the value or nullptr
+     */
+    T * find(const Key & key) const
+    {
+        auto & s = _stripe(key);
+        std::shared_lock<shared_mutex> l(s.m);
+        auto it = s.map.find(key);
+        return (it == s.map.end()) ? nullptr : it->second.get();
+    }
+
+    /// Find a value or insert a new one
+    /**
+     * @param key Key to look up
+     * @param make Callable returning std::unique_ptr<T>. Only called if the key is missing and
+     * runs under the stripe's exclusive lock
+     * @returns Pointer to the found or inserted value
+     */
+    template<typename Factory>
+    T * find_or_create(const Key & key, Factory && make)
+    {
+        auto & s = _stripe(key);
+        {
+            std::shared_lock<shared_mutex> l(s.m);
+            auto it = s.map.find(key);
+            if (it != s.map.end())
+                return it->second.get();
+        }
+        std::unique_lock<shared_mutex> l(s.m);
+        auto it = s.map.find(key);
+        if (it != s.map.end())
+            return it->second.get();
+        auto ptr = make();
+        auto res = ptr.get();
+        s.map.emplace(key, std::move(ptr));
+        _size.fetch_add(1, std::memory_order_relaxed);
+        return res;
+    }
+
+    /// Insert a value if the key is missing
+    /**
+     * @param key Key to insert at
+     * @param value Value to take ownership of. Destroyed if the key exists
+     * @returns true if inserted
+     */
+    bool insert(const Key & key, value_ptr value)
+    {
+        if (!value)
+            return false;
+        auto & s = _stripe(key);
+        std::unique_lock<shared_mutex> l(s.m);
+        if (!s.map.emplace(key, std::move(value)).second)
+            return false;
+        _size.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    /// Remove a value and hand over its ownership
+    /**
+     * @param key Key to remove
+     * @returns The value or an empty pointer if the key is missing
+     */
+    value_ptr extract(const Key & key)
+    {
+        auto & s = _stripe(key);
+        std::unique_lock<shared_mutex> l(s.m);
+        auto it = s.map.find(key);
+        if (it == s.map.end())
+            return nullptr;
+        auto res = std::move(it->second);
+        s.map.erase(it);
+        _size.fetch_sub(1, std::memory_order_relaxed);
+        return res;
+    }
+
+    /// Visit every entry
+    /**
+     * Stripes are locked shared one after the other, so this is not a snapshot of the whole
+     * map. Do not modify the map from within func.
+     * @param func Callable taking (const Key &, T &)
+     */
+    template<typename Func>
+    void for_each(Func && func) const
+    {
+        for (auto & s : _stripes)
+        {
+            std::shared_lock<shared_mutex> l(s.m);
+            for (auto & kv : s.map)
+                func(kv.first, *kv.second);
+        }
+    }
+
+    /// Visit a random entry
+    /**
+     * Costs one stripe lock regardless of the size of the map, for sampling it instead of
+     * walking it. Do not modify the map from within func.
+     * @param r Random number picking the stripe and the entry
+     * @param func Callable taking (const Key &, T &)
+     * @returns false if the picked stripe was empty
+     */
+    template<typename Func>
+    bool sample(uint64_t r, Func && func) const
+    {
+        auto & s = _stripes[r % Stripes];
+        std::shared_lock<shared_mutex> l(s.m);
+        auto it = s.map.from_bucket(static_cast<std::size_t>(r / Stripes));
+        if (it == s.map.end())
+            return false;
+        func(it->first, *it->second);
+        return true;
+    }
+
+    /// Visit every entry of one stripe
+    /**
+     * Lets long walks over the map work in bounded batches. See for_each()
+     * @param index Stripe to visit, below stripe_count
+     * @param func Callable taking (const Key &, T &)
+     */
+    template<typename Func>
+    void for_each_in_stripe(std::size_t index, Func && func) const
+    {
+        auto & s = _stripes[index];
+        std::shared_lock<shared_mutex> l(s.m);
+        for (auto & kv : s.map)
+            func(kv.first, *kv.second);
+    }
+
+    /// Destroy every value
+    void clear()
+    {
+        for (auto & s : _stripes)
+        {
+            std::unique_lock<shared_mutex> l(s.m);
+            _size.fetch_sub(s.map.size(), std::memory_order_relaxed);
+            s.map.clear();
+        }
+    }
+
+    /// Get the amount of entries
+    std::size_t size() const noexcept
+    {
+        return _size.load(std::memory_order_relaxed);
+    }
+
+    /// Check if the map is empty
+    bool empty() const noexcept
+    {
+        return size() == 0;
+    }
+
+private:
+    struct stripe
+    {
+        mutable shared_mutex m;
+        flat_map<Key, value_ptr, Hash> map;
+    };
+
+    stripe & _stripe(const Key & key) const noexcept
+    {
+        // remix so the stripe does not correlate with the slot bits used by the stripe's flat_map
+        uint64_t h = static_cast<uint64_t>(Hash()(key));
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return _stripes[h % Stripes];
+    }
+
+    mutable stripe _stripes[Stripes];
+    std::atomic<std::size_t> _size{ 0 };
+};
+
+}
@@ -90,6 +90,15 @@
 # define AEGIS_CXX17
 #endif // (__cplusplus >= 201703) || (_MSVC_LANG >= 201703)
 
+// Support for co_await on aegis::future
+#if !defined(AEGIS_HAS_COROUTINES) && !defined(AEGIS_DISABLE_COROUTINES)
+# if defined(__cpp_impl_coroutine) && (__cpp_impl_coroutine >= 201902)
+#  if __has_include(<coroutine>)
+#   define AEGIS_HAS_COROUTINES 1
+#  endif // __has_include(<coroutine>)
+# endif // defined(__cpp_impl_coroutine) && (__cpp_impl_coroutine >= 201902)
+#endif // !defined(AEGIS_HAS_COROUTINES) && !defined(AEGIS_DISABLE_COROUTINES)
+
 // Support for std::optional over built-in
 #if !defined(AEGIS_HAS_STD_OPTIONAL)
 # if (__cplusplus >= 201703)
@@ -17,6 +17,13 @@
 //#include "aegis/ratelimit/ratelimit.hpp"
 //#include "aegis/ratelimit/bucket.hpp"
 #include "aegis/rest/rest_controller.hpp"
+#include "aegis/ratelimit/retry_policy.hpp"
+#include "aegis/scheduler.hpp"
+#include "aegis/handler_pool.hpp"
+#include "aegis/presence_filter.hpp"
+#include "aegis/concurrent_map.hpp"
+#include "aegis/reclaim.hpp"
+#include "aegis/cache_policy.hpp"
 #include "aegis/shards/shard_mgr.hpp"
 #include "aegis/gateway/objects/role.hpp"
 #include "aegis/gateway/objects/member.hpp"
@@ -38,8 +45,10 @@
 #include <spdlog/spdlog.h>
 
 #include <thread>
+#include <atomic>
 #include <condition_variable>
 #include <shared_mutex>
+#include <random>
 
 namespace aegis
 {
@@ -71,7 +80,7 @@ using ratelimit_mgr_t = aegis::ratelimit::ratelimit_mgr;
 struct thread_state
 {
     std::thread thd;
-    bool active = false;
+    std::atomic<bool> active{ false }; /**< Cleared by core::reduce_threads() to end the thread */
     std::chrono::steady_clock::time_point start_time;
     std::function<void(void)> fn;
 };
@@ -107,6 +116,23 @@ struct create_bot_t
     create_bot_t & log_format(const std::string & param) noexcept { _log_format = param; return *this; }
     create_bot_t & io_context(std::shared_ptr<asio::io_context> param) noexcept { _io = param; return *this; }
     create_bot_t & logger(std::shared_ptr<spdlog::logger> param) noexcept { _log = param; return *this; }
+    create_bot_t & retry_policy(const ratelimit::retry_policy & param) noexcept { _retry_policy = param; return *this; }
+    /// Run async() tasks and event handlers (without handler_threads) on a work-stealing scheduler
+    create_bot_t & scheduler_threads(const uint32_t param) noexcept { _scheduler_threads = param; return *this; }
+    create_bot_t & handler_threads(const uint32_t param) noexcept { _handler_threads = param; return *this; }
+    create_bot_t & handler_queue_limit(const uint32_t param) noexcept { _handler_queue_limit = param; return *this; }
+    /// What to do with events while the handler pool is full. caller_runs and block run or park handlers on network threads
+    create_bot_t & handler_overflow(const overflow_policy param) noexcept { _handler_overflow = param; return *this; }
+    create_bot_t & event_queue_limit(const uint32_t param) noexcept { _event_queue_limit = param; return *this; }
+    create_bot_t & event_shed_threshold(const uint32_t param) noexcept { _event_shed_threshold = param; return *this; }
+    create_bot_t & event_queue_hard_limit(const uint32_t param) noexcept { _event_queue_hard_limit = param; return *this; }
+    create_bot_t & presence_dedup_window(const std::chrono::milliseconds param) noexcept { _presence_dedup_window = param; return *this; }
+    create_bot_t & cache(const cache_policy & param) noexcept { _cache_policy = param; return *this; }
+#if !defined(AEGIS_DISABLE_ALL_CACHE)
+    /// Load the caches from this file on run() and save them to it periodically and on shutdown. See aegis::snapshot
+    create_bot_t & snapshot_path(const std::string & param) noexcept { _snapshot_path = param; return *this; }
+    create_bot_t & snapshot_interval(const std::chrono::minutes param) noexcept { _snapshot_interval = param; return *this; }
+#endif
 private:
     friend aegis::core;
     std::string _token;
@@ -117,6 +143,20 @@ private:
     std::string _log_format{ "%^%Y-%m-%d %H:%M:%S.%e [%L] [th#%t]%$ : %v" };
     std::shared_ptr<asio::io_context> _io;
     std::shared_ptr<spdlog::logger> _log;
+    ratelimit::retry_policy _retry_policy;
+    uint32_t _scheduler_threads{ 0 };
+    uint32_t _handler_threads{ 0 };
+    uint32_t _handler_queue_limit{ 4096 };
+    overflow_policy _handler_overflow{ overflow_policy::defer };
+    uint32_t _event_queue_limit{ 10000 };
+    uint32_t _event_shed_threshold{ 1000 };
+    uint32_t _event_queue_hard_limit{ 50000 };
+    std::chrono::milliseconds _presence_dedup_window{ 5000 };
+    cache_policy _cache_policy;
+#if !defined(AEGIS_DISABLE_ALL_CACHE)
+    std::string _snapshot_path;
+    std::chrono::minutes _snapshot_interval{ 5 };
+#endif
 };
 
 /// Primary class for managing a bot interface
@@ -192,6 +232,108 @@ public:
         return *_io_context;
     }
 
+    /// Get the work-stealing scheduler for CPU bound work
+    /**
+     * Only created if create_bot_t::scheduler_threads() was set. When it is, async() tasks run
+     * on it, as do event handlers unless there is a handler pool.
+     * @returns Pointer to the scheduler or nullptr
+     */
+    scheduler * get_scheduler() noexcept
+    {
+        return _scheduler.get();
+    }
+
+    /// Get the pool running user event handlers
+    /**
+     * Only created if create_bot_t::handler_threads() was set. Otherwise handlers run on the
+     * scheduler if there is one, or on the io_context threads.
+     * @returns Pointer to the handler pool or nullptr
+     */
+    handler_pool * get_handler_pool() noexcept
+    {
+        return _handler_pool.get();
+    }
+
+    /// Get the filter suppressing repeated presence updates
+    /**
+     * Not created if create_bot_t::presence_dedup_window() was set to 0
+     * @returns Pointer to the filter or nullptr
+     */
+    presence_filter * get_presence_filter() noexcept
+    {
+        return _presence_filter.get();
+    }
+
+    /// Get the policy deciding what the caches keep
+    /**
+     * @see create_bot_t::cache()
+     * @returns Reference to the cache policy
+     */
+    const cache_policy & get_cache_policy() const noexcept
+    {
+        return _cache_policy;
+    }
+
+    /// Get the reclaimer freeing guilds, channels and users removed from the caches
+    /**
+     * Event processing and handlers are pinned automatically. Code holding pointers from
+     * find_guild(), find_channel() or find_user() outside of an event handler, e.g. in a
+     * timer, pins for as long as it uses them:
+     * @code{.cpp}
+     * auto pin = bot.get_reclaimer().pin();
+     * auto g = bot.find_guild(id);
+     * @endcode
+     * @returns Reference to the reclaimer
+     */
+    epoch_reclaimer & get_reclaimer() noexcept
+    {
+        return _reclaimer;
+    }
+
+    /// Get the cache of recent messages
+    /**
+     * @returns Pointer to the cache or nullptr if cache_policy::messages() is 0
+     */
+    message_cache * get_message_cache() noexcept
+    {
+        return _message_cache.get();
+    }
+
+    /// Set how an event type is queued while a shard's event queue is backed up
+    /**
+     * By default PRESENCE_UPDATE is coalesced per guild and user, TYPING_START is shed and
+     * everything else is kept. Must be called before run()
+     * @see shards::event_policy
+     * @param type Event name, e.g. "GUILD_MEMBER_UPDATE"
+     * @param policy Policy to apply
+     */
+    void set_event_policy(const std::string & type, shards::event_policy policy)
+    {
+        _event_traits[type].policy = policy;
+    }
+
+    /// Set the order in which an event type is processed relative to others on its shard
+    /**
+     * By default message and reaction events are high priority, PRESENCE_UPDATE, TYPING_START
+     * and GUILD_MEMBERS_CHUNK are low and everything else is normal. No event overtakes a
+     * normal priority event of the same guild, and normal events do not overtake low priority
+     * events of their guild. Must be called before run()
+     * @see shards::event_priority
+     * @param type Event name, e.g. "INTERACTION_CREATE"
+     * @param priority Priority to apply
+     */
+    void set_event_priority(const std::string & type, shards::event_priority priority)
+    {
+        _event_traits[type].priority = priority;
+    }
+
+    /// Get the counters of every shard's event queue added together
+    /**
+     * high_water is the highest of the shards
+     * @returns shards::event_queue::stats
+     */
+    AEGIS_DECL shards::event_queue::stats get_event_queue_stats() const;
+
     /// Invokes a shutdown on the entire lib. Sets internal state to `Shutdown` and propagates the
     /// Shutdown state along with closing all websockets within the shard vector
     AEGIS_DECL void shutdown() noexcept;
@@ -468,14 +610,11 @@ public:
         return get_shard_mgr().get_websocket().set_timer(duration, std::move(callback));
     }
 
-    std::unordered_map<snowflake, std::unique_ptr<channel>> channels;
-    std::unordered_map<snowflake, std::unique_ptr<channel>> stale_channels;
-    std::unordered_map<snowflake, std::unique_ptr<guild>> guilds;
-    std::unordered_map<snowflake, std::unique_ptr<guild>> stale_guilds;
 #if !defined(AEGIS_DISABLE_ALL_CACHE)
-    std::unordered_map<snowflake, std::unique_ptr<user>> users;
-    std::unordered_map<snowflake, std::unique_ptr<user>> stale_users;
+    concurrent_map<snowflake, user> users; /**< Declared first so members outlive the guilds referring to them */
 #endif
+    concurrent_map<snowflake, channel> channels;
+    concurrent_map<snowflake, guild> guilds;
     std::map<std::string, uint64_t> message_count;
 
     std::string self_presence;
@@ -701,8 +840,9 @@ public:
      */
     AEGIS_DECL std::size_t add_run_thread() noexcept;
 
-    /// Interrupt and end threads
+    /// End threads started by add_run_thread()
     /**
+     * Each thread stops after the handler it is running, so pending work stays queued
      * @param count Amount of threads to shutdown
      */
     AEGIS_DECL void reduce_threads(std::size_t count) noexcept;
@@ -713,7 +853,8 @@ public:
 
     /// Run async task
     /**
-     * This function will queue your task (a lambda or std::function) within Asio for execution at a later time
+     * This function will queue your task (a lambda or std::function) within Asio for execution at a later time,
+     * or on the scheduler if create_bot_t::scheduler_threads() was set
      * This version will return an aegis::future of your type that the passed function returns that you may
      * chain a continuation onto and receive that value within in
      *
@@ -732,8 +873,10 @@ public:
     template<typename T, typename V = std::result_of_t<T()>, typename = std::enable_if_t<!std::is_void<V>::value>>
     aegis::future<V> async(T f) noexcept
     {
-        std::atomic_thread_fence(std::memory_order_acquire);
-        aegis::promise<V> pr(_io_context.get(), &_global_m);
+        if (_scheduler)
+            return async(_scheduler->get_executor(), std::move(f));
+
+        aegis::promise<V> pr(_io_context.get());
         auto fut = pr.get_future();
 
         asio::post(*_io_context, [pr = std::move(pr), f = std::move(f)]() mutable
@@ -747,13 +890,13 @@ public:
                 pr.set_exception(std::current_exception());
             }
         });
-        std::atomic_thread_fence(std::memory_order_release);
         return fut;
     }
 
     /// Run async task
     /**
-     * This function will queue your task (a lambda or std::function) within Asio for execution at a later time
+     * This function will queue your task (a lambda or std::function) within Asio for execution at a later time,
+     * or on the scheduler if create_bot_t::scheduler_threads() was set
      * This version will return an aegis::future<void> that will still allow chaining continuations on
      *
      * Example:
@@ -771,8 +914,10 @@ public:
     template<typename T, typename V = std::enable_if_t<std::is_void<std::result_of_t<T()>>::value>>
     aegis::future<V> async(T f) noexcept
     {
-        std::atomic_thread_fence(std::memory_order_acquire);
-        aegis::promise<V> pr(_io_context.get(), &_global_m);
+        if (_scheduler)
+            return async(_scheduler->get_executor(), std::move(f));
+
+        aegis::promise<V> pr(_io_context.get());
         auto fut = pr.get_future();
 
         asio::post(*_io_context, [pr = std::move(pr), f = std::move(f)]() mutable
@@ -787,70 +932,124 @@ public:
                 pr.set_exception(std::current_exception());
             }
         });
-        std::atomic_thread_fence(std::memory_order_release);
         return fut;
     }
 
-    /// Get the internal guild mutex
-    shared_mutex & get_guild_mutex() { return _guild_m; }
-
-    /// Get the internal channel mutex
-    shared_mutex & get_channel_mutex() { return _channel_m; }
-
-    /// Get the internal user mutex
-    shared_mutex & get_user_mutex() { return _user_m; }
-
-    /// Get the guild map
+    /// Run async task on an executor
     /**
-     * This will return the internal unordered_map of all the guilds currently tracked. Does not
-     * include stale items. You MUST lock the appropriate mutex BEFORE accessing it to prevent
-     * potential race conditions and possible crashes.
-     * 
+     * Like async() but runs the task on the given executor instead of the io_context.
+     * Continuations chained onto the returned future without an executor run on the executor
+     * too, unless the task already finished when they are chained, in which case they run on
+     * the calling thread. Chain with then(ex, func) to always stay on the executor.
+     *
      * Example:
      * @code{.cpp}
-     * std::shared_lock<aegis::shared_mutex> l(get_guild_mutex());
+     * auto strand = asio::make_strand(bot.get_io_context());
+     * async(strand, []{
+     *     return 5;
+     * }).then(strand, [](int value){
+     *     // on strand
+     * });
      * @endcode
-     * 
-     * @returns std::unordered_map<snowflake, std::unique_ptr<guild>>
+     *
+     * @param ex Executor to run the task on. An asio executor (strand, io_context executor) or
+     * an aegis executor such as aegis::inline_executor
+     * @param f Function to run async
+     * @returns aegis::future<V>
      */
-    std::unordered_map<snowflake, std::unique_ptr<guild>> & get_guild_map() { return guilds; };
+    template<typename Executor, typename T, typename V = std::result_of_t<T()>>
+    aegis::future<V> async(const Executor & ex, T f) noexcept
+    {
+        aegis::promise<V> pr(nullptr);
+        auto fut = pr.get_future();
 
-    /// Get the channel map
+        aegis::detail::execute(ex, [pr = std::move(pr), f = std::move(f)]() mutable
+        {
+            aegis::detail::call_function<V>(std::is_void<V>{}, std::move(f)).forward_to(std::move(pr));
+        });
+        return fut;
+    }
+
+    /// Get the guild map
     /**
-     * This will return the internal unordered_map of all the channels currently tracked. Does not
-     * include stale items. You MUST lock the appropriate mutex BEFORE accessing it to prevent
-     * potential race conditions and possible crashes.
+     * This will return the internal map of all the guilds currently tracked. Does not include
+     * removed items. The map locks internally.
      *
      * Example:
      * @code{.cpp}
-     * std::shared_lock<aegis::shared_mutex> l(get_channel_mutex());
+     * bot.get_guild_map().for_each([](snowflake id, aegis::guild & g) { ... });
      * @endcode
      *
-     * @returns std::unordered_map<snowflake, std::unique_ptr<channel>>
+     * @returns concurrent_map<snowflake, guild>
      */
-    std::unordered_map<snowflake, std::unique_ptr<channel>> & get_channel_map() { return channels; };
+    concurrent_map<snowflake, guild> & get_guild_map() { return guilds; };
+
+    /// Get the channel map
+    /**
+     * This will return the internal map of all the channels currently tracked. Does not
+     * include removed items. The map locks internally.
+     *
+     * @returns concurrent_map<snowflake, channel>
+     */
+    concurrent_map<snowflake, channel> & get_channel_map() { return channels; };
 
 #if !defined(AEGIS_DISABLE_ALL_CACHE)
     /// Get the user map
     /**
-     * This will return the internal unordered_map of all the users currently tracked. Does not
-     * include stale items. You MUST lock the appropriate mutex BEFORE accessing it to prevent
-     * potential race conditions and possible crashes.
-     *
-     * Example:
-     * @code{.cpp}
-     * std::shared_lock<aegis::shared_mutex> l(get_user_mutex());
-     * @endcode
+     * This will return the internal map of all the users currently tracked. Does not include
+     * removed items. The map locks internally.
      *
-     * @returns std::unordered_map<snowflake, std::unique_ptr<user>>
+     * @returns concurrent_map<snowflake, user>
      */
-    std::unordered_map<snowflake, std::unique_ptr<user>> & get_user_map() { return users; };
+    concurrent_map<snowflake, user> & get_user_map() { return users; };
 #endif
 
 private:
 
     AEGIS_DECL void _thread_track(thread_state * t_state);
 
+    /// Post a handler ending the run thread that picks it up
+    AEGIS_DECL void _post_thread_stop();
+
+    /// Run thread of the calling thread, if any
+    static thread_state *& _current_thread() noexcept
+    {
+        static thread_local thread_state * t = nullptr;
+        return t;
+    }
+
+    /// Invoke a user event handler, on the handler pool or else the scheduler if there is one
+    template<typename Callback, typename Event>
+    void _dispatch(const Callback & cb, Event && obj)
+    {
+        if (!cb)
+            return;
+        if (!_handler_pool && !_scheduler)
+        {
+            cb(std::forward<Event>(obj));
+            return;
+        }
+        auto task = [this, &cb, obj = std::forward<Event>(obj), pin = _reclaimer.pin()]() mutable
+        {
+            try
+            {
+                cb(std::move(obj));
+            }
+            catch (std::exception & e)
+            {
+                log->error("Event handler exception: {}", e.what());
+            }
+            catch (...)
+            {
+                log->error("Event handler exception: Unknown error");
+            }
+        };
+        if (_handler_pool)
+            _handler_pool->post(std::move(task));
+        else
+            _scheduler->post(std::move(task));
+    }
+
     typing_start_t i_typing_start;
     message_create_t i_message_create;
     message_create_t i_message_create_dm;
@@ -896,6 +1095,7 @@ private:
 
     friend class guild;
     friend class channel;
+    friend class snapshot;
     //friend class shard;
 
     AEGIS_DECL void ws_presence_update(const json & result, shards::shard * _shard);
@@ -933,6 +1133,33 @@ private:
     AEGIS_DECL void ws_webhooks_update(const json & result, shards::shard * _shard);
 
     AEGIS_DECL void on_message(websocketpp::connection_hdl hdl, std::string msg, shards::shard * _shard);
+#if !defined(AEGIS_DISABLE_ALL_CACHE)
+    /// Evict a bounded amount of users per the cache policy
+    /**
+     * Samples the user cache rather than walking it, so a pass costs the same however many users
+     * are cached. Expired users in a sample are evicted and, while over the user limit, so is
+     * the least recently seen one. Passes run every second off the event drain.
+     */
+    AEGIS_DECL void _evict_users();
+
+    /// Arm the timer of the next eviction pass
+    AEGIS_DECL void _schedule_eviction();
+
+    /// Cancel the eviction timer
+    AEGIS_DECL void _stop_eviction() noexcept;
+
+    /// Save the cache snapshot, logging instead of throwing
+    AEGIS_DECL void _save_snapshot() noexcept;
+
+    /// Start the thread saving periodic snapshots, so they never hold up an io thread
+    AEGIS_DECL void _start_snapshot_thread();
+
+    /// Stop the periodic snapshot thread and wait for it
+    AEGIS_DECL void _stop_snapshot_thread() noexcept;
+#endif
+
+    AEGIS_DECL void _drain_events(shards::shard * _shard);
+    AEGIS_DECL void _process_event(const std::string & cmd, const json & res, shards::shard * _shard);
     AEGIS_DECL void on_connect(websocketpp::connection_hdl hdl, shards::shard * _shard);
     AEGIS_DECL void on_close(websocketpp::connection_hdl hdl, shards::shard * _shard);
     AEGIS_DECL void process_ready(const json & d, shards::shard * _shard);
@@ -941,8 +1168,6 @@ private:
 
     AEGIS_DECL void remove_guild(snowflake guild_id) noexcept;
     AEGIS_DECL void remove_channel(snowflake channel_id) noexcept;
-    AEGIS_DECL void remove_guild_nolock(snowflake guild_id) noexcept;
-    AEGIS_DECL void remove_channel_nolock(snowflake channel_id) noexcept;
 
     AEGIS_DECL void remove_member(snowflake member_id) noexcept;
 
@@ -965,11 +1190,23 @@ private:
     user * _self = nullptr;
 
     std::unordered_map<std::string, std::function<void(const json &, shards::shard *)>> ws_handlers;
+    std::unordered_map<std::string, shards::event_traits> _event_traits{
+        { "MESSAGE_CREATE", { shards::event_policy::keep, shards::event_priority::high } },
+        { "MESSAGE_UPDATE", { shards::event_policy::keep, shards::event_priority::high } },
+        { "MESSAGE_DELETE", { shards::event_policy::keep, shards::event_priority::high } },
+        { "MESSAGE_REACTION_ADD", { shards::event_policy::keep, shards::event_priority::high } },
+        { "MESSAGE_REACTION_REMOVE", { shards::event_policy::keep, shards::event_priority::high } },
+        { "PRESENCE_UPDATE", { shards::event_policy::coalesce, shards::event_priority::low } },
+        { "TYPING_START", { shards::event_policy::shed, shards::event_priority::low } },
+        { "GUILD_MEMBERS_CHUNK", { shards::event_policy::keep, shards::event_priority::low } }
+    };
+    std::size_t _event_queue_limit = 10000;
+    std::size_t _event_shed_threshold = 1000;
+    std::size_t _event_queue_hard_limit = 50000;
     spdlog::level::level_enum _loglevel = spdlog::level::level_enum::info;
+
+    ratelimit::retry_policy _retry_policy;
     mutable shared_mutex _shard_m;
-    mutable shared_mutex _guild_m;
-    mutable shared_mutex _channel_m;
-    mutable shared_mutex _user_m;
 
     bool file_logging = false;
     bool external_io_context = true;
@@ -980,11 +1217,29 @@ private:
 
     std::shared_ptr<asio::io_context> _io_context = nullptr;
     work_ptr wrk = nullptr;
+    epoch_reclaimer _reclaimer; /**< Before the pools so queued handlers can still unpin */
+    std::unique_ptr<scheduler> _scheduler;
+    std::unique_ptr<handler_pool> _handler_pool;
+    std::unique_ptr<presence_filter> _presence_filter;
+    cache_policy _cache_policy;
+    std::unique_ptr<asio::steady_timer> _eviction_timer;
+    std::mutex _eviction_m; /**< Guards _eviction_timer, which is armed from its own handler */
+    std::mt19937_64 _eviction_rng; /**< Only used by the eviction pass */
+    std::unique_ptr<message_cache> _message_cache;
+#if !defined(AEGIS_DISABLE_ALL_CACHE)
+    std::string _snapshot_path;
+    std::chrono::minutes _snapshot_interval{ 5 };
+    std::thread _snapshot_thread;
+    std::mutex _snapshot_m; /**< Serializes periodic and shutdown snapshots */
+    std::mutex _snapshot_wait_m;
+    std::condition_variable _snapshot_cv;
+    bool _snapshot_stop = false; /**< Guarded by _snapshot_wait_m */
+#endif
     std::condition_variable cv;
     std::chrono::hours _tz_bias = 0h;
+    std::atomic<std::size_t> _run_threads{ 0 }; /**< Threads of add_run_thread() still running */
 public:
     std::vector<std::unique_ptr<thread_state>> threads;
-    std::recursive_mutex _global_m;
 };
 
 }
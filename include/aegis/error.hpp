@@ -82,6 +82,21 @@ enum error
     /// Provided too many or too few messages for message bulk delete
     bulk_delete_out_of_range,
 
+    /// REST request did not complete before its deadline
+    request_timeout,
+
+    /// REST request was cancelled
+    request_cancelled,
+
+    /// Cache snapshot could not be read or written
+    snapshot_error,
+
+    /// Promise was destroyed without a result
+    broken_promise,
+
+    /// Future has no state, it was default constructed or already consumed
+    no_state,
+
     max_errors
 };
 
@@ -139,6 +154,16 @@ public:
                 return "Bad Redis request";
             case error::bulk_delete_out_of_range:
                 return "Bulk delete invalid message amount";
+            case error::request_timeout:
+                return "Request timed out";
+            case error::request_cancelled:
+                return "Request cancelled";
+            case error::snapshot_error:
+                return "Cache snapshot error";
+            case error::broken_promise:
+                return "Broken promise";
+            case error::no_state:
+                return "Future has no state";
             default:
                 return "Unknown";
         }
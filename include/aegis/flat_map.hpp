@@ -0,0 +1,408 @@
+//
+// flat_map.hpp
+// ************
+//
+// Copyright (c) 2019 Sharon W (sharon at aegis dot gg)
+//
+// Distributed under the MIT License. (See accompanying file LICENSE)
+//
+
+#pragma once
+
+#include "aegis/config.hpp"
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+namespace aegis
+{
+
+/// Open addressing hash map
+/**
+ * Entries are stored inline in one array with linear probing and backward shift deletion, so
+ * there is one allocation per table instead of one per entry and a lookup touches adjacent
+ * memory. The hash is used as is to pick the slot, so it has to mix all bits. std::hash of
+ * snowflake does.
+ *
+ * Interface follows std::unordered_map for the parts aegis uses. Differences:
+ * - any insertion may invalidate all iterators, references and pointers to entries
+ * - erase() may move other entries, invalidating iterators except the one returned
+ */
+template<typename Key, typename T, typename Hash = std::hash<Key>, typename KeyEqual = std::equal_to<Key>>
+class flat_map
+{
+public:
+    using key_type = Key;
+    using mapped_type = T;
+    using value_type = std::pair<const Key, T>;
+    using size_type = std::size_t;
+    using hasher = Hash;
+    using key_equal = KeyEqual;
+
+private:
+    template<bool Const>
+    class iter
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = typename flat_map::value_type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = std::conditional_t<Const, const value_type *, value_type *>;
+        using reference = std::conditional_t<Const, const value_type &, value_type &>;
+        using map_pointer = std::conditional_t<Const, const flat_map *, flat_map *>;
+
+        iter() noexcept = default;
+        iter(map_pointer map, size_type index) noexcept
+            : _map(map)
+            , _index(index)
+        {
+        }
+
+        template<bool C = Const, typename = std::enable_if_t<C>>
+        iter(const iter<false> & other) noexcept
+            : _map(other._map)
+            , _index(other._index)
+        {
+        }
+
+        reference operator*() const noexcept { return *_map->_slot(_index); }
+        pointer operator->() const noexcept { return _map->_slot(_index); }
+
+        iter & operator++() noexcept
+        {
+            _index = _map->_next_full(_index + 1);
+            return *this;
+        }
+
+        iter operator++(int) noexcept
+        {
+            auto res = *this;
+            ++*this;
+            return res;
+        }
+
+        bool operator==(const iter & other) const noexcept { return _index == other._index; }
+        bool operator!=(const iter & other) const noexcept { return _index != other._index; }
+
+    private:
+        friend class flat_map;
+        template<bool> friend class iter;
+
+        map_pointer _map = nullptr;
+        size_type _index = 0;
+    };
+
+public:
+    using iterator = iter<false>;
+    using const_iterator = iter<true>;
+
+    flat_map() noexcept = default;
+
+    flat_map(const flat_map & other)
+        : _hash(other._hash)
+        , _equal(other._equal)
+    {
+        if (other._size == 0)
+            return;
+        _allocate(other._capacity);
+        for (size_type i = 0; i < other._capacity; ++i)
+            if (other._used[i])
+            {
+                new (_slot(i)) value_type(*other._slot(i));
+                _used[i] = 1;
+            }
+        _size = other._size;
+    }
+
+    flat_map(flat_map && other) noexcept
+    {
+        _swap(other);
+    }
+
+    flat_map & operator=(const flat_map & other)
+    {
+        if (this != &other)
+        {
+            flat_map tmp(other);
+            _swap(tmp);
+        }
+        return *this;
+    }
+
+    flat_map & operator=(flat_map && other) noexcept
+    {
+        if (this != &other)
+        {
+            _destroy();
+            _swap(other);
+        }
+        return *this;
+    }
+
+    ~flat_map()
+    {
+        _destroy();
+    }
+
+    iterator begin() noexcept { return iterator(this, _next_full(0)); }
+    iterator end() noexcept { return iterator(this, _capacity); }
+    const_iterator begin() const noexcept { return const_iterator(this, _next_full(0)); }
+    const_iterator end() const noexcept { return const_iterator(this, _capacity); }
+    const_iterator cbegin() const noexcept { return begin(); }
+    const_iterator cend() const noexcept { return end(); }
+
+    size_type size() const noexcept { return _size; }
+    bool empty() const noexcept { return _size == 0; }
+    size_type bucket_count() const noexcept { return _capacity; }
+
+    /// Get the first entry at or after a bucket, wrapping around
+    /**
+     * Lets callers pick entries at random. Entries that follow empty buckets are more likely
+     * @param n Bucket, reduced modulo bucket_count()
+     * @returns end() if the map is empty
+     */
+    const_iterator from_bucket(size_type n) const noexcept
+    {
+        if (_size == 0)
+            return end();
+        auto i = _next_full(n & (_capacity - 1));
+        return const_iterator(this, (i == _capacity) ? _next_full(0) : i);
+    }
+
+    iterator find(const Key & key) noexcept
+    {
+        return iterator(this, _find(key));
+    }
+
+    const_iterator find(const Key & key) const noexcept
+    {
+        return const_iterator(this, _find(key));
+    }
+
+    size_type count(const Key & key) const noexcept
+    {
+        return _find(key) != _capacity ? 1 : 0;
+    }
+
+    T & at(const Key & key)
+    {
+        auto i = _find(key);
+        if (i == _capacity)
+            throw std::out_of_range("flat_map::at");
+        return _slot(i)->second;
+    }
+
+    const T & at(const Key & key) const
+    {
+        auto i = _find(key);
+        if (i == _capacity)
+            throw std::out_of_range("flat_map::at");
+        return _slot(i)->second;
+    }
+
+    T & operator[](const Key & key)
+    {
+        return try_emplace(key).first->second;
+    }
+
+    /// Insert if the key is missing. Value arguments are only used when inserting
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(const Key & key, Args &&... args)
+    {
+        auto found = _find(key);
+        if (found != _capacity)
+            return { iterator(this, found), false };
+        _reserve_one();
+        auto i = _index(key);
+        while (_used[i])
+            i = (i + 1) & (_capacity - 1);
+        new (_slot(i)) value_type(std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple(std::forward<Args>(args)...));
+        _used[i] = 1;
+        ++_size;
+        return { iterator(this, i), true };
+    }
+
+    template<typename K, typename... Args>
+    std::pair<iterator, bool> emplace(K && key, Args &&... args)
+    {
+        return try_emplace(Key(std::forward<K>(key)), std::forward<Args>(args)...);
+    }
+
+    std::pair<iterator, bool> insert(const value_type & value)
+    {
+        return try_emplace(value.first, value.second);
+    }
+
+    std::pair<iterator, bool> insert(value_type && value)
+    {
+        return try_emplace(value.first, std::move(value.second));
+    }
+
+    size_type erase(const Key & key)
+    {
+        auto i = _find(key);
+        if (i == _capacity)
+            return 0;
+        _erase(i);
+        return 1;
+    }
+
+    /// Erase an entry
+    /**
+     * @returns Iterator to the entry now at the erased position, or the next one
+     */
+    iterator erase(const_iterator pos)
+    {
+        auto i = pos._index;
+        _erase(i);
+        return iterator(this, _next_full(i));
+    }
+
+    void clear() noexcept
+    {
+        for (size_type i = 0; i < _capacity; ++i)
+            if (_used[i])
+            {
+                _slot(i)->~value_type();
+                _used[i] = 0;
+            }
+        _size = 0;
+    }
+
+    void reserve(size_type count)
+    {
+        size_type cap = 8;
+        while (cap - cap / 4 < count)
+            cap *= 2;
+        if (cap > _capacity)
+            _rehash(cap);
+    }
+
+private:
+    using storage = std::aligned_storage_t<sizeof(value_type), alignof(value_type)>;
+
+    value_type * _slot(size_type i) const noexcept
+    {
+        return reinterpret_cast<value_type *>(const_cast<storage *>(&_slots[i]));
+    }
+
+    size_type _index(const Key & key) const noexcept
+    {
+        return static_cast<size_type>(_hash(key)) & (_capacity - 1);
+    }
+
+    size_type _next_full(size_type i) const noexcept
+    {
+        while (i < _capacity && !_used[i])
+            ++i;
+        return i;
+    }
+
+    size_type _find(const Key & key) const noexcept
+    {
+        if (_size == 0)
+            return _capacity;
+        auto i = _index(key);
+        while (_used[i])
+        {
+            if (_equal(_slot(i)->first, key))
+                return i;
+            i = (i + 1) & (_capacity - 1);
+        }
+        return _capacity;
+    }
+
+    void _erase(size_type i)
+    {
+        _slot(i)->~value_type();
+        _used[i] = 0;
+        --_size;
+
+        // shift back later entries of the run that can move closer to their home slot
+        const auto mask = _capacity - 1;
+        auto hole = i;
+        auto j = (i + 1) & mask;
+        while (_used[j])
+        {
+            auto home = _index(_slot(j)->first);
+            if (((j - home) & mask) >= ((j - hole) & mask))
+            {
+                new (_slot(hole)) value_type(std::move(*_slot(j)));
+                _used[hole] = 1;
+                _slot(j)->~value_type();
+                _used[j] = 0;
+                hole = j;
+            }
+            j = (j + 1) & mask;
+        }
+    }
+
+    void _reserve_one()
+    {
+        if (_capacity == 0)
+            _rehash(8);
+        else if (_size + 1 > _capacity - _capacity / 4)
+            _rehash(_capacity * 2);
+    }
+
+    void _allocate(size_type cap)
+    {
+        _slots = std::make_unique<storage[]>(cap);
+        _used = std::make_unique<uint8_t[]>(cap);
+        _capacity = cap;
+    }
+
+    void _rehash(size_type cap)
+    {
+        auto old_slots = std::move(_slots);
+        auto old_used = std::move(_used);
+        auto old_cap = _capacity;
+
+        _allocate(cap);
+        for (size_type i = 0; i < old_cap; ++i)
+        {
+            if (!old_used[i])
+                continue;
+            auto & v = *reinterpret_cast<value_type *>(&old_slots[i]);
+            auto j = _index(v.first);
+            while (_used[j])
+                j = (j + 1) & (_capacity - 1);
+            new (_slot(j)) value_type(std::move(v));
+            _used[j] = 1;
+            v.~value_type();
+        }
+    }
+
+    void _destroy() noexcept
+    {
+        clear();
+        _slots.reset();
+        _used.reset();
+        _capacity = 0;
+    }
+
+    void _swap(flat_map & other) noexcept
+    {
+        std::swap(_slots, other._slots);
+        std::swap(_used, other._used);
+        std::swap(_capacity, other._capacity);
+        std::swap(_size, other._size);
+        std::swap(_hash, other._hash);
+        std::swap(_equal, other._equal);
+    }
+
+    std::unique_ptr<storage[]> _slots;
+    std::unique_ptr<uint8_t[]> _used;
+    size_type _capacity = 0;
+    size_type _size = 0;
+    Hash _hash;
+    KeyEqual _equal;
+};
+
+}
@@ -5,7 +5,7 @@
 // Copyright (c) 2019 Sharon W (sharon at aegis dot gg)
 //
 // Distributed under the MIT License. (See accompanying file LICENSE)
-// 
+//
 // Adapted from https://github.com/scylladb/seastar to support asio scheduling
 
 #pragma once
@@ -21,12 +21,20 @@
 #include <cassert>
 #include <chrono>
 #include <thread>
-#include <iostream>
+#include <atomic>
 #include <mutex>
+#include <tuple>
+#include <vector>
+#include <iterator>
+#include <cstddef>
+#include <new>
 #include <asio/io_context.hpp>
 #include <asio/post.hpp>
 #include <asio/bind_executor.hpp>
 #include <asio/executor_work_guard.hpp>
+#if defined(AEGIS_HAS_COROUTINES)
+# include <coroutine>
+#endif
 
 using namespace std::literals::chrono_literals;
 
@@ -34,6 +42,19 @@ using namespace std::literals::chrono_literals;
 namespace aegis
 {
 
+/// Interface for an operation backing a future that can be cancelled
+class cancellation
+{
+public:
+    virtual ~cancellation() = default;
+
+    /// Request cancellation of the operation
+    /**
+     * @returns true if the operation was cancelled before it completed
+     */
+    virtual bool cancel() noexcept = 0;
+};
+
 template <class T>
 class promise;
 
@@ -82,6 +103,62 @@ struct is_future : std::false_type {};
 template<typename T>
 struct is_future<future<T>> : std::true_type {};
 
+namespace detail
+{
+template<typename... T>
+struct make_void
+{
+    using type = void;
+};
+
+template<typename... T>
+using void_t = typename make_void<T...>::type;
+}
+
+/// Check if a type is an executor implemented by aegis or a user
+/**
+ * Other executors are expected to meet the asio executor requirements (io_context executors,
+ * strands) and receive work through asio::post. An aegis executor declares an
+ * aegis_executor_tag type and a post(Func) member.
+ */
+template<typename Executor, typename = void>
+struct is_aegis_executor : std::false_type {};
+
+template<typename Executor>
+struct is_aegis_executor<Executor, detail::void_t<typename Executor::aegis_executor_tag>> : std::true_type {};
+
+/// Executor that runs work immediately in the calling thread
+/**
+ * For cheap continuations that are not worth a round trip through a scheduler
+ */
+struct inline_executor
+{
+    using aegis_executor_tag = void;
+
+    template<typename Func>
+    void post(Func && func) const
+    {
+        func();
+    }
+};
+
+namespace detail
+{
+/// Run work on an aegis executor
+template<typename Executor, typename Func>
+inline std::enable_if_t<is_aegis_executor<Executor>::value> execute(const Executor & ex, Func && func)
+{
+    ex.post(std::forward<Func>(func));
+}
+
+/// Run work on an asio executor
+template<typename Executor, typename Func>
+inline std::enable_if_t<!is_aegis_executor<Executor>::value> execute(const Executor & ex, Func && func)
+{
+    asio::post(ex, std::forward<Func>(func));
+}
+}
+
 template<typename F, typename... A>
 struct result_of : std::result_of<F(A...)> {};
 
@@ -110,9 +187,15 @@ add_future_t<T> call_state(Func&& func, State&& state);
 /// call_future<T, Func, Future>
 template<typename T, typename Func, typename Future>
 add_future_t<T> call_future(Func&& func, Future&& fut) noexcept;
+
+struct future_access;
 }
 
 /// future_state<T>
+/**
+ * Holds the value or exception of a future. Not synchronized on its own; access is
+ * ordered by the state word of the shared state that owns it.
+ */
 template <typename T>
 struct future_state
 {
@@ -126,14 +209,14 @@ struct future_state
                   "std::exception_ptr's copy constructor must not throw");
     static_assert(std::is_nothrow_move_constructible<std::exception_ptr>::value,
                   "std::exception_ptr's move constructor must not throw");
-    enum class state
+    enum class state : uint8_t
     {
         invalid,
         future,
         result,
         exception,
-    };// _state = state::future;
-    std::atomic<state> _state;
+    };
+    state _state = state::future;
     union any
     {
         any() {}
@@ -141,26 +224,12 @@ struct future_state
         T value;
         std::exception_ptr ex;
     } _u;
-    asio::io_context * _io_context = nullptr;
-    std::recursive_mutex * _global_m = nullptr;
     future_state() noexcept {}
-    future_state(asio::io_context * _io_context, std::recursive_mutex * _global_m) noexcept 
-        : _state(state::future)
-        , _io_context(_io_context)
-        , _global_m(_global_m)
-    {}
     future_state(future_state&& x) noexcept
-        : _state(state::future)
-        , _io_context(x._io_context)
-        , _global_m(x._global_m)
-    {
-        std::atomic_thread_fence(std::memory_order_acquire);
-        state _x = x._state.load(std::memory_order_acquire);
-        state _s = _state.load(std::memory_order_acquire);
-        switch (_x)
+        : _state(x._state)
+    {
+        switch (_state)
         {
-            case state::future:
-                break;
             case state::result:
                 new (&_u.value) T(std::move(x._u.value));
                 x._u.value.~T();
@@ -169,24 +238,15 @@ struct future_state
                 new (&_u.ex) std::exception_ptr(std::move(x._u.ex));
                 x._u.ex.~exception_ptr();
                 break;
-            case state::invalid:
-                break;
             default:
-                abort();
+                break;
         }
-        _state.store(_x, std::memory_order_release);
-        x._state.store(state::invalid, std::memory_order_release);
-        std::atomic_thread_fence(std::memory_order_release);
+        x._state = state::invalid;
     }
     ~future_state() noexcept
     {
-        std::atomic_thread_fence(std::memory_order_acquire);
         switch (_state)
         {
-            case state::invalid:
-                break;
-            case state::future:
-                break;
             case state::result:
                 _u.value.~T();
                 break;
@@ -194,83 +254,55 @@ struct future_state
                 _u.ex.~exception_ptr();
                 break;
             default:
-                abort();
+                break;
         }
-        std::atomic_thread_fence(std::memory_order_release);
     }
     future_state& operator=(future_state&& x) noexcept
     {
-        std::atomic_thread_fence(std::memory_order_acquire);
-        state _s = _state.load(std::memory_order_consume);
         if (this != &x)
         {
             this->~future_state();
             new (this) future_state(std::move(x));
         }
-        std::atomic_thread_fence(std::memory_order_release);
         return *this;
     }
     bool available() const noexcept
     {
-        std::atomic_thread_fence(std::memory_order_acquire);
-        auto _s = _state.load(std::memory_order_consume);
-        std::atomic_thread_fence(std::memory_order_release);
-        return _s == state::result || _s == state::exception;
+        return _state == state::result || _state == state::exception;
     }
     bool failed() const noexcept
     {
         return _state == state::exception;
     }
-    void wait();
-    void set(const T& value) noexcept
-    {
-        state _s = _state.load(std::memory_order_acquire);
-        assert(_s == state::future);
-        new (&_u.value) T(value);
-        _state.store(state::result, std::memory_order_release);
-    }
-    void set(T&& value) noexcept
-    {
-        state _s = _state.load(std::memory_order_acquire);
-        assert(_s == state::future);
-        new (&_u.value) T(std::move(value));
-        _state.store(state::result, std::memory_order_release);
-    }
     template <typename... A>
     void set(A&&... a)
     {
-        state _s = _state.load(std::memory_order_acquire);
-        assert(_s == state::future);
+        assert(_state == state::future);
         new (&_u.value) T(std::forward<A>(a)...);
-        _state.store(state::result, std::memory_order_release);
+        _state = state::result;
     }
     void set_exception(std::exception_ptr ex) noexcept
     {
-        state _s = _state.load(std::memory_order_acquire);
-        assert(_s == state::future);
-        new (&_u.ex) std::exception_ptr(ex);
-        _state.store(state::exception, std::memory_order_release);
+        assert(_state == state::future);
+        new (&_u.ex) std::exception_ptr(std::move(ex));
+        _state = state::exception;
     }
     std::exception_ptr get_exception() && noexcept
     {
-        state _s = _state.load(std::memory_order_acquire);
-        assert(_s == state::exception);
+        assert(_state == state::exception);
         auto ex = std::move(_u.ex);
         _u.ex.~exception_ptr();
-        _state.store(state::invalid, std::memory_order_release);
+        _state = state::invalid;
         return ex;
     }
     std::exception_ptr get_exception() const& noexcept
     {
-        state _s = _state.load(std::memory_order_consume);
-        assert(_s == state::exception);
+        assert(_state == state::exception);
         return _u.ex;
     }
-    auto get_value() && noexcept
+    T get_value() && noexcept
     {
-        state _s = _state.load(std::memory_order_acquire);
-        assert(_s == state::result);
-        _state.store(_s, std::memory_order_release);
+        assert(_state == state::result);
         return std::move(_u.value);
     }
     template<typename U = T>
@@ -281,50 +313,36 @@ struct future_state
     }
     T get() &&
     {
-        auto _s = _state.load(std::memory_order_acquire);
-        assert(_s != state::future);
-        if (_s == state::exception)
+        assert(available());
+        if (_state == state::exception)
         {
             auto ex = std::move(_u.ex);
             _u.ex.~exception_ptr();
-            _state.store(state::invalid, std::memory_order_release);
+            _state = state::invalid;
             std::rethrow_exception(std::move(ex));
         }
-        _state.store(_s, std::memory_order_release);
         return std::move(_u.value);
     }
     T get() const&
     {
-        state _s = _state.load(std::memory_order_consume);
-        assert(_s != state::future);
-        if (_s == state::exception)
-        {
+        assert(available());
+        if (_state == state::exception)
             std::rethrow_exception(_u.ex);
-        }
         return _u.value;
     }
     void ignore() noexcept
     {
-        state _s = _state.load(std::memory_order_acquire);
-        assert(_s != state::future);
         this->~future_state();
-        _state.store(state::invalid, std::memory_order_release);
+        _state = state::invalid;
     }
     void forward_to(promise<T>& pr) noexcept
     {
-        state _s = _state.load(std::memory_order_acquire);
-        assert(_s != state::future);
-        if (_s == state::exception)
-        {
-            pr.set_urgent_exception(std::move(_u.ex));
-            _u.ex.~exception_ptr();
-        }
+        assert(available());
+        if (_state == state::exception)
+            pr.set_exception(std::move(*this).get_exception());
         else
-        {
-            pr.set_urgent_value(std::move(_u.value));
-            _u.value.~T();
-        }
-        _state.store(state::invalid, std::memory_order_release);
+            pr.set_value(std::move(*this).get_value());
+        ignore();
     }
 };
 
@@ -338,643 +356,710 @@ struct future_state<void>
     static_assert(std::is_nothrow_move_constructible<std::exception_ptr>::value,
                   "std::exception_ptr's move constructor must not throw");
     static constexpr bool copy_noexcept = true;
-    enum class state : uintptr_t
+    enum class state : uint8_t
     {
-        invalid = 0,
-        future = 1,
-        result = 2,
-        exception_min = 3
+        invalid,
+        future,
+        result,
+        exception
     };
-    union any
-    {
-        any() { st = state::future; }
-        ~any() {}
-        std::atomic<state> st;
-        std::exception_ptr ex;
-    } _u;
-    std::recursive_mutex _m;
-    asio::io_context * _io_context = nullptr;
-    std::recursive_mutex * _global_m = nullptr;
+    state _state = state::future;
+    std::exception_ptr _ex;
     future_state() noexcept {}
-    future_state(asio::io_context * _io_context, std::recursive_mutex * _global_m) noexcept 
-        : _io_context(_io_context)
-        , _global_m(_global_m)
-    {}    future_state(future_state&& x) noexcept
-    {
-        std::atomic_thread_fence(std::memory_order_acquire);
-        if (x._u.st < state::exception_min)
-        {
-            _u.st.store(x._u.st);
-        }
-        else
-        {
-            new (&_u.ex) std::exception_ptr(std::move(x._u.ex));
-            x._u.ex.~exception_ptr();
-        }
-        x._u.st.store(state::invalid);
-        std::atomic_thread_fence(std::memory_order_release);
-    }
-    ~future_state() noexcept
+    future_state(future_state&& x) noexcept
+        : _state(x._state)
+        , _ex(std::move(x._ex))
     {
-        if (_u.st >= state::exception_min)
-        {
-            _u.ex.~exception_ptr();
-        }
+        x._state = state::invalid;
     }
     future_state& operator=(future_state&& x) noexcept
     {
-        std::atomic_thread_fence(std::memory_order_acquire);
         if (this != &x)
         {
-            this->~future_state();
-            new (this) future_state(std::move(x));
+            _state = x._state;
+            _ex = std::move(x._ex);
+            x._state = state::invalid;
         }
-        std::atomic_thread_fence(std::memory_order_release);
         return *this;
     }
     bool available() const noexcept
     {
-        return _u.st == state::result || _u.st >= state::exception_min;
+        return _state == state::result || _state == state::exception;
     }
     bool failed() const noexcept
     {
-        return _u.st >= state::exception_min;
+        return _state == state::exception;
     }
     void set()
     {
-        assert(_u.st == state::future);
-        _u.st.store(state::result, std::memory_order_release);
+        assert(_state == state::future);
+        _state = state::result;
     }
     void set_exception(std::exception_ptr ex) noexcept
     {
-        assert(_u.st == state::future);
-        new (&_u.ex) std::exception_ptr(ex);
-        assert(_u.st >= state::exception_min);
+        assert(_state == state::future);
+        _ex = std::move(ex);
+        _state = state::exception;
     }
     void get() &&
     {
-        assert(_u.st != state::future);
-        if (_u.st >= state::exception_min)
+        assert(available());
+        if (_state == state::exception)
         {
-            std::rethrow_exception(std::move(_u.ex));
+            _state = state::invalid;
+            std::rethrow_exception(std::move(_ex));
         }
     }
     void get() const&
     {
-        assert(_u.st != state::future);
-        if (_u.st >= state::exception_min)
-        {
-            std::rethrow_exception(_u.ex);
-        }
+        assert(available());
+        if (_state == state::exception)
+            std::rethrow_exception(_ex);
     }
     void ignore() noexcept
     {
-        assert(available());
-        this->~future_state();
-        _u.st.store(state::invalid, std::memory_order_release);
+        _ex = nullptr;
+        _state = state::invalid;
     }
     std::exception_ptr get_exception() && noexcept
     {
-        assert(_u.st >= state::exception_min);
-        return std::move(_u.ex);
+        assert(_state == state::exception);
+        _state = state::invalid;
+        return std::move(_ex);
     }
     std::exception_ptr get_exception() const& noexcept
     {
-        assert(_u.st >= state::exception_min);
-        return _u.ex;
+        assert(_state == state::exception);
+        return _ex;
     }
     void get_value() const noexcept
     {
-        assert(_u.st == state::result);
+        assert(_state == state::result);
     }
     void forward_to(promise<void>& pr) noexcept;
 };
 
-/// task<T>
-class task
+namespace detail
 {
-public:
-    virtual ~task() = default;
-    virtual void run() noexcept = 0;
-};
 
-/// continuation_base<T>
-template <typename T>
-class continuation_base : public task
+/// Thread-local free lists of small fixed size blocks
+/**
+ * Futures are created and resolved at a high rate on every io thread. Recycling their
+ * blocks per thread keeps that churn out of the global allocator. Blocks freed on another
+ * thread than the one that allocated them join that thread's lists.
+ */
+class block_pool
 {
-protected:
-    future_state<T> _state;
-    using future_type = future<T>;
-    using promise_type = promise<T>;
 public:
-    continuation_base() = default;
-    explicit continuation_base(asio::io_context * _io_context, std::recursive_mutex * _global_m)
-        : _state(_io_context, _global_m) {}
+    static constexpr std::size_t max_block = 1024; /**< Larger blocks go to operator new */
 
-    explicit continuation_base(future_state<T>&& state) : _state(std::move(state)) {}
-
-    void set_state(T&& state)
+    static void * allocate(std::size_t size)
     {
-        _state.set(std::move(state));
+        if (size > max_block)
+            return ::operator new(size);
+        auto k = size_class(size);
+        auto c = local();
+        if (c && c->head[k])
+        {
+            auto n = c->head[k];
+            c->head[k] = n->next;
+            --c->count[k];
+            return n;
+        }
+        return ::operator new(block_size(k));
     }
-    void set_state(future_state<T>&& state)
+
+    static void deallocate(void * p, std::size_t size) noexcept
     {
-        _state = std::move(state);
+        if (size > max_block)
+            return ::operator delete(p);
+        auto k = size_class(size);
+        auto c = local();
+        if (!c || c->count[k] >= max_cached)
+            return ::operator delete(p);
+        auto n = static_cast<node *>(p);
+        n->next = c->head[k];
+        c->head[k] = n;
+        ++c->count[k];
     }
-    future_state<T>* state() noexcept
+
+private:
+    static constexpr std::size_t classes = 5; // 64 to 1024 bytes
+    static constexpr uint32_t max_cached = 256; // per class and thread
+
+    struct node
     {
-        return &_state;
-    }
+        node * next;
+    };
 
-    friend class promise<T>;
-    friend class future<T>;
-};
+    struct cache
+    {
+        node * head[classes] = {};
+        uint32_t count[classes] = {};
+    };
 
-/// continuation_base<void>
-template <>
-class continuation_base<void> : public task
-{
-protected:
-    future_state<void> _state;
-    using future_type = future<void>;
-    using promise_type = promise<void>;
-public:
-    continuation_base() = default;
-    explicit continuation_base(asio::io_context * _io_context, std::recursive_mutex * _global_m)
-        : _state(_io_context, _global_m) {}
-    explicit continuation_base(future_state<void>&& state) : _state(std::move(state)) {}
-    void set_state(future_state<void>&& state)
+    struct cache_owner
+    {
+        cache c;
+        cache_owner() noexcept
+        {
+            current() = &c;
+        }
+        ~cache_owner()
+        {
+            // blocks released during later thread_local destruction bypass the cache
+            current() = nullptr;
+            for (auto n : c.head)
+                while (n)
+                {
+                    auto next = n->next;
+                    ::operator delete(n);
+                    n = next;
+                }
+        }
+    };
+
+    static cache *& current() noexcept
     {
-        _state = std::move(state);
+        static thread_local cache * c = nullptr;
+        return c;
     }
-    future_state<void>* state() noexcept
+
+    static cache * local() noexcept
     {
-        return &_state;
+        static thread_local cache_owner owner;
+        return current();
     }
 
-    friend class promise<void>;
-    friend class future<void>;
-};
+    static std::size_t size_class(std::size_t size) noexcept
+    {
+        std::size_t k = 0;
+        while (block_size(k) < size)
+            ++k;
+        return k;
+    }
 
-/// continuation<Func, T>
-template <typename Func, typename T>
-struct continuation final : continuation_base<T>
-{
-    continuation(Func&& func, future_state<T>&& state) : continuation_base<T>(std::move(state)), _func(std::move(func)) {}
-    continuation(Func&& func, asio::io_context * _io_context, std::recursive_mutex * _global_m)
-        : continuation_base<T>(_io_context, _global_m)
-        , _func(std::move(func))
-    {}
-    virtual void run() noexcept override
+    static constexpr std::size_t block_size(std::size_t k) noexcept
     {
-        _func(std::move(this->_state));
+        return std::size_t(64) << k;
     }
-    Func _func;
 };
-using task_ptr = std::unique_ptr<task>;
-
 
-/// promise<T>
+/// Allocator drawing from block_pool
 template <typename T>
-class promise
+class pool_allocator
 {
-    enum class urgent { no, yes };
-    future<T>* _future = nullptr;
-    future_state<T> _local_state;
-    future_state<T>* _state;
-    std::unique_ptr<continuation_base<T>> _task;
-    std::recursive_mutex _m;
-    asio::io_context * _io_context = nullptr;
-    std::recursive_mutex * _global_m = nullptr;
-    static constexpr bool copy_noexcept = future_state<T>::copy_noexcept;
 public:
-    promise(asio::io_context * _io_context, std::recursive_mutex * _global_m) noexcept
-        : _local_state(future_state<T>(_io_context, _global_m))
-        , _state(&_local_state)
-        , _io_context(_io_context)
-        , _global_m(_global_m)
-    {}
-
-    promise(promise&& x) noexcept
-        : _local_state(future_state<T>(x._io_context, x._global_m))
-        , _io_context(x._io_context)
-        , _global_m(x._global_m)
-    {
-        std::atomic_thread_fence(std::memory_order_acquire);
-        //std::lock_guard<std::recursive_mutex> gl(internal::_global_m);
-        //TODO: this needs a lock or l2 lock has a chance of segfault
-        if (x._future)
-        {
-            std::unique_lock<std::recursive_mutex> l(_m, std::defer_lock);
-            std::unique_lock<std::recursive_mutex> l2(x._future->_m, std::defer_lock);
-            std::lock(l, l2);
-            if (!x._future)
-                goto NOTREALLYTHERE;
-            _future = x._future;
-            _future->_promise = this;
-            _state = x._state;
-            _task = std::move(x._task);
-            if (_state == &x._local_state)
-            {
-                _state = &_local_state;
-                _local_state = std::move(x._local_state);
-            }
-            x._future = nullptr;
-            x._state = nullptr;
-        }
-        else
-        {
-        NOTREALLYTHERE:;
-            std::lock_guard<std::recursive_mutex> l(_m);
-            _state = x._state;
-            _task = std::move(x._task);
-            if (_state == &x._local_state)
-            {
-                _state = &_local_state;
-                _local_state = std::move(x._local_state);
-            }
-            x._state = nullptr;
-        }
-        std::atomic_thread_fence(std::memory_order_release);
-    }
-    promise(const promise&) = delete;
-    ~promise() noexcept
+    using value_type = T;
+
+    pool_allocator() noexcept = default;
+    template <typename U>
+    pool_allocator(const pool_allocator<U> &) noexcept {}
+
+    T * allocate(std::size_t n)
     {
-        std::unique_lock<std::recursive_mutex> l(_m, std::defer_lock);
-        std::unique_lock<std::recursive_mutex> l2(*_global_m, std::defer_lock);
-        std::lock(l, l2);
-        abandoned();
+        static_assert(alignof(T) <= alignof(std::max_align_t), "Over-aligned types are not supported");
+        return static_cast<T *>(block_pool::allocate(n * sizeof(T)));
     }
-    promise& operator=(promise&& x) noexcept
+
+    void deallocate(T * p, std::size_t n) noexcept
     {
-        std::atomic_thread_fence(std::memory_order_acquire);
-        if (this != &x)
-        {
-            this->~promise();
-            new (this) promise(std::move(x));
-        }
-        std::atomic_thread_fence(std::memory_order_release);
-        return *this;
+        block_pool::deallocate(p, n * sizeof(T));
     }
-    void operator=(const promise&) = delete;
 
-    future<T> get_future() noexcept;
+    template <typename U>
+    bool operator==(const pool_allocator<U> &) const noexcept
+    {
+        return true;
+    }
 
-    template <typename... A>
-    void set_value(A&&... a) noexcept
+    template <typename U>
+    bool operator!=(const pool_allocator<U> &) const noexcept
     {
-        assert(_state);
-        _state->set(std::forward<A>(a)...);
-        make_ready<urgent::no>();
+        return false;
     }
+};
 
-    void set_exception(std::exception_ptr ex) noexcept
+/// Callback attached to a shared state and run once its result is available
+template <typename T>
+class continuation_base
+{
+public:
+    virtual ~continuation_base() = default;
+
+    /// Run with the result of the shared state. Releases the continuation.
+    virtual void run(future_state<T> && result) noexcept = 0;
+
+    /// Release the continuation without running it
+    virtual void discard() noexcept = 0;
+
+    /// Run in the thread that completes the state instead of posting to the io_context
+    bool _inline = false;
+};
+
+/// continuation<Func, T>
+/**
+ * Constructed in the inline buffer of a shared state, or in a pooled block if it does not fit
+ */
+template <typename Func, typename T>
+class continuation final : public continuation_base<T>
+{
+public:
+    template <typename F>
+    continuation(F&& func, bool pooled)
+        : _func(std::forward<F>(func))
+        , _pooled(pooled)
     {
-        do_set_exception<urgent::no>(std::move(ex));
     }
 
-    template<typename Exception>
-    void set_exception(Exception&& e) noexcept
+    void run(future_state<T> && result) noexcept override
     {
-        set_exception(make_exception_ptr(std::forward<Exception>(e)));
+        _func(std::move(result));
+        release();
     }
-private:
 
-    template<urgent Urgent, typename... A>
-    void do_set_value(A... a) noexcept
+    void discard() noexcept override
     {
-        assert(_state);
-        _state->set(std::move(a)...);
-        make_ready<Urgent>();
+        release();
     }
 
-    template<typename... A>
-    void set_urgent_value(A&&... a) noexcept
+private:
+    void release() noexcept
     {
-        set_value(std::forward<A>(a)...);
+        bool pooled = _pooled;
+        this->~continuation();
+        if (pooled)
+            block_pool::deallocate(this, sizeof(continuation));
     }
 
-    template<urgent Urgent>
-    void do_set_exception(std::exception_ptr ex) noexcept
+    Func _func;
+    bool _pooled;
+};
+
+/// Continuation used by blocking waits. Lives on the waiting thread's stack.
+template <typename T>
+class waiter final : public continuation_base<T>
+{
+public:
+    waiter() noexcept
     {
-        assert(_state);
-        _state->set_exception(std::move(ex));
-        make_ready<Urgent>();
+        this->_inline = true;
     }
 
-    void set_urgent_exception(std::exception_ptr ex) noexcept
+    void run(future_state<T> &&) noexcept override
     {
-        do_set_exception<urgent::yes>(std::move(ex));
+        std::lock_guard<std::mutex> l(_m);
+        _done = true;
+        _cv.notify_one();
     }
-private:
-    template <typename Func>
-    void schedule(Func&& func)
+
+    void discard() noexcept override
     {
-        auto tws = std::make_unique<continuation<Func, T>>(std::move(func), _io_context, _global_m);
-        _state = &tws->_state;
-        _task = std::move(tws);
     }
-    template<urgent Urgent>
-    void make_ready() noexcept;
-    void abandoned() noexcept;
 
-    template <typename U>
-    friend class future;
+    void wait() noexcept
+    {
+        std::unique_lock<std::mutex> l(_m);
+        _cv.wait(l, [this] { return _done; });
+    }
 
-    friend struct future_state<T>;
-    friend struct future_state<void>;
+private:
+    std::mutex _m;
+    std::condition_variable _cv;
+    bool _done = false;
 };
 
-/// future<T>
+/// State shared between a promise and its future
+/**
+ * A single atomic word orders the two sides. The promise publishes the result and
+ * swaps the word to ready; the future publishes a continuation and swaps the word
+ * from pending. Whichever side comes second dispatches the continuation, so neither
+ * side ever waits on the other.
+ */
 template <typename T>
-class future
+class shared_state
 {
-    promise<T>* _promise;
-    future_state<T> _local_state;
-    mutable std::recursive_mutex _m;
-    asio::io_context * _io_context = nullptr;
-    std::recursive_mutex * _global_m = nullptr;
-    static constexpr bool copy_noexcept = future_state<T>::copy_noexcept;
-private:
-    future(promise<T>* pr) noexcept
-        : _local_state(future_state<T>(pr->_io_context, pr->_global_m))
+public:
+    enum : uint8_t
     {
-        _io_context = pr->_io_context;
-        _global_m = pr->_global_m;
-        std::atomic_thread_fence(std::memory_order_acquire);
-        std::unique_lock<std::recursive_mutex> l(*_global_m, std::defer_lock);
-        std::unique_lock<std::recursive_mutex> l2(_m, std::defer_lock);
-        std::unique_lock<std::recursive_mutex> l3(pr->_m, std::defer_lock);
-        std::lock(l, l2, l3);
+        st_pending,
+        st_continuation,
+        st_ready
+    };
 
-        _promise = pr;
-        _promise->_future = this;
-        std::atomic_thread_fence(std::memory_order_release);
+    explicit shared_state(asio::io_context * io_context) noexcept
+        : _io_context(io_context)
+    {
     }
-    template <typename... A>
-    future(ready_future_marker, A&&... a)
-        : _promise(nullptr)
-        , _local_state(future_state<T>(nullptr, nullptr))
+
+    shared_state(const shared_state &) = delete;
+    shared_state & operator=(const shared_state &) = delete;
+
+    ~shared_state()
     {
-        _local_state.set(std::forward<A>(a)...);
+        if (_continuation)
+            _continuation->discard();
     }
-    future(exception_future_marker, std::exception_ptr ex) noexcept
-        : _promise(nullptr)
-        , _local_state(future_state<T>(nullptr, nullptr))
+
+    bool ready() const noexcept
     {
-        _local_state.set_exception(std::move(ex));
+        return _word.load(std::memory_order_acquire) == st_ready;
     }
-    explicit future(future_state<T>&& state, asio::io_context * _io_context, std::recursive_mutex * _global_m) noexcept
-        : _local_state(future_state<T>(_io_context, _global_m))
-        , _io_context(_io_context)
-        , _global_m(_global_m)
+
+    /// Publish the result and dispatch a waiting continuation
+    /**
+     * The result must already be stored in _result
+     */
+    static void complete(std::shared_ptr<shared_state> self) noexcept
     {
-        std::atomic_thread_fence(std::memory_order_acquire);
-        _local_state = std::move(state);
-        _promise = nullptr;
-        std::atomic_thread_fence(std::memory_order_release);
+        if (self->_word.exchange(st_ready, std::memory_order_acq_rel) == st_continuation)
+            dispatch(std::move(self));
     }
-    future_state<T> * state() noexcept
+
+    /// Construct a continuation for this state
+    /**
+     * Uses the inline buffer when the callable fits, which covers the usual then() chains
+     * @returns Continuation to pass to attach()
+     */
+    template <typename Func>
+    continuation_base<T> * make_continuation(Func && func)
     {
-        std::atomic_thread_fence(std::memory_order_acquire);
-        if (_promise)
-        {
-            std::unique_lock<std::recursive_mutex> l(_m, std::defer_lock);
-            std::unique_lock<std::recursive_mutex> l2(*_global_m, std::defer_lock);
-            std::lock(l, l2);
-            
-            //std::lock_guard<std::recursive_mutex> l(_promise->_m);
-            future_state<T> * _st = _promise->_state;
-            std::atomic_thread_fence(std::memory_order_release);
-            return _st;
-        }
-        else
-        {
-            future_state<T> * _st = &_local_state;
-            std::atomic_thread_fence(std::memory_order_release);
-            return _st;
-        }
+        using type = continuation<std::decay_t<Func>, T>;
+        // only the chosen branch is instantiated, so an oversized type never meets the buffer
+        using fits = std::integral_constant<bool, sizeof(type) <= sizeof(_buffer) && alignof(type) <= alignof(std::max_align_t)>;
+        return _make_continuation<type>(std::forward<Func>(func), fits{});
     }
-    const future_state<T> * state() const noexcept
+
+    /// Attach a continuation, dispatching it right away if the result is available
+    static void attach(std::shared_ptr<shared_state> self, continuation_base<T> * c) noexcept
     {
-        std::atomic_thread_fence(std::memory_order_acquire);
-        if (_promise)
-        {
-            std::unique_lock<std::recursive_mutex> l(_m, std::defer_lock);
-            std::unique_lock<std::recursive_mutex> l2(*_global_m, std::defer_lock);
-            std::lock(l, l2);
-
-            //std::lock_guard<std::recursive_mutex> l(_promise->_m);
-            const future_state<T> * _st = _promise->_state;
-            std::atomic_thread_fence(std::memory_order_release);
-            return _st;
-        }
-        else
-        {
-            const future_state<T> * _st = &_local_state;
-            std::atomic_thread_fence(std::memory_order_release);
-            return _st;
-        }
+        if (!self->try_attach(c))
+            dispatch(std::move(self));
     }
-    template <typename Func>
-    void schedule(Func&& func)
+
+    /// Attach a continuation
+    /**
+     * @returns false if the result was already available. The continuation is left attached
+     * but not dispatched.
+     */
+    bool try_attach(continuation_base<T> * c) noexcept
     {
-        std::atomic_thread_fence(std::memory_order_acquire);
-        future_state<T> * _st = state();
-        if (state()->available())
-        {
-            asio::post(*_io_context, [func = std::move(func), _state = std::move(*state())]() mutable
-            {
-                func(std::move(_state));
-            });
-        }
-        else
-        {
-            std::unique_lock<std::recursive_mutex> l(_m, std::defer_lock);
-            std::unique_lock<std::recursive_mutex> l2(_promise->_m, std::defer_lock);
-            std::lock(l, l2);
-            assert(_promise);
-            _promise->schedule(std::move(func));
-            _promise->_future = nullptr;
-            _promise = nullptr;
-        }
-        std::atomic_thread_fence(std::memory_order_release);
+        assert(!_continuation);
+        _continuation = c;
+        uint8_t expected = st_pending;
+        return _word.compare_exchange_strong(expected, st_continuation, std::memory_order_acq_rel, std::memory_order_acquire);
     }
-    future_state<T> get_available_state() noexcept
+
+    /// Remove a continuation left attached by a failed try_attach() without running it
+    void detach() noexcept
     {
-        auto st = state();
-        if (_promise)
-        {
-            std::lock_guard<std::recursive_mutex> l(_promise->_m);
-            if (!_promise)
-                goto NOTREALLYTHERE;
-            _promise->_future = nullptr;
-            _promise = nullptr;
-        }
-    NOTREALLYTHERE:;
-        return std::move(*st);
+        assert(ready());
+        _continuation = nullptr;
     }
 
-    future<T> rethrow_with_nested()
+    static void dispatch(std::shared_ptr<shared_state> self) noexcept
     {
-        if (!failed())
+        if (self->_continuation->_inline || !self->_io_context)
         {
-            return make_exception_future<T>(std::current_exception());
+            self->run();
+            return;
         }
-        else
+        auto & io = *self->_io_context;
+        asio::post(io, [self = std::move(self)]
         {
-            std::nested_exception f_ex;
-            try
-            {
-                get();
-            }
-            catch (...)
-            {
-                std::throw_with_nested(f_ex);
-            }
-            throw std::runtime_error("unreachable");
-        }
+            self->run();
+        });
     }
 
-    template<typename U>
-    friend class shared_future;
-public:
-    using value_type = T;
-    using promise_type = promise<T>;
-    future(future&& x) noexcept
-        : _local_state(future_state<T>(x._io_context, x._global_m))
-        , _io_context(x._io_context)
-        , _global_m(x._global_m)
-    {
-        std::atomic_thread_fence(std::memory_order_acquire);
-        std::unique_lock<std::recursive_mutex> l(_m, std::defer_lock);
-        std::unique_lock<std::recursive_mutex> l2(x._m, std::defer_lock);
-        std::lock(l, l2);
-
-        _promise = x._promise;
-        if (!_promise)
+    void run() noexcept
+    {
+        auto c = _continuation;
+        _continuation = nullptr;
+        c->run(std::move(_result));
+    }
+
+    future_state<T> _result;
+    asio::io_context * _io_context = nullptr;
+
+private:
+    template <typename Type, typename Func>
+    continuation_base<T> * _make_continuation(Func && func, std::true_type)
+    {
+        assert(!_continuation);
+        return new (&_buffer) Type(std::forward<Func>(func), false);
+    }
+
+    template <typename Type, typename Func>
+    continuation_base<T> * _make_continuation(Func && func, std::false_type)
+    {
+        void * p = block_pool::allocate(sizeof(Type));
+        try
         {
-            _local_state = std::move(x._local_state);
+            return new (p) Type(std::forward<Func>(func), true);
         }
-        x._promise = nullptr;
-        if (_promise)
+        catch (...)
         {
-            std::lock_guard<std::recursive_mutex> l(_promise->_m);
-            _promise->_future = this;
+            block_pool::deallocate(p, sizeof(Type));
+            throw;
         }
-        std::atomic_thread_fence(std::memory_order_release);
     }
-    future(const future&) = delete;
-    future& operator=(future&& x) noexcept
+
+    std::atomic<uint8_t> _word{ st_pending };
+    continuation_base<T> * _continuation = nullptr;
+    typename std::aligned_storage<96, alignof(std::max_align_t)>::type _buffer;
+};
+
+}
+
+/// promise<T>
+template <typename T>
+class promise
+{
+    std::shared_ptr<detail::shared_state<T>> _state;
+public:
+    /// Create a promise whose continuations are posted to an io_context
+    /**
+     * @param _io_context io_context to run continuations on. Continuations run inline if nullptr
+     */
+    explicit promise(asio::io_context * _io_context) noexcept
+        : _state(std::allocate_shared<detail::shared_state<T>>(detail::pool_allocator<detail::shared_state<T>>(), _io_context))
+    {
+    }
+
+    promise(promise&& x) noexcept = default;
+    promise(const promise&) = delete;
+
+    /// Fails the future with error::broken_promise if no result was set
+    ~promise() noexcept
+    {
+        _break();
+    }
+
+    promise& operator=(promise&& x) noexcept
     {
-        std::atomic_thread_fence(std::memory_order_acquire);
         if (this != &x)
         {
-            this->~future();
-            new (this) future(std::move(x));
+            _break();
+            _state = std::move(x._state);
         }
-        std::atomic_thread_fence(std::memory_order_release);
         return *this;
     }
-    void operator=(const future&) = delete;
-    ~future()
+    void operator=(const promise&) = delete;
+
+    future<T> get_future() noexcept;
+
+    template <typename... A>
+    void set_value(A&&... a) noexcept
     {
-        std::atomic_thread_fence(std::memory_order_acquire);
-        if (_promise)
+        assert(_state);
+        _state->_result.set(std::forward<A>(a)...);
+        detail::shared_state<T>::complete(std::move(_state));
+    }
+
+    void set_exception(std::exception_ptr ex) noexcept
+    {
+        assert(_state);
+        _state->_result.set_exception(std::move(ex));
+        detail::shared_state<T>::complete(std::move(_state));
+    }
+
+    template<typename Exception>
+    void set_exception(Exception&& e) noexcept
+    {
+        set_exception(make_exception_ptr(std::forward<Exception>(e)));
+    }
+
+private:
+    template <typename U>
+    friend class future;
+
+    void _break() noexcept
+    {
+        if (!_state)
+            return;
+        try
         {
-            std::lock_guard<std::recursive_mutex> l(*_global_m);
-            if (_promise)
-            {
-                std::lock_guard<std::recursive_mutex> l(_promise->_m);
-                _promise->_future = nullptr;
-            }
+            set_exception(std::make_exception_ptr(aegis::exception(make_error_code(error::broken_promise))));
         }
-        if (failed())
+        catch (...)
         {
+            set_exception(std::current_exception());
         }
-        std::atomic_thread_fence(std::memory_order_release);
     }
+};
 
-    T get()
+/// future<T>
+template <typename T>
+class future
+{
+    std::shared_ptr<detail::shared_state<T>> _state;
+    future_state<T> _local_state;
+    std::shared_ptr<cancellation> _cancel;
+    static constexpr bool copy_noexcept = future_state<T>::copy_noexcept;
+private:
+    explicit future(std::shared_ptr<detail::shared_state<T>> st) noexcept
+        : _state(std::move(st))
+    {
+    }
+    template <typename... A>
+    future(ready_future_marker, A&&... a)
+    {
+        _local_state.set(std::forward<A>(a)...);
+    }
+    future(exception_future_marker, std::exception_ptr ex) noexcept
+    {
+        _local_state.set_exception(std::move(ex));
+    }
+    explicit future(future_state<T>&& state) noexcept
+        : _local_state(std::move(state))
+    {
+    }
+    asio::io_context * io_context() const noexcept
+    {
+        return _state ? _state->_io_context : nullptr;
+    }
+    template <typename Func>
+    void schedule(Func&& func, bool run_inline = false)
     {
+        assert(_state);
+        auto c = _state->make_continuation(std::forward<Func>(func));
+        c->_inline = run_inline;
+        detail::shared_state<T>::attach(std::move(_state), c);
+    }
+    template <typename Executor, typename Task>
+    void execute_on(const Executor & ex, Task&& task) noexcept
+    {
+        try
         {
-            std::atomic_thread_fence(std::memory_order_acquire);
-            future_state<T> * _st = state();
-            std::atomic_thread_fence(std::memory_order_release);
-            if (!_st->available())
+            if (available())
             {
-                do_wait();
+                detail::execute(ex, [task = std::forward<Task>(task), state = get_available_state()]() mutable {
+                    task(std::move(state));
+                });
+                return;
             }
+            this->schedule([ex, task = std::forward<Task>(task)](future_state<T> && state) mutable {
+                detail::execute(ex, [task = std::move(task), state = std::move(state)]() mutable {
+                    task(std::move(state));
+                });
+            }, true);
         }
+        catch (...)
+        {
+            abort();
+        }
+    }
+    future_state<T> get_available_state() noexcept
+    {
+        if (_state)
+        {
+            assert(_state->ready());
+            future_state<T> st(std::move(_state->_result));
+            _state.reset();
+            return st;
+        }
+        return std::move(_local_state);
+    }
 
+    future<T> rethrow_with_nested()
+    {
+        if (!failed())
         {
-            std::atomic_thread_fence(std::memory_order_acquire);
+            return make_exception_future<T>(std::current_exception());
+        }
+        else
+        {
+            std::nested_exception f_ex;
+            try
+            {
+                get();
+            }
+            catch (...)
+            {
+                std::throw_with_nested(f_ex);
+            }
+            throw std::runtime_error("unreachable");
+        }
+    }
 
-            std::unique_lock<std::recursive_mutex> l(_m, std::defer_lock);
-            std::unique_lock<std::recursive_mutex> l2(*_global_m, std::defer_lock);
-            std::lock(l, l2);
+    template<typename U>
+    friend class shared_future;
+public:
+    using value_type = T;
+    using promise_type = promise<T>;
+    future(future&& x) noexcept = default;
+    future(const future&) = delete;
+    future& operator=(future&& x) noexcept = default;
+    void operator=(const future&) = delete;
+    ~future() = default;
 
-            future_state<T> _st(get_available_state());
-            std::atomic_thread_fence(std::memory_order_release);
-            return _st.get();
-        }
+    T get()
+    {
+        wait();
+        return get_available_state().get();
     }
 
     std::exception_ptr get_exception()
     {
-        std::atomic_thread_fence(std::memory_order_acquire);
-        future_state<T> _st(get_available_state());
-        std::atomic_thread_fence(std::memory_order_release);
-        return _st.get_exception();
+        return get_available_state().get_exception();
     }
 
     void wait() const noexcept
     {
-        std::atomic_thread_fence(std::memory_order_acquire);
-        const future_state<T> * _st = state();
-        std::atomic_thread_fence(std::memory_order_release);
-        if (!_st->available())
-        {
-            do_wait();
-        }
+        if (!_state || _state->ready())
+            return;
+        detail::waiter<T> w;
+        if (_state->try_attach(&w))
+            w.wait();
+        else
+            _state->run();
     }
-private:
-    void do_wait() const noexcept
+
+    /// Cancel the operation backing this future if it supports cancellation
+    /**
+     * A cancelled operation fails its future with error::request_cancelled
+     * @returns true if the operation was cancelled before it completed
+     */
+    bool cancel() noexcept
     {
-        // fake wait
-        // maybe execute something in the asio queue?
+        return _cancel ? _cancel->cancel() : false;
+    }
 
-        while (!available())
-            std::this_thread::sleep_for(std::chrono::nanoseconds(1));
+    /// Attach the cancellation handle of the operation backing this future
+    /**
+     * Futures returned by then() share the handle of the future they were chained from
+     * @param handle Cancellation handle of the operation
+     */
+    void set_cancellation(std::shared_ptr<cancellation> handle) noexcept
+    {
+        _cancel = std::move(handle);
     }
 
-public:
     bool available() const noexcept
     {
-        std::atomic_thread_fence(std::memory_order_acquire);
-        const future_state<T> * _st = state();
-        assert(_st);
-        auto res = _st->available();
-        std::atomic_thread_fence(std::memory_order_release);
-        return res;
+        return _state ? _state->ready() : _local_state.available();
     }
 
     bool failed() const noexcept
     {
-        std::atomic_thread_fence(std::memory_order_acquire);
-        auto _st = state();
-        if (!_st)
-            return false;
-        bool f = _st->failed();
-        std::atomic_thread_fence(std::memory_order_release);
-        return f;
+        if (_state)
+            return _state->ready() && _state->_result.failed();
+        return _local_state.failed();
     }
 
+    /// Chain a continuation
+    /**
+     * If this future is already resolved the continuation runs right away on the calling
+     * thread. Otherwise it runs where the future resolves: posted to the io_context of the
+     * promise if it has one, or inline on the resolving thread. Use then(executor, func) to
+     * choose where it runs regardless.
+     * @param func Continuation receiving the value of this future
+     * @returns future of the continuation's result
+     */
     template <typename Func, typename Result = result_of_t<Func, T>>
     add_future_t<Result> then(Func&& func) noexcept
     {
         using inner_type = remove_future_t<Result>;
-        std::atomic_thread_fence(std::memory_order_acquire);
         if (available())
         {
             if (failed())
@@ -986,13 +1071,12 @@ public:
                 return detail::call_state<inner_type>(std::forward<Func>(func), get_available_state());
             }
         }
-        std::atomic_thread_fence(std::memory_order_release);
-        promise<inner_type> pr(_io_context, _global_m);
+        promise<inner_type> pr(io_context());
         auto fut = pr.get_future();
+        fut._cancel = _cancel;
         try
         {
             this->schedule([pr = std::move(pr), func = std::forward<Func>(func)](future_state<T> && state) mutable {
-                std::atomic_thread_fence(std::memory_order_acquire);
                 if (state.failed())
                 {
                     pr.set_exception(std::move(state).get_exception());
@@ -1001,7 +1085,6 @@ public:
                 {
                     detail::call_state<inner_type>(std::forward<Func>(func), std::move(state)).forward_to(std::move(pr));
                 }
-                std::atomic_thread_fence(std::memory_order_release);
             });
         }
         catch (...)
@@ -1015,20 +1098,17 @@ public:
     add_future_t<Result> then_wrapped(Func&& func) noexcept
     {
         using inner_type = remove_future_t<Result>;
-        std::atomic_thread_fence(std::memory_order_acquire);
         if (available())
         {
-            return detail::call_future<inner_type>(std::forward<Func>(func), future(get_available_state(), _io_context, _global_m));
+            return detail::call_future<inner_type>(std::forward<Func>(func), future(get_available_state()));
         }
-        std::atomic_thread_fence(std::memory_order_release);
-        promise<inner_type> pr(_io_context, _global_m);
+        promise<inner_type> pr(io_context());
         auto fut = pr.get_future();
+        fut._cancel = _cancel;
         try
         {
-            this->schedule([pr = std::move(pr), func = std::forward<Func>(func), this](auto&& state) mutable {
-                std::atomic_thread_fence(std::memory_order_acquire);
-                detail::call_future<inner_type>(std::forward<Func>(func), future(std::move(state), _io_context, _global_m)).forward_to(std::move(pr));
-                std::atomic_thread_fence(std::memory_order_release);
+            this->schedule([pr = std::move(pr), func = std::forward<Func>(func)](future_state<T> && state) mutable {
+                detail::call_future<inner_type>(std::forward<Func>(func), future(std::move(state))).forward_to(std::move(pr));
             });
         }
         catch (...)
@@ -1038,20 +1118,79 @@ public:
         return fut;
     }
 
+    /// Chain a continuation run on an executor
+    /**
+     * The continuation is handed to the executor even if this future is already resolved.
+     * Continuations chained onto the returned future without an executor run on the executor
+     * if they are chained before it resolves, and on the calling thread otherwise. See then(func).
+     *
+     * @code{.cpp}
+     * auto strand = asio::make_strand(bot.get_io_context());
+     * bot.get_ratelimit().post_task<gateway::objects::message>(params)
+     *     .then(strand, [](gateway::objects::message && msg) { ... })
+     *     .then(aegis::inline_executor{}, [] { ... });
+     * @endcode
+     * @param ex Executor to run the continuation on. An asio executor or aegis executor.
+     * @param func Continuation receiving the value of this future
+     * @returns future of the continuation's result
+     */
+    template <typename Executor, typename Func, typename Result = result_of_t<Func, T>>
+    add_future_t<Result> then(const Executor & ex, Func&& func) noexcept
+    {
+        using inner_type = remove_future_t<Result>;
+        promise<inner_type> pr(nullptr);
+        auto fut = pr.get_future();
+        fut._cancel = _cancel;
+        execute_on(ex, [pr = std::move(pr), func = std::forward<Func>(func)](future_state<T> && state) mutable {
+            if (state.failed())
+            {
+                pr.set_exception(std::move(state).get_exception());
+            }
+            else
+            {
+                detail::call_state<inner_type>(std::move(func), std::move(state)).forward_to(std::move(pr));
+            }
+        });
+        return fut;
+    }
+
+    /// Move delivery of this future's result to an executor
+    /**
+     * @param ex Executor to resolve the returned future on
+     * @returns future resolved on the executor. Continuations chained onto it without an
+     * executor run there if chained before it resolves. See then(func).
+     */
+    template <typename Executor>
+    future<T> via(const Executor & ex) noexcept
+    {
+        promise<T> pr(nullptr);
+        auto fut = pr.get_future();
+        fut._cancel = _cancel;
+        execute_on(ex, [pr = std::move(pr)](future_state<T> && state) mutable {
+            state.forward_to(pr);
+        });
+        return fut;
+    }
+
     void forward_to(promise<T>&& pr) noexcept
     {
-        std::atomic_thread_fence(std::memory_order_acquire);
-        if (state()->available())
+        if (available())
         {
-            state()->forward_to(pr);
+            get_available_state().forward_to(pr);
         }
         else
         {
-            _promise->_future = nullptr;
-            *_promise = std::move(pr);
-            _promise = nullptr;
+            try
+            {
+                this->schedule([pr = std::move(pr)](future_state<T> && state) mutable {
+                    state.forward_to(pr);
+                }, true);
+            }
+            catch (...)
+            {
+                abort();
+            }
         }
-        std::atomic_thread_fence(std::memory_order_release);
     }
 
     template <typename Func>
@@ -1130,73 +1269,39 @@ public:
             if (!fut.failed())
                 return make_ready_future<T>(fut.get());
             else
-                return detail::call_future<func_ret>(func, fut.get_exception());
+                return detail::call_future<remove_future_t<func_ret>>(func, fut.get_exception());
         });
     }
 
     void ignore_ready_future() noexcept
     {
-        state()->ignore();
+        get_available_state().ignore();
     }
 
 private:
     template <typename U>
     friend class promise;
+    template <typename U>
+    friend class future;
     template <typename U, typename... A>
     friend future<U> make_ready_future(A&&... value);
     template <typename U>
     friend future<U> make_ready_future(U&& value);
     template <typename U>
     friend future<U> make_exception_future(std::exception_ptr ex) noexcept;
+    friend struct detail::future_access;
+#if defined(AEGIS_HAS_COROUTINES)
+    template <typename U>
+    friend class future_awaiter;
+#endif
 };
 
 /// promise<T>::get_future()
 template <typename T>
 inline future<T> promise<T>::get_future() noexcept
 {
-    assert(!_future && _state && !_task);
-    return future<T>(this);
-}
-
-/// promise<T>::make_ready()
-template <typename T>
-template<typename promise<T>::urgent Urgent>
-inline void promise<T>::make_ready() noexcept
-{
-    if (_task)
-    {
-        _state = nullptr;
-        if (Urgent == urgent::yes)
-        {
-            _task->run();
-        }
-        else
-        {
-            asio::post(*_io_context, [_task = std::move(_task)]
-            {
-                _task->run();
-            });
-        }
-    }
-}
-
-/// promise<T>::abandoned()
-template <typename T>
-inline void promise<T>::abandoned() noexcept
-{
-    std::atomic_thread_fence(std::memory_order_acquire);
-    if (_future)
-    {
-        std::lock_guard<std::recursive_mutex> l(_future->_m);
-        assert(_state);
-        assert(_state->available() || !_task);
-        _future->_local_state = std::move(*_state);
-        _future->_promise = nullptr;
-    }
-    else if (_state && _state->failed())
-    {
-    }
-    std::atomic_thread_fence(std::memory_order_release);
+    assert(_state);
+    return future<T>(_state);
 }
 
 /// make_ready_future<T, ...A>()
@@ -1312,18 +1417,12 @@ inline add_future_t<T> call_future(Func&& func, Future&& fut) noexcept
 /// future_state<void>::forward_to()
 inline void future_state<void>::forward_to(promise<void>& pr) noexcept
 {
-    std::atomic_thread_fence(std::memory_order_acquire);
     assert(available());
-    if (_u.st == state::exception_min)
-    {
-        pr.set_urgent_exception(std::move(_u.ex));
-    }
+    if (_state == state::exception)
+        pr.set_exception(std::move(*this).get_exception());
     else
-    {
-        pr.set_urgent_value();
-    }
-    _u.st = state::invalid;
-    std::atomic_thread_fence(std::memory_order_release);
+        pr.set_value();
+    ignore();
 }
 
 /// make_exception_future()
@@ -1333,4 +1432,454 @@ inline future<T> make_exception_future(aegis::error ec)
     return aegis::make_exception_future<T>(std::make_exception_ptr(aegis::exception(make_error_code(ec))));
 }
 
+/// Result of when_any()
+template <typename Sequence>
+struct when_any_result
+{
+    std::size_t index; /**< Position of the first future resolved. size_t(-1) if there were none */
+    Sequence futures; /**< All futures passed to when_any() */
+};
+
+namespace detail
+{
+
+/// Access to future internals for the combinators
+struct future_access
+{
+    template <typename T>
+    static bool pending(const future<T> & fut) noexcept
+    {
+        return fut._state != nullptr;
+    }
+
+    template <typename T>
+    static asio::io_context * io_context(const future<T> & fut) noexcept
+    {
+        return fut.io_context();
+    }
+
+    template <typename T, typename Func>
+    static void schedule(future<T> & fut, Func && func)
+    {
+        fut.schedule(std::forward<Func>(func), true);
+    }
+
+    template <typename T>
+    static void resolve(future<T> & fut, future_state<T> && state) noexcept
+    {
+        fut._local_state = std::move(state);
+    }
+
+    template <typename T>
+    static void share_cancellation(future<T> & to, const future<T> & from) noexcept
+    {
+        to._cancel = from._cancel;
+    }
+};
+
+/// for_each_future<Func, T>()
+template <typename Func, typename T>
+inline void for_each_future(std::vector<future<T>> & futures, Func && func)
+{
+    for (std::size_t i = 0; i < futures.size(); ++i)
+        func(i, futures[i]);
+}
+
+/// for_each_future<Func, ...T, ...I>()
+template <typename Func, typename... T, std::size_t... I>
+inline void for_each_future(std::tuple<future<T>...> & futures, Func && func, std::index_sequence<I...>)
+{
+    (void)std::initializer_list<int>{ (func(I, std::get<I>(futures)), 0)... };
+}
+
+/// for_each_future<Func, ...T>()
+template <typename Func, typename... T>
+inline void for_each_future(std::tuple<future<T>...> & futures, Func && func)
+{
+    for_each_future(futures, std::forward<Func>(func), std::index_sequence_for<T...>{});
+}
+
+/// io_context of the first unresolved future. Combined futures resume there.
+template <typename Sequence>
+inline asio::io_context * io_context_of(Sequence & futures) noexcept
+{
+    asio::io_context * io = nullptr;
+    for_each_future(futures, [&io](std::size_t, auto & fut)
+    {
+        if (!io)
+            io = future_access::io_context(fut);
+    });
+    return io;
+}
+
+/// Shared state of when_all()
+/**
+ * Each future gets an inline continuation that stores its result back in place and
+ * counts down. The count starts one higher than the number of futures so that the
+ * sequence is not handed over while continuations are still being attached.
+ */
+template <typename Sequence>
+class when_all_state
+{
+public:
+    when_all_state(Sequence && futures, std::size_t count) noexcept
+        : _futures(std::move(futures))
+        , _pending(count + 1)
+        , _promise(io_context_of(_futures))
+    {
+    }
+
+    static future<Sequence> start(Sequence && futures, std::size_t count)
+    {
+        auto self = std::allocate_shared<when_all_state>(pool_allocator<when_all_state>(), std::move(futures), count);
+        auto result = self->_promise.get_future();
+        for_each_future(self->_futures, [&self](std::size_t, auto & fut)
+        {
+            using value_type = typename std::decay_t<decltype(fut)>::value_type;
+            if (!future_access::pending(fut))
+            {
+                self->arrive();
+                return;
+            }
+            future_access::schedule(fut, [self, &fut](future_state<value_type> && state)
+            {
+                future_access::resolve(fut, std::move(state));
+                self->arrive();
+            });
+        });
+        self->arrive();
+        return result;
+    }
+
+private:
+    void arrive() noexcept
+    {
+        if (_pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            _promise.set_value(std::move(_futures));
+    }
+
+    Sequence _futures;
+    std::atomic<std::size_t> _pending;
+    promise<Sequence> _promise;
+};
+
+/// Shared state of when_any()
+/**
+ * Unresolved futures are replaced by futures of new promises that their results are
+ * forwarded to, so the sequence can be handed over on the first result while the rest
+ * keep resolving. The first result and the end of setup both count down.
+ */
+template <typename Sequence>
+class when_any_state
+{
+public:
+    explicit when_any_state(Sequence && futures) noexcept
+        : _futures(std::move(futures))
+        , _promise(io_context_of(_futures))
+    {
+    }
+
+    static future<when_any_result<Sequence>> start(Sequence && futures, std::size_t count)
+    {
+        auto self = std::allocate_shared<when_any_state>(pool_allocator<when_any_state>(), std::move(futures));
+        auto result = self->_promise.get_future();
+        if (count == 0)
+            self->resolved(std::size_t(-1));
+        for_each_future(self->_futures, [&self](std::size_t i, auto & fut)
+        {
+            using value_type = typename std::decay_t<decltype(fut)>::value_type;
+            if (!future_access::pending(fut))
+            {
+                self->resolved(i);
+                return;
+            }
+            promise<value_type> pr(future_access::io_context(fut));
+            auto source = std::move(fut);
+            fut = pr.get_future();
+            future_access::share_cancellation(fut, source);
+            future_access::schedule(source, [self, i, pr = std::move(pr)](future_state<value_type> && state) mutable
+            {
+                state.forward_to(pr);
+                self->resolved(i);
+            });
+        });
+        self->arrive();
+        return result;
+    }
+
+private:
+    void resolved(std::size_t index) noexcept
+    {
+        bool expected = false;
+        if (_won.compare_exchange_strong(expected, true, std::memory_order_acq_rel))
+        {
+            _index = index;
+            arrive();
+        }
+    }
+
+    void arrive() noexcept
+    {
+        if (_arrivals.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            _promise.set_value(when_any_result<Sequence>{ _index, std::move(_futures) });
+    }
+
+    Sequence _futures;
+    std::size_t _index = std::size_t(-1);
+    std::atomic<bool> _won{ false };
+    std::atomic<uint8_t> _arrivals{ 2 };
+    promise<when_any_result<Sequence>> _promise;
+};
+
+}
+
+/// Wait for all futures without blocking a thread
+/**
+ * @code{.cpp}
+ * aegis::when_all(c1.create_message("a"), c2.create_message("b")).then([](auto && results)
+ * {
+ *     auto & first = std::get<0>(results);
+ *     if (!first.failed())
+ *         ...
+ * });
+ * @endcode
+ * @param futs Futures to wait for
+ * @returns future resolved with the resolved futures once all of them are available. Failures are
+ * kept in their own future and never fail the result.
+ */
+template <typename... T>
+inline future<std::tuple<future<T>...>> when_all(future<T> &&... futs)
+{
+    return detail::when_all_state<std::tuple<future<T>...>>::start(std::make_tuple(std::move(futs)...), sizeof...(T));
+}
+
+/// Wait for a range of futures without blocking a thread
+/**
+ * @param begin Iterator to the first future. Futures are moved from the range.
+ * @param end Iterator past the last future
+ * @returns future resolved with the resolved futures in order once all of them are available
+ */
+template <typename FutureIterator, typename T = typename std::iterator_traits<FutureIterator>::value_type::value_type>
+inline future<std::vector<future<T>>> when_all(FutureIterator begin, FutureIterator end)
+{
+    std::vector<future<T>> futures;
+    std::move(begin, end, std::back_inserter(futures));
+    auto count = futures.size();
+    return detail::when_all_state<std::vector<future<T>>>::start(std::move(futures), count);
+}
+
+/// Wait for the first of several futures without blocking a thread
+/**
+ * @param futs Futures to wait for
+ * @returns future resolved with the index of the first future available and all the futures.
+ * The others may still be unresolved.
+ */
+template <typename... T>
+inline future<when_any_result<std::tuple<future<T>...>>> when_any(future<T> &&... futs)
+{
+    return detail::when_any_state<std::tuple<future<T>...>>::start(std::make_tuple(std::move(futs)...), sizeof...(T));
+}
+
+/// Wait for the first of a range of futures without blocking a thread
+/**
+ * @param begin Iterator to the first future. Futures are moved from the range.
+ * @param end Iterator past the last future
+ * @returns future resolved with the index of the first future available and all the futures.
+ * The others may still be unresolved. The index is size_t(-1) for an empty range.
+ */
+template <typename FutureIterator, typename T = typename std::iterator_traits<FutureIterator>::value_type::value_type>
+inline future<when_any_result<std::vector<future<T>>>> when_any(FutureIterator begin, FutureIterator end)
+{
+    std::vector<future<T>> futures;
+    std::move(begin, end, std::back_inserter(futures));
+    auto count = futures.size();
+    return detail::when_any_state<std::vector<future<T>>>::start(std::move(futures), count);
+}
+
+#if defined(AEGIS_HAS_COROUTINES)
+
+/// Awaiter returned by co_await on a future
+/**
+ * Suspends the coroutine until the future is resolved. The coroutine is resumed on the
+ * io_context of the future, or inline in the thread that resolved it if it has none.
+ * The awaiter is its own continuation and lives in the coroutine frame, so awaiting does
+ * not allocate.
+ */
+template <typename T>
+class future_awaiter final : public detail::continuation_base<T>
+{
+public:
+    explicit future_awaiter(future<T> && fut) noexcept
+        : _future(std::move(fut))
+    {
+    }
+
+    bool await_ready() const noexcept
+    {
+        // a future without a state has nothing to wait for, await_resume reports it
+        return !_future._state || _future.available();
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle) noexcept
+    {
+        _handle = handle;
+        if (_future._state->try_attach(this))
+            return true;
+        // resolved in the meantime, continue without suspending
+        _future._state->detach();
+        return false;
+    }
+
+    T await_resume()
+    {
+        if (_resumed)
+            return std::move(_result).get();
+        if (!_future.available())
+            throw aegis::exception(make_error_code(error::no_state));
+        return _future.get_available_state().get();
+    }
+
+    void run(future_state<T> && result) noexcept override
+    {
+        _result = std::move(result);
+        _resumed = true;
+        _handle.resume();
+    }
+
+    void discard() noexcept override
+    {
+    }
+
+private:
+    future<T> _future;
+    future_state<T> _result;
+    std::coroutine_handle<> _handle;
+    bool _resumed = false;
+};
+
+/// co_await a future
+template <typename T>
+inline future_awaiter<T> operator co_await(future<T> && fut) noexcept
+{
+    return future_awaiter<T>(std::move(fut));
+}
+
+/// Awaiting consumes the future, so named futures have to be moved: co_await std::move(fut)
+template <typename T>
+future_awaiter<T> operator co_await(future<T> & fut) = delete;
+
+template <typename T = void>
+class task;
+
+namespace detail
+{
+
+template <typename T>
+class task_promise_base
+{
+public:
+    std::suspend_never initial_suspend() const noexcept
+    {
+        return {};
+    }
+
+    std::suspend_never final_suspend() const noexcept
+    {
+        return {};
+    }
+
+    void unhandled_exception() noexcept
+    {
+        _promise.set_exception(std::current_exception());
+    }
+
+    task<T> get_return_object() noexcept
+    {
+        return task<T>(_promise.get_future());
+    }
+
+protected:
+    promise<T> _promise{ nullptr };
+};
+
+template <typename T>
+class task_promise : public task_promise_base<T>
+{
+public:
+    template <typename U>
+    void return_value(U && value) noexcept
+    {
+        this->_promise.set_value(std::forward<U>(value));
+    }
+};
+
+template <>
+class task_promise<void> : public task_promise_base<void>
+{
+public:
+    void return_void() noexcept
+    {
+        this->_promise.set_value();
+    }
+};
+
+}
+
+/// Coroutine returning a future
+/**
+ * The coroutine starts running when called and its frame is released as soon as it
+ * returns, so a task may be dropped without waiting for it. Exceptions escaping the
+ * coroutine fail the future.
+ *
+ * @code{.cpp}
+ * aegis::task<> on_message(aegis::gateway::events::message_create obj)
+ * {
+ *     auto msg = co_await obj.channel.create_message("pong");
+ *     co_await msg.edit("pong!");
+ * }
+ * @endcode
+ */
+template <typename T>
+class task
+{
+public:
+    using promise_type = detail::task_promise<T>;
+    using value_type = T;
+
+    explicit task(future<T> && fut) noexcept
+        : _future(std::move(fut))
+    {
+    }
+
+    task(task &&) noexcept = default;
+    task & operator=(task &&) noexcept = default;
+    task(const task &) = delete;
+    task & operator=(const task &) = delete;
+
+    /// Get the future resolved when the coroutine returns
+    /**
+     * @returns future<T>
+     */
+    future<T> get_future() noexcept
+    {
+        return std::move(_future);
+    }
+
+    operator future<T>() && noexcept
+    {
+        return std::move(_future);
+    }
+
+    future_awaiter<T> operator co_await() && noexcept
+    {
+        return future_awaiter<T>(std::move(_future));
+    }
+
+private:
+    future<T> _future;
+};
+
+#endif
+
+
 }
@@ -34,6 +34,7 @@ class channel;
 class guild;
 class user;
 class shard;
+class message_cache;
 
 namespace gateway
 {
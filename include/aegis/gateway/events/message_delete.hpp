@@ -13,6 +13,7 @@
 #include "aegis/fwd.hpp"
 #include "aegis/snowflake.hpp"
 #include "aegis/gateway/objects/message.hpp"
+#include <memory>
 
 namespace aegis
 {
@@ -30,6 +31,7 @@ struct message_delete
     shards::shard & shard; /**< Reference to shard object this message came from */
     aegis::channel & channel; /**<\todo Needs documentation */
     snowflake id; /**< Snowflake of deleted message */
+    std::shared_ptr<const objects::message> cached; /**< Deleted message if the message cache held it */
 };
 
 }
@@ -12,6 +12,9 @@
 #include "aegis/config.hpp"
 #include "aegis/fwd.hpp"
 #include "aegis/snowflake.hpp"
+#include "aegis/gateway/objects/message.hpp"
+#include <memory>
+#include <vector>
 
 namespace aegis
 {
@@ -29,6 +32,7 @@ struct message_delete_bulk
     snowflake channel_id; /**< Snowflake of channel */
     snowflake guild_id; /**< Snowflake of guild */
     std::vector<snowflake> ids; /**< Array of snowflake of deleted messages */
+    std::vector<std::shared_ptr<const objects::message>> cached; /**< Deleted messages the message cache held, in no particular order */
 };
 
 }
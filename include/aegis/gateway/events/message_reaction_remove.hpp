@@ -13,6 +13,8 @@
 #include "aegis/fwd.hpp"
 #include "aegis/snowflake.hpp"
 #include "aegis/gateway/objects/emoji.hpp"
+#include "aegis/gateway/objects/message.hpp"
+#include <memory>
 
 namespace aegis
 {
@@ -33,6 +35,7 @@ struct message_reaction_remove
     snowflake message_id;
     snowflake guild_id;
     objects::emoji emoji;
+    std::shared_ptr<const objects::message> cached; /**< Reacted to message if the message cache held it */
 };
 
 }
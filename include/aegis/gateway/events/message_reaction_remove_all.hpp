@@ -12,6 +12,8 @@
 #include "aegis/config.hpp"
 #include "aegis/fwd.hpp"
 #include "aegis/snowflake.hpp"
+#include "aegis/gateway/objects/message.hpp"
+#include <memory>
 
 namespace aegis
 {
@@ -30,6 +32,7 @@ struct message_reaction_remove_all
     snowflake channel_id;
     snowflake message_id;
     snowflake guild_id;
+    std::shared_ptr<const objects::message> cached; /**< Reacted to message if the message cache held it */
 };
 
 }
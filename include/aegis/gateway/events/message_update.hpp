@@ -13,6 +13,7 @@
 #include "aegis/fwd.hpp"
 #include "aegis/gateway/objects/message.hpp"
 #include <nlohmann/json.hpp>
+#include <memory>
 
 namespace aegis
 {
@@ -31,6 +32,7 @@ struct message_update
     aegis::channel & channel; /**< Reference to channel object this message came from */
     lib::optional<std::reference_wrapper<aegis::user>> user; /**< Cached user object */
     objects::message msg; /**< Message object */
+    std::shared_ptr<const objects::message> cached; /**< Message before the update if the message cache held it */
 };
 
 }
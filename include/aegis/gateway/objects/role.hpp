@@ -12,6 +12,7 @@
 #include "aegis/config.hpp"
 #include "aegis/snowflake.hpp"
 #include "aegis/permission.hpp"
+#include "aegis/intern.hpp"
 #include <nlohmann/json.hpp>
 
 namespace aegis
@@ -50,7 +51,7 @@ struct role
     uint32_t color = 0;
     snowflake id;
     snowflake role_id;
-    std::string name;
+    interned_string name; /**< Interned, as role names repeat across guilds */
     aegis::permission _permission;
     uint16_t position = 0;
     bool hoist = false;
@@ -66,7 +67,7 @@ inline void from_json(const nlohmann::json& j, role& m)
     if (j.count("id") && !j["id"].is_null())
         m.id = m.role_id = j["id"];
     if (j.count("name") && !j["name"].is_null())
-        m.name = j["name"];
+        m.name.assign(j["name"].get<std::string>());
     if (j.count("permissions") && !j["permissions"].is_null())
         m._permission = j["permissions"];
     if (j.count("position") && !j["position"].is_null())
@@ -81,7 +82,7 @@ inline void to_json(nlohmann::json& j, const role& m)
 {
     j["color"] = m.color;
     j["id"] = std::to_string(m.id);
-    j["name"] = m.name;
+    j["name"] = m.name.value();
     j["permissions"] = m._permission;
     j["position"] = m.position;
     j["hoist"] = m.hoist;
@@ -13,6 +13,12 @@
 #include "aegis/utility.hpp"
 #include "aegis/gateway/objects/role.hpp"
 #include "aegis/snowflake.hpp"
+#include "aegis/flat_map.hpp"
+#include "aegis/slab.hpp"
+#include "aegis/user.hpp"
+#include "aegis/role_table.hpp"
+#include "aegis/role_index.hpp"
+#include "aegis/permission_cache.hpp"
 #include "aegis/rest/rest_reply.hpp"
 #include "aegis/ratelimit/ratelimit.hpp"
 #include "aegis/gateway/objects/permission_overwrite.hpp"
@@ -174,6 +180,10 @@ public:
     guild(guild &&) = delete;
     guild & operator=(const guild &) = delete;
 
+    /// Guilds are allocated from a slab. See aegis::slab
+    static void * operator new(std::size_t size) { return slab<guild>::instance().allocate(size); }
+    static void operator delete(void * p, std::size_t size) noexcept { slab<guild>::instance().deallocate(p, size); }
+
     int32_t shard_id; /*< shard that receives this guild's messages */
     snowflake guild_id; /*< snowflake of this guild */
 
@@ -245,6 +255,21 @@ public:
      */
     AEGIS_DECL bool member_has_role(snowflake member_id, snowflake role_id) const noexcept;
 
+    /// Get the members that have a role
+    /**
+     * Answered from an index of the members of each role, without scanning the guild
+     * @param role_id Snowflake of role
+     * @returns Snowflakes of the cached members that have the role
+     */
+    AEGIS_DECL std::vector<snowflake> get_role_members(snowflake role_id) const;
+
+    /// Get count of cached members that have a role
+    /**
+     * @param role_id Snowflake of role
+     * @returns Count of cached members that have the role
+     */
+    AEGIS_DECL std::size_t get_role_member_count(snowflake role_id) const noexcept;
+
     /// Get count of members in guild (potentially inaccurate)
     /**
      * @returns Count of members in guild
@@ -267,13 +292,41 @@ public:
      */
     AEGIS_DECL permission get_permissions(const user * _member, const channel * _channel) const;
 
+    /// Get guild permissions of every cached member in a channel
+    /**
+     * Evaluates all members in one pass. Role masks and role overwrites are resolved once for the
+     * channel instead of once per member, which makes this much faster than calling
+     * get_permissions() for each member of a large guild.
+     * @param channel_id Snowflake of channel
+     * @returns Snowflake and permissions of each member. Empty if the channel is not cached
+     */
+    AEGIS_DECL std::vector<std::pair<snowflake, permission>> get_channel_permissions(snowflake channel_id) const;
+
+    /// Get guild permissions of some members in a channel
+    /**
+     * @see get_channel_permissions(snowflake) const
+     * @param channel_id Snowflake of channel
+     * @param member_ids Snowflakes of members
+     * @returns Snowflake and permissions of each member in the order given. Members that are not
+     * cached get no permissions. Empty if the channel is not cached
+     */
+    AEGIS_DECL std::vector<std::pair<snowflake, permission>> get_channel_permissions(snowflake channel_id, const std::vector<snowflake> & member_ids) const;
+
+    /// Get the cache of computed permissions, for its hit and miss counts
+    /**
+     * @returns Reference to the permission cache of this guild
+     */
+    const permission_cache & get_permission_cache() const noexcept
+    {
+        return _perm_cache;
+    }
+
     /// Get base guild permissions for member
     /**
      * @param _member Pointer to member object
      */
     int64_t base_permissions() const
     {
-        std::shared_lock<shared_mutex> l(_m);
         return base_permissions(self());
     }
 
@@ -283,7 +336,6 @@ public:
  */
     int64_t base_permissions(const user * _member) const noexcept
     {
-        std::shared_lock<shared_mutex> l(_m);
         return base_permissions(*_member);
     }
 
@@ -695,52 +747,52 @@ public:
 
     /// Obtain map of channels
     /**
-     * @returns unordered_map<snowflake, channel*> COPY of channels
+     * @returns flat_map<snowflake, channel*> COPY of channels
      */
-    std::unordered_map<snowflake, channel*> get_channels() const noexcept
+    flat_map<snowflake, channel*> get_channels() const noexcept
     {
         std::shared_lock<shared_mutex> l(_m);
-        std::unordered_map<snowflake, channel*> _list = channels;
+        flat_map<snowflake, channel*> _list = channels;
         return std::move(_list);
     }
 
 #if !defined(AEGIS_DISABLE_ALL_CACHE)
     /// Obtain map of members
     /**
-     * @returns unordered_map<snowflake, user*> COPY of members
+     * @returns flat_map<snowflake, user*> COPY of members
      */
-    std::unordered_map<snowflake, user*> get_members() const noexcept
+    flat_map<snowflake, user*> get_members() const noexcept
     {
         std::shared_lock<shared_mutex> l(_m);
-        std::unordered_map<snowflake, user*> _list = members;
+        flat_map<snowflake, user*> _list = members;
         return std::move(_list);
     }
 
     /// Obtain map of roles
     /**
-     * @returns unordered_map<snowflake, gateway::objects::role> COPY of roles
+     * @returns flat_map<snowflake, gateway::objects::role> COPY of roles
      */
-    std::unordered_map<snowflake, gateway::objects::role> get_roles() const noexcept
+    flat_map<snowflake, gateway::objects::role> get_roles() const noexcept
     {
         std::shared_lock<shared_mutex> l(_m);
-        std::unordered_map<snowflake, gateway::objects::role> _list = roles;
+        flat_map<snowflake, gateway::objects::role> _list = roles;
         return std::move(_list);
     }
 
     /// Obtain map of members - caller must lock guild._m to ensure no race conditions
     /**
-     * @returns unordered_map<snowflake, user*> of members
+     * @returns flat_map<snowflake, user*> of members
      */
-    const std::unordered_map<snowflake, user*> & get_members_nocopy() const noexcept
+    const flat_map<snowflake, user*> & get_members_nocopy() const noexcept
     {
         return members;
     }
 
     /// Obtain map of roles - caller must lock guild._m to ensure no race conditions
     /**
-     * @returns unordered_map<snowflake, gateway::objects::role> of roles
+     * @returns flat_map<snowflake, gateway::objects::role> of roles
      */
-    const std::unordered_map<snowflake, gateway::objects::role> & get_roles_nocopy() const noexcept
+    const flat_map<snowflake, gateway::objects::role> & get_roles_nocopy() const noexcept
     {
         return roles;
     }
@@ -748,9 +800,9 @@ public:
 
     /// Obtain map of channels - caller must lock guild._m to ensure no race conditions
     /**
-     * @returns unordered_map<snowflake, channel*> of channels
+     * @returns flat_map<snowflake, channel*> of channels
      */
-    const std::unordered_map<snowflake, channel*> & get_channels_nocopy() const noexcept
+    const flat_map<snowflake, channel*> & get_channels_nocopy() const noexcept
     {
         return channels;
     }
@@ -763,12 +815,18 @@ public:
 private:
     friend class core;
     friend class user;
+    friend class snapshot;
 
-    std::unordered_map<snowflake, channel*> channels; /**< Map of snowflakes to channel objects */
+    flat_map<snowflake, channel*> channels; /**< Map of snowflakes to channel objects */
 #if !defined(AEGIS_DISABLE_ALL_CACHE)
-    std::unordered_map<snowflake, user*> members; /**< Map of snowflakes to member objects */
-    std::unordered_map<snowflake, gateway::objects::role> roles; /**< Map of snowflakes to role objects */
-    std::unordered_map<snowflake, gateway::objects::emoji> emojis; /**< Map of snowflakes to emoji objects */
+    flat_map<snowflake, user*> members; /**< Map of snowflakes to member objects */
+    flat_map<snowflake, std::unique_ptr<user::guild_info>> member_info; /**< Guild specific information of each member */
+    flat_map<snowflake, gateway::objects::role> roles; /**< Map of snowflakes to role objects */
+    role_table _role_table; /**< Allow masks of the roles, kept in step with roles */
+    role_index _role_index; /**< Members of each role, kept in step with the roles in member_info */
+    uint64_t _perm_generation = permission_cache::next_generation(); /**< Replaced whenever roles or the owner change */
+    mutable permission_cache _perm_cache; /**< Computed permissions of members in channels */
+    flat_map<snowflake, gateway::objects::emoji> emojis; /**< Map of snowflakes to emoji objects */
 #endif
 
 #if !defined(AEGIS_DISABLE_ALL_CACHE)
@@ -778,6 +836,12 @@ private:
 
     AEGIS_DECL void _remove_member(snowflake member_id) noexcept;
 
+    /// Get the guild information of a member, creating it if missing - caller must lock guild._m
+    AEGIS_DECL user::guild_info & _member_info_nolock(snowflake member_id);
+
+    /// Find the guild information of a member - caller must lock guild._m
+    AEGIS_DECL user::guild_info * _find_member_info(snowflake member_id) const noexcept;
+
     AEGIS_DECL void _load_presence(const json & obj) noexcept;
 
     AEGIS_DECL void _load_emoji(const json & obj) noexcept;
@@ -785,6 +849,27 @@ private:
     AEGIS_DECL void _load_role(const json & obj) noexcept;
 
     AEGIS_DECL void _remove_role(snowflake role_id) noexcept;
+
+    /// Replace the roles of a member from a member object - caller must lock guild._m and the member's mutex
+    AEGIS_DECL void _set_member_roles(user::guild_info & g, const json & member_roles);
+
+    /// Base permissions of a member - caller must lock guild._m and the member's mutex
+    AEGIS_DECL int64_t _base_permissions(snowflake member_id, const user::guild_info * g) const noexcept;
+
+    /// Apply the overwrites of a channel - caller must lock guild._m and the member's mutex
+    AEGIS_DECL int64_t _compute_overwrites(int64_t _base_permissions, snowflake member_id, const user::guild_info * g, const channel & _channel) const noexcept;
+
+    /// Permissions of a member in a channel through the permission cache - caller must lock guild._m and the member's mutex
+    AEGIS_DECL int64_t _get_permissions(snowflake member_id, const user::guild_info * g, const channel & _channel) const;
+
+    /// Overwrites of a channel resolved against the role table
+    struct channel_masks;
+
+    /// Resolve the overwrites of a channel - caller must lock guild._m and channel._m
+    AEGIS_DECL void _channel_masks(const channel & _channel, channel_masks & masks) const;
+
+    /// Permissions of a member from resolved channel masks - caller must lock guild._m, channel._m and the member's mutex
+    AEGIS_DECL int64_t _masked_permissions(const channel_masks & masks, const channel & _channel, snowflake member_id, const user::guild_info * g) const noexcept;
 #endif
 
     AEGIS_DECL void _load(const json & obj, shards::shard * _shard) noexcept;
@@ -816,6 +901,7 @@ private:
     uint32_t member_count = 0;
     //std::string m_voice_states;//this is really an array
     bool is_init = true;
+    bool _restored = false; /**< Loaded from a snapshot and not yet sent by the gateway */
 #endif
     core * _bot;
     asio::io_context & _io_context;
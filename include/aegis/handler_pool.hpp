@@ -0,0 +1,192 @@
+//
+// handler_pool.hpp
+// ****************
+//
+// Copyright (c) 2019 Sharon W (sharon at aegis dot gg)
+//
+// Distributed under the MIT License. (See accompanying file LICENSE)
+//
+
+#pragma once
+
+#include "aegis/config.hpp"
+#include "aegis/scheduler.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace aegis
+{
+
+/// What a handler_pool does with work arriving while it is full
+enum class overflow_policy
+{
+    defer, /**< Leave events in the shard's event queue until there is room. See wait_for_room() */
+    block, /**< Wait for room. For event handlers this parks a network thread */
+    drop, /**< Discard the work and count it */
+    caller_runs /**< Run the work on the posting thread. For event handlers that is a network thread, so a slow handler holds up websocket reads and heartbeats */
+};
+
+/// Bounded pool running user event handlers away from the network threads
+/**
+ * Handlers that block (database calls, synchronous REST) only hold up other handlers and
+ * never the io_context threads servicing websocket reads, heartbeats and REST sockets.
+ * At most `capacity` handlers are queued or running at once. Beyond that the overflow
+ * policy applies.
+ *
+ * Under overflow_policy::defer the poster checks has_room() before taking on more work and
+ * registers with wait_for_room() when there is none. post() itself never refuses work, so
+ * posters racing for the last slot can overshoot the capacity by one handler each.
+ */
+class handler_pool
+{
+public:
+    /// Start a handler pool
+    /**
+     * @param threads Amount of handler threads
+     * @param capacity Maximum amount of handlers queued or running
+     * @param policy What to do with handlers arriving while full
+     */
+    AEGIS_DECL handler_pool(std::size_t threads, std::size_t capacity, overflow_policy policy);
+
+    handler_pool(const handler_pool &) = delete;
+    handler_pool & operator=(const handler_pool &) = delete;
+
+    /// Queue a handler
+    /**
+     * @param func Callable taking no arguments
+     * @returns false if the handler was dropped
+     */
+    template<typename Func>
+    bool post(Func && func)
+    {
+        if (!_acquire())
+        {
+            if (_policy == overflow_policy::caller_runs)
+            {
+                _caller_ran.fetch_add(1, std::memory_order_relaxed);
+                func();
+                return true;
+            }
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        try
+        {
+            _sched.post([this, func = std::forward<Func>(func)]() mutable
+            {
+                release_guard g{ this };
+                func();
+            });
+        }
+        catch (...)
+        {
+            _release();
+            throw;
+        }
+        return true;
+    }
+
+    /// Check if a handler can be posted without exceeding the capacity
+    bool has_room() const noexcept
+    {
+        return _inflight.load(std::memory_order_seq_cst) < _capacity;
+    }
+
+    /// Check if posters are expected to wait for room rather than post
+    bool defers() const noexcept
+    {
+        return _policy == overflow_policy::defer;
+    }
+
+    /// Call a function once a handler finishes
+    /**
+     * The function runs on the handler thread that freed the slot, so it should only hand
+     * work off, e.g. post it to an io_context.
+     * @param func Callable taking no arguments
+     * @returns false without registering func if there is room already
+     */
+    AEGIS_DECL bool wait_for_room(std::function<void()> func);
+
+    /// Get the amount of handlers queued or running
+    std::size_t pending() const noexcept
+    {
+        return _inflight.load(std::memory_order_relaxed);
+    }
+
+    /// Get the maximum amount of handlers queued or running
+    std::size_t capacity() const noexcept
+    {
+        return _capacity;
+    }
+
+    /// Get the amount of handlers dropped because the pool was full
+    uint64_t dropped() const noexcept
+    {
+        return _dropped.load(std::memory_order_relaxed);
+    }
+
+    /// Get the amount of handlers that waited for room
+    uint64_t blocked() const noexcept
+    {
+        return _blocked.load(std::memory_order_relaxed);
+    }
+
+    /// Get the amount of handlers run on the posting thread because the pool was full
+    uint64_t caller_ran() const noexcept
+    {
+        return _caller_ran.load(std::memory_order_relaxed);
+    }
+
+    /// Get the amount of times a poster waited for room under overflow_policy::defer
+    uint64_t deferred() const noexcept
+    {
+        return _deferred.load(std::memory_order_relaxed);
+    }
+
+    /// Get the underlying scheduler, e.g. for its per-thread utilisation
+    scheduler & get_scheduler() noexcept
+    {
+        return _sched;
+    }
+
+private:
+    struct release_guard
+    {
+        handler_pool * pool;
+        ~release_guard()
+        {
+            pool->_release();
+        }
+    };
+
+    /// Take a slot, waiting under overflow_policy::block
+    /**
+     * @returns false if the pool is full and the policy does not wait
+     */
+    AEGIS_DECL bool _acquire();
+
+    AEGIS_DECL void _release() noexcept;
+
+    std::size_t _capacity;
+    overflow_policy _policy;
+    std::atomic<std::size_t> _inflight{ 0 };
+    std::atomic<std::size_t> _waiters{ 0 };
+    std::atomic<uint64_t> _dropped{ 0 };
+    std::atomic<uint64_t> _blocked{ 0 };
+    std::atomic<uint64_t> _caller_ran{ 0 };
+    std::atomic<uint64_t> _deferred{ 0 };
+    std::atomic<std::size_t> _room_waiters{ 0 }; /**< Size of _room_callbacks */
+    std::mutex _m;
+    std::condition_variable _cv;
+    std::vector<std::function<void()>> _room_callbacks; /**< Guarded by _m */
+    scheduler _sched; /**< Last so workers are joined before the counters go away */
+};
+
+}
+
+#if defined(AEGIS_HEADER_ONLY)
+#include "aegis/impl/handler_pool.cpp"
+#endif
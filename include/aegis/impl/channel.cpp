@@ -69,7 +69,7 @@ AEGIS_DECL void channel::_load_with_guild_nolock(guild & _guild, const json & ob
     guild_id = _guild.get_id();
     try
     {
-        if (!obj["name"].is_null()) name = obj["name"].get<std::string>();
+        if (!obj["name"].is_null()) name.assign(obj["name"].get<std::string>());
         position = obj["position"];
         type = static_cast<gateway::objects::channel::channel_type>(obj["type"].get<int>());// 0 = text, 2 = voice
 
@@ -97,6 +97,8 @@ AEGIS_DECL void channel::_load_with_guild_nolock(guild & _guild, const json & ob
         if (obj.count("permission_overwrites") && !obj["permission_overwrites"].is_null())
         {
             json permission_overwrites = obj["permission_overwrites"];
+            // the list is complete, so overwrites missing from it were deleted
+            overrides.clear();
             for (auto & permission : permission_overwrites)
             {
                 uint32_t allow = permission["allow"];
@@ -112,6 +114,7 @@ AEGIS_DECL void channel::_load_with_guild_nolock(guild & _guild, const json & ob
                 else
                     overrides[p_id].type = gateway::objects::overwrite_type::User;
             }
+            _perm_generation.store(permission_cache::next_generation(), std::memory_order_release);
         }
 
         //_channel.update_permission_cache();
@@ -10,12 +10,15 @@
 #include "aegis/config.hpp"
 #include "aegis/core.hpp"
 #include <string>
+#include <limits>
 #include <asio/streambuf.hpp>
 #include <asio/connect.hpp>
 #include "aegis/shards/shard.hpp"
 #include "aegis/guild.hpp"
 #include "aegis/channel.hpp"
 #include "aegis/user.hpp"
+#include "aegis/snapshot.hpp"
+#include "aegis/message_cache.hpp"
 
 #include <nlohmann/json.hpp>
 #include <spdlog/sinks/sink.h>
@@ -116,6 +119,7 @@ AEGIS_DECL void core::setup_shard_mgr()
                   _rest.get(),
                   std::placeholders::_1),
         get_io_context(), this);
+    _ratelimit->set_retry_policy(_retry_policy);
 
     setup_callbacks();
 }
@@ -131,6 +135,10 @@ AEGIS_DECL core::core(create_bot_t bot_config)
     force_shard_count = bot_config._force_shard_count;
     log_formatting = bot_config._log_format;
     _loglevel = bot_config._log_level;
+    _retry_policy = bot_config._retry_policy;
+    _event_queue_limit = bot_config._event_queue_limit;
+    _event_shed_threshold = bot_config._event_shed_threshold;
+    _event_queue_hard_limit = bot_config._event_queue_hard_limit;
 
     if (bot_config._log)
         log = bot_config._log;
@@ -142,6 +150,23 @@ AEGIS_DECL core::core(create_bot_t bot_config)
     else
         setup_context();
 
+    if (bot_config._scheduler_threads > 0)
+        _scheduler = std::make_unique<scheduler>(bot_config._scheduler_threads);
+
+    if (bot_config._handler_threads > 0)
+        _handler_pool = std::make_unique<handler_pool>(bot_config._handler_threads, bot_config._handler_queue_limit, bot_config._handler_overflow);
+
+    if (bot_config._presence_dedup_window.count() > 0)
+        _presence_filter = std::make_unique<presence_filter>(bot_config._presence_dedup_window);
+
+    _cache_policy = bot_config._cache_policy;
+    if (_cache_policy._messages > 0)
+        _message_cache = std::make_unique<message_cache>(_cache_policy._messages, _cache_policy._message_memory);
+#if !defined(AEGIS_DISABLE_ALL_CACHE)
+    _snapshot_path = bot_config._snapshot_path;
+    _snapshot_interval = bot_config._snapshot_interval;
+#endif
+
     setup_shard_mgr();
 }
 
@@ -202,8 +227,15 @@ AEGIS_DECL core::core(std::shared_ptr<asio::io_context> _io, std::shared_ptr<spd
 
 AEGIS_DECL core::~core()
 {
+#if !defined(AEGIS_DISABLE_ALL_CACHE)
+    _stop_snapshot_thread();
+    _stop_eviction();
+#endif
     if (_shard_mgr)
         _shard_mgr->shutdown();
+    // handlers and scheduler work may still wait on the io_context
+    _handler_pool.reset();
+    _scheduler.reset();
     wrk.reset();
     if (!external_io_context)
         if (_io_context)
@@ -216,10 +248,11 @@ AEGIS_DECL core::~core()
 #if !defined(AEGIS_DISABLE_ALL_CACHE)
 AEGIS_DECL int64_t core::get_member_count() const noexcept
 {
-    std::shared_lock<shared_mutex> l(_guild_m);
     int64_t count = 0;
-    for (auto & kv : guilds)
-        count += kv.second->get_member_count();
+    guilds.for_each([&count](const snowflake &, guild & g)
+    {
+        count += g.get_member_count();
+    });
     return count;
 }
 
@@ -240,25 +273,18 @@ AEGIS_DECL int64_t core::get_guild_count() const noexcept
 
 AEGIS_DECL user * core::find_user(snowflake id) const noexcept
 {
-    std::shared_lock<shared_mutex> l(_user_m);
-    auto it = users.find(id);
-    if (it == users.end())
-        return nullptr;
-    return it->second.get();
+    return users.find(id);
 }
 
 AEGIS_DECL user * core::user_create(snowflake id) noexcept
 {
-    std::unique_lock<shared_mutex> l(_user_m);
-    auto it = users.find(id);
-    if (it == users.end())
+    auto _user = users.find_or_create(id, [id]()
     {
-        auto g = std::make_unique<user>(id);
-        auto ptr = g.get();
-        users.emplace(id, std::move(g));
-        return ptr;
-    }
-    return it->second.get();
+        return std::make_unique<user>(id);
+    });
+    if (_cache_policy.evicts_users())
+        _user->_last_seen.store(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count(), std::memory_order_relaxed);
+    return _user;
 }
 #endif
 
@@ -285,7 +311,7 @@ AEGIS_DECL aegis::future<gateway::objects::message> core::create_dm_message(snow
 #if !defined(AEGIS_DISABLE_ALL_CACHE)
                 m->set_dm_id(reply.id);
 #endif
-                return c->create_message(content, nonce).get();
+                return c->create_message(content, nonce);
             });
     }
 }
@@ -313,7 +339,7 @@ AEGIS_DECL aegis::future<gateway::objects::message> core::create_dm_message(cons
 #if !defined(AEGIS_DISABLE_ALL_CACHE)
             m->set_dm_id(reply.id);
 #endif
-            return c->create_message(obj).get();
+            return c->create_message(obj);
         });
     }
 }
@@ -340,112 +366,175 @@ AEGIS_DECL aegis::rest::rest_reply core::call(rest::request_params && params)
 
 AEGIS_DECL channel * core::find_channel(snowflake id) const noexcept
 {
-    std::shared_lock<shared_mutex> l(_channel_m);
-    auto it = channels.find(id);
-    if (it == channels.end())
-        return nullptr;
-    return it->second.get();
+    return channels.find(id);
 }
 
 AEGIS_DECL channel * core::channel_create(snowflake id) noexcept
 {
-    std::unique_lock<shared_mutex> l(_channel_m);
-    auto it = channels.find(id);
-    if (it == channels.end())
+    return channels.find_or_create(id, [&]()
     {
-        auto g = std::make_unique<channel>(id, 0, this, *_io_context, *_ratelimit);
-        auto ptr = g.get();
-        channels.emplace(id, std::move(g));
-        return ptr;
-    }
-    return it->second.get();
+        return std::make_unique<channel>(id, 0, this, *_io_context, *_ratelimit);
+    });
 }
 
 AEGIS_DECL guild * core::find_guild(snowflake id) const noexcept
 {
-    std::shared_lock<shared_mutex> l(_guild_m);
-    auto it = guilds.find(id);
-    if (it == guilds.end())
-        return nullptr;
-    return it->second.get();
+    return guilds.find(id);
 }
 
 AEGIS_DECL guild * core::guild_create(snowflake id, shards::shard * _shard) noexcept
 {
-    std::unique_lock<shared_mutex> l(_guild_m);
-    auto it = guilds.find(id);
-    if (it == guilds.end())
+    return guilds.find_or_create(id, [&]()
     {
-        auto g = std::make_unique<guild>(_shard->get_id(), id, this, *_io_context);
-        auto ptr = g.get();
-        guilds.emplace(id, std::move(g));
-        return ptr;
-    }
-    return it->second.get();
+        return std::make_unique<guild>(_shard->get_id(), id, this, *_io_context);
+    });
 }
 
 AEGIS_DECL void core::remove_guild(snowflake guild_id) noexcept
 {
-    std::unique_lock<shared_mutex> l(_guild_m);
-    auto it = guilds.find(guild_id);
-    if (it == guilds.end())
+    auto g = guilds.extract(guild_id);
+    if (!g)
     {
         AEGIS_DEBUG(log, "Unable to remove guild [{}] (does not exist)", guild_id);
         return;
     }
-    stale_guilds.emplace(it->first, std::move(it->second));
-    guilds.erase(it);
+#if !defined(AEGIS_DISABLE_ALL_CACHE)
+    // members point at guild information owned by the guild. Detach them now, as a guild created
+    // again with this id before the reclaimer frees this one must not find that information
+    {
+        std::unique_lock<shared_mutex> l(g->mtx());
+        for (auto & kv : g->members)
+        {
+            auto gi = g->_find_member_info(kv.first);
+            std::unique_lock<shared_mutex> ul(kv.second->mtx());
+            auto it = std::find(kv.second->guilds.begin(), kv.second->guilds.end(), gi);
+            if (it != kv.second->guilds.end())
+                kv.second->guilds.erase(it);
+        }
+        g->members.clear();
+    }
+#endif
+    _reclaimer.retire(std::move(g));
 }
 
-AEGIS_DECL void core::remove_guild_nolock(snowflake guild_id) noexcept
+AEGIS_DECL void core::remove_channel(snowflake channel_id) noexcept
 {
-    auto it = guilds.find(guild_id);
-    if (it == guilds.end())
+    if (_message_cache)
+        _message_cache->remove_channel(channel_id);
+    auto c = channels.extract(channel_id);
+    if (!c)
     {
-        AEGIS_DEBUG(log, "Unable to remove guild [{}] (does not exist)", guild_id);
+        AEGIS_DEBUG(log, "Unable to remove channel [{}] (does not exist)", channel_id);
         return;
     }
-    stale_guilds.emplace(it->first, std::move(it->second));
-    guilds.erase(it);
+    _reclaimer.retire(std::move(c));
 }
 
-AEGIS_DECL void core::remove_channel(snowflake channel_id) noexcept
+#if !defined(AEGIS_DISABLE_ALL_CACHE)
+AEGIS_DECL void core::remove_member(snowflake user_id) noexcept
 {
-    std::unique_lock<shared_mutex> l(_channel_m);
-    auto it = channels.find(channel_id);
-    if (it == channels.end())
+    auto u = users.extract(user_id);
+    if (!u)
     {
-        AEGIS_DEBUG(log, "Unable to remove channel [{}] (does not exist)", channel_id);
+        AEGIS_DEBUG(log, "Unable to remove member [{}] (does not exist)", user_id);
         return;
     }
-    stale_channels.emplace(it->first, std::move(it->second));
-    channels.erase(it);
+    // guilds refer to their members, so detach first
+    std::vector<snowflake> guild_ids;
+    {
+        std::shared_lock<shared_mutex> l(u->mtx());
+        for (auto gi : u->guilds)
+            guild_ids.push_back(gi->id);
+    }
+    for (auto & id : guild_ids)
+    {
+        auto _guild = find_guild(id);
+        if (_guild != nullptr)
+            _guild->_remove_member(user_id);
+    }
+    _reclaimer.retire(std::move(u));
 }
 
-AEGIS_DECL void core::remove_channel_nolock(snowflake channel_id) noexcept
+AEGIS_DECL void core::_evict_users()
 {
-    auto it = channels.find(channel_id);
-    if (it == channels.end())
+    constexpr std::size_t sample_size = 16;
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(5);
+    const int64_t now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    const int64_t cutoff = (_cache_policy._user_ttl.count() > 0)
+        ? now - std::chrono::duration_cast<std::chrono::seconds>(_cache_policy._user_ttl).count()
+        : std::numeric_limits<int64_t>::min();
+    const snowflake self_id = _self ? _self->get_id() : snowflake();
+
+    std::size_t evicted = 0;
+    std::vector<snowflake> expired;
+    expired.reserve(sample_size);
+    while (!users.empty() && std::chrono::steady_clock::now() < deadline)
     {
-        AEGIS_DEBUG(log, "Unable to remove channel [{}] (does not exist)", channel_id);
-        return;
+        const bool over_limit = _cache_policy._user_limit > 0 && users.size() > _cache_policy._user_limit;
+        std::size_t sampled = 0;
+        int64_t oldest_seen = std::numeric_limits<int64_t>::max();
+        snowflake oldest;
+        expired.clear();
+        for (std::size_t i = 0; i < sample_size; ++i)
+        {
+            users.sample(_eviction_rng(), [&](const snowflake & id, user & _user)
+            {
+                if (id == self_id)
+                    return;
+                ++sampled;
+                const auto seen = _user._last_seen.load(std::memory_order_relaxed);
+                if (seen < cutoff)
+                    expired.push_back(id);
+                else if (seen < oldest_seen)
+                {
+                    oldest_seen = seen;
+                    oldest = id;
+                }
+            });
+        }
+
+        // the same user can be drawn twice, remove_member ignores the second
+        for (auto & id : expired)
+            remove_member(id);
+        evicted += expired.size();
+        if (over_limit && oldest_seen != std::numeric_limits<int64_t>::max())
+        {
+            remove_member(oldest);
+            ++evicted;
+        }
+
+        // keep going while over the limit or while a quarter of the sample had expired
+        if (!over_limit && expired.size() * 4 < sampled + 1)
+            break;
     }
-    stale_channels.emplace(it->first, std::move(it->second));
-    channels.erase(it);
+
+    if (evicted > 0)
+        AEGIS_DEBUG(log, "Evicted {} users, {} remain", evicted, users.size());
 }
 
-#if !defined(AEGIS_DISABLE_ALL_CACHE)
-AEGIS_DECL void core::remove_member(snowflake user_id) noexcept
+AEGIS_DECL void core::_schedule_eviction()
 {
-    std::unique_lock<shared_mutex> l(_user_m);
-    auto it = users.find(user_id);
-    if (it == users.end())
+    std::lock_guard<std::mutex> l(_eviction_m);
+    if (_eviction_timer == nullptr)
+        return;
+    _eviction_timer->expires_after(std::chrono::seconds(1));
+    _eviction_timer->async_wait([this](const asio::error_code & ec)
     {
-        AEGIS_DEBUG(log, "Unable to remove member [{}] (does not exist)", user_id);
+        if (ec == asio::error::operation_aborted || get_state() == aegis::bot_status::shutdown)
+            return;
+        _evict_users();
+        _schedule_eviction();
+    });
+}
+
+AEGIS_DECL void core::_stop_eviction() noexcept
+{
+    std::lock_guard<std::mutex> l(_eviction_m);
+    if (_eviction_timer == nullptr)
         return;
-    }
-    stale_users.emplace(it->first, std::move(it->second));
-    users.erase(it);
+    asio::error_code ec;
+    _eviction_timer->cancel(ec);
+    _eviction_timer.reset();
 }
 #endif
 
@@ -460,9 +549,55 @@ AEGIS_DECL void core::run()
     set_state(bot_status::running);
 
     starttime = std::chrono::steady_clock::now();
+
+#if !defined(AEGIS_DISABLE_ALL_CACHE)
+    if (!_snapshot_path.empty())
+    {
+        // shards are not connected yet, so nothing else touches the caches
+        try
+        {
+            if (snapshot::load(*this, _snapshot_path))
+                log->info("Restored {} guilds, {} channels and {} users from {}", guilds.size(), channels.size(), users.size(), _snapshot_path);
+        }
+        catch (std::exception & e)
+        {
+            log->error("Unable to restore cache snapshot, starting cold: {}", e.what());
+            guilds.clear();
+            channels.clear();
+            users.clear();
+        }
+        _start_snapshot_thread();
+    }
+    if (_cache_policy.evicts_users())
+    {
+        {
+            std::lock_guard<std::mutex> l(_eviction_m);
+            _eviction_timer = std::make_unique<asio::steady_timer>(*_io_context);
+        }
+        _schedule_eviction();
+    }
+#endif
     
     log->info("Starting shard manager with {} shards", _shard_mgr->shard_max_count);
     _shard_mgr->start();
+    for (auto & _shard : _shard_mgr->get_shards())
+        _shard->get_event_queue().set_limits(_event_queue_limit, _event_shed_threshold, _event_queue_hard_limit);
+}
+
+AEGIS_DECL shards::event_queue::stats core::get_event_queue_stats() const
+{
+    shards::event_queue::stats res;
+    for (auto & _shard : _shard_mgr->get_shards())
+    {
+        auto s = _shard->get_event_queue().get_stats();
+        res.depth += s.depth;
+        res.high_water = (std::max)(res.high_water, s.high_water);
+        res.queued += s.queued;
+        res.coalesced += s.coalesced;
+        res.dropped += s.dropped;
+        res.pauses += s.pauses;
+    }
+    return res;
 }
 
 
@@ -574,9 +709,69 @@ AEGIS_DECL void core::shutdown() noexcept
 {
     set_state(bot_status::shutdown);
     _shard_mgr->shutdown();
+#if !defined(AEGIS_DISABLE_ALL_CACHE)
+    _stop_eviction();
+    if (!_snapshot_path.empty())
+    {
+        _stop_snapshot_thread();
+        _save_snapshot();
+    }
+#endif
     cv.notify_all();
 }
 
+#if !defined(AEGIS_DISABLE_ALL_CACHE)
+AEGIS_DECL void core::_save_snapshot() noexcept
+{
+    std::lock_guard<std::mutex> l(_snapshot_m);
+    try
+    {
+        const auto start = std::chrono::steady_clock::now();
+        const auto size = snapshot::save(*this, _snapshot_path);
+        AEGIS_DEBUG(log, "Saved cache snapshot to {} ({} bytes in {}ms)", _snapshot_path, size,
+                    std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+        // AEGIS_DEBUG expands to nothing in release builds
+        (void)start;
+        (void)size;
+    }
+    catch (std::exception & e)
+    {
+        log->error("Unable to save cache snapshot: {}", e.what());
+    }
+}
+
+AEGIS_DECL void core::_start_snapshot_thread()
+{
+    if (_snapshot_interval.count() <= 0 || _snapshot_thread.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> l(_snapshot_wait_m);
+        _snapshot_stop = false;
+    }
+    _snapshot_thread = std::thread([this]
+    {
+        std::unique_lock<std::mutex> l(_snapshot_wait_m);
+        while (!_snapshot_cv.wait_for(l, _snapshot_interval, [this] { return _snapshot_stop; }))
+        {
+            l.unlock();
+            _save_snapshot();
+            l.lock();
+        }
+    });
+}
+
+AEGIS_DECL void core::_stop_snapshot_thread() noexcept
+{
+    {
+        std::lock_guard<std::mutex> l(_snapshot_wait_m);
+        _snapshot_stop = true;
+    }
+    _snapshot_cv.notify_all();
+    if (_snapshot_thread.joinable() && _snapshot_thread.get_id() != std::this_thread::get_id())
+        _snapshot_thread.join();
+}
+#endif
+
 AEGIS_DECL void core::setup_gateway()
 {
 	try
@@ -677,8 +872,7 @@ AEGIS_DECL void core::process_ready(const json & d, shards::shard * _shard)
             mention = ss.str();
         }
 
-	_self = user_create(user_id);
-        users.emplace(user_id, std::move(m));
+        _self = user_create(user_id);
         _self->_member_id = user_id;
         _self->_is_bot = true;
         _self->_name = username;
@@ -712,6 +906,41 @@ AEGIS_DECL void core::process_ready(const json & d, shards::shard * _shard)
                       , guildobj["name"].get<std::string>());
         }
     }
+
+#if !defined(AEGIS_DISABLE_ALL_CACHE)
+    // guilds restored from a snapshot that READY does not list for this shard were left while offline
+    std::vector<snowflake> listed;
+    listed.reserve(guilds.size());
+    for (auto & guildobj : guilds)
+        listed.push_back(guildobj["id"].get<snowflake>());
+    std::sort(listed.begin(), listed.end());
+
+    const auto shard_count = (std::max)(_shard_mgr->shard_max_count, uint32_t(1));
+    std::vector<guild *> candidates;
+    this->guilds.for_each([&](const snowflake & id, guild & _guild)
+    {
+        if (static_cast<uint64_t>(id.get() >> 22) % shard_count == static_cast<uint64_t>(_shard->get_id())
+            && !std::binary_search(listed.begin(), listed.end(), id))
+            candidates.push_back(&_guild);
+    });
+
+    for (auto _guild : candidates)
+    {
+        std::vector<snowflake> channel_ids;
+        {
+            std::shared_lock<shared_mutex> l(_guild->mtx());
+            if (!_guild->_restored)
+                continue;
+            for (auto & c : _guild->channels)
+                channel_ids.push_back(c.first);
+        }
+        const auto guild_id = _guild->guild_id;
+        AEGIS_DEBUG(log, "Shard#{} : Dropping restored guild {} not present in READY", _shard->get_id(), guild_id);
+        for (auto & id : channel_ids)
+            remove_channel(id);
+        remove_guild(guild_id);
+    }
+#endif
 }
 
 AEGIS_DECL aegis::future<gateway::objects::guild> core::create_guild(create_guild_t obj)
@@ -749,7 +978,7 @@ AEGIS_DECL channel * core::dm_channel_create(const json & obj, shards::shard * _
         std::unique_lock<shared_mutex> l(_channel->mtx());
 #if !defined(AEGIS_DISABLE_ALL_CACHE)
         AEGIS_DEBUG(log, "Shard#{} : Channel[{}] created for DirectMessage", _shard->get_id(), channel_id);
-        if (obj.count("name") && !obj["name"].is_null()) _channel->name = obj["name"].get<std::string>();
+        if (obj.count("name") && !obj["name"].is_null()) _channel->name.assign(obj["name"].get<std::string>());
         _channel->type = static_cast<gateway::objects::channel::channel_type>(obj["type"].get<int>());// 0 = text, 2 = voice
 
         if (!obj["last_message_id"].is_null()) _channel->last_message_id = obj["last_message_id"];
@@ -816,34 +1045,42 @@ AEGIS_DECL void core::on_message(websocketpp::connection_hdl hdl, std::string ms
                 {
                     //message id found
                     ++message_count[cmd];
-                    asio::post(*_io_context, [=, res = std::move(result)]()
+
+                    shards::event_traits traits;
+                    const auto tr = _event_traits.find(cmd);
+                    if (tr != _event_traits.end())
+                        traits = tr->second;
+
+                    // GUILD_CREATE/UPDATE/DELETE carry the guild as their own id
+                    const json & d = result["d"];
+                    int64_t guild_id = 0;
+                    if (d.is_object())
                     {
-                        if (get_state() == aegis::bot_status::shutdown)
-                            return;
+                        const auto g = d.find("guild_id");
+                        if (g != d.end() && !g->is_null())
+                            guild_id = g->get<snowflake>().get();
+                        else if (cmd.compare(0, 6, "GUILD_") == 0 && d.count("id"))
+                            guild_id = d["id"].get<snowflake>().get();
+                    }
 
-                        try
-                        {
-#if defined(AEGIS_PROFILING)
-                            auto s_t = std::chrono::steady_clock::now();
-                            (it->second)(res, _shard);
-                            if (message_end)
-                                message_end(s_t, cmd);
-#else
-                            (it->second)(res, _shard);
-#endif
-                        }
-                        catch (std::exception& e)
-                        {
-                            log->error("Failed to process object: {0}", e.what());
-                            log->error(res.dump());
-                            debug_trace(_shard);
-                        }
-                        catch (...)
-                        {
-                            log->error("Failed to process object: Unknown error");
-                            debug_trace(_shard);
-                        }
-                    });
+                    shards::event_queue::key_type key;
+                    if (traits.policy == shards::event_policy::coalesce)
+                    {
+                        key.first = guild_id;
+                        if (d.count("user"))
+                            key.second = d["user"]["id"].get<snowflake>().get();
+                        else if (d.count("id"))
+                            key.second = d["id"].get<snowflake>().get();
+                    }
+
+                    auto & queue = _shard->get_event_queue();
+                    if (queue.push(cmd, std::move(result), traits, guild_id, key))
+                        asio::post(*_io_context, [this, _shard]() { _drain_events(_shard); });
+                    if (queue.take_pause())
+                    {
+                        log->warn("Shard#{}: event queue reached {} events, pausing reads", _shard->get_id(), queue.size());
+                        _shard->get_connection()->pause_reading();
+                    }
                 }
                 else
                 {
@@ -966,6 +1203,78 @@ AEGIS_DECL void core::on_message(websocketpp::connection_hdl hdl, std::string ms
     }
 }
 
+AEGIS_DECL void core::_drain_events(shards::shard * _shard)
+{
+    auto & queue = _shard->get_event_queue();
+    const auto resume = [&]()
+    {
+        if (!queue.take_resume())
+            return;
+        auto conn = _shard->get_connection();
+        if (conn != nullptr)
+            conn->resume_reading();
+    };
+    resume();
+
+    // bounded batch so one busy shard does not hold an io thread indefinitely
+    shards::event_queue::entry e;
+    for (int n = 0; n < 64; ++n)
+    {
+        // with the handler pool full the events stay queued, where the hard limit pauses reading,
+        // and the pool restarts the drain once a handler finishes
+        if (_handler_pool && _handler_pool->defers() && !_handler_pool->has_room()
+            && _handler_pool->wait_for_room([this, _shard]() { asio::post(*_io_context, [this, _shard]() { _drain_events(_shard); }); }))
+        {
+            _reclaimer.collect();
+            return;
+        }
+        if (!queue.pop(e))
+        {
+            resume();
+            _reclaimer.collect();
+            return;
+        }
+        if (get_state() == aegis::bot_status::shutdown)
+            continue;
+        _process_event(e.type, e.payload, _shard);
+    }
+    _reclaimer.collect();
+    asio::post(*_io_context, [this, _shard]() { _drain_events(_shard); });
+}
+
+AEGIS_DECL void core::_process_event(const std::string & cmd, const json & res, shards::shard * _shard)
+{
+    const auto it = ws_handlers.find(cmd);
+    if (it == ws_handlers.end())
+        return;
+
+    // keeps anything this event removes from the caches alive until its handlers are done
+    auto pin = _reclaimer.pin();
+
+    try
+    {
+#if defined(AEGIS_PROFILING)
+        auto s_t = std::chrono::steady_clock::now();
+        (it->second)(res, _shard);
+        if (message_end)
+            message_end(s_t, cmd);
+#else
+        (it->second)(res, _shard);
+#endif
+    }
+    catch (std::exception& e)
+    {
+        log->error("Failed to process object: {0}", e.what());
+        log->error(res.dump());
+        debug_trace(_shard);
+    }
+    catch (...)
+    {
+        log->error("Failed to process object: Unknown error");
+        debug_trace(_shard);
+    }
+}
+
 AEGIS_DECL void core::debug_trace(shards::shard * _shard) noexcept
 {
     _shard_mgr->debug_trace(_shard);
@@ -1107,19 +1416,20 @@ AEGIS_DECL uint64_t core::get_shard_u_transfer() const noexcept
 
 AEGIS_DECL void core::_thread_track(thread_state * t_state)
 {
+    _current_thread() = t_state;
     try
     {
-//        while (t_state->active)
-        t_state->fn();
+        // one handler at a time, so reduce_threads() can end the thread between them
+        while (t_state->active && !_io_context->stopped())
+            t_state->fn();
     }
     catch (std::exception & e)
     {
         log->critical("Scheduler thread exit due to exception: {}", e.what());
     }
-    catch (int)
-    {
-    }
-    t_state->active = false;
+    if (t_state->active.exchange(false))
+        --_run_threads;
+    _current_thread() = nullptr;
 }
 
 AEGIS_DECL std::size_t core::add_run_thread() noexcept
@@ -1127,8 +1437,9 @@ AEGIS_DECL std::size_t core::add_run_thread() noexcept
     std::unique_ptr<thread_state> t = std::make_unique<thread_state>();
     t->active = true;
     t->start_time = std::chrono::steady_clock::now();
-    t->fn = std::bind(static_cast<asio::io_context::count_type(asio::io_context::*)()>(&asio::io_context::run),
+    t->fn = std::bind(static_cast<asio::io_context::count_type(asio::io_context::*)()>(&asio::io_context::run_one),
                       _io_context.get());
+    ++_run_threads;
     t->thd = std::thread(std::bind(&core::_thread_track, this, t.get()));
     threads.emplace_back(std::move(t));
     return threads.size();
@@ -1136,11 +1447,24 @@ AEGIS_DECL std::size_t core::add_run_thread() noexcept
 
 AEGIS_DECL void core::reduce_threads(std::size_t count) noexcept
 {
-    for (uint32_t i = 0; i < count; ++i)
-        asio::post(*_io_context, []
+    for (std::size_t i = 0; i < count; ++i)
+        _post_thread_stop();
+}
+
+AEGIS_DECL void core::_post_thread_stop()
+{
+    asio::post(*_io_context, [this]
+    {
+        auto t_state = _current_thread();
+        if (t_state != nullptr && t_state->active.exchange(false))
         {
-            throw 1;
-        });
+            --_run_threads;
+            return;
+        }
+        // picked up by a thread we do not manage, pass it on while one of ours is left
+        if (_run_threads > 0)
+            _post_thread_stop();
+    });
 }
 
 AEGIS_DECL void core::on_close(websocketpp::connection_hdl hdl, shards::shard * _shard)
@@ -1158,37 +1482,54 @@ AEGIS_DECL void core::ws_presence_update(const json & result, shards::shard * _s
 {
     _shard->counters.presence_changes++;
 
-#if !defined(AEGIS_DISABLE_ALL_CACHE)
-    json user = result["d"]["user"];
-    snowflake guild_id = result["d"]["guild_id"];
-    snowflake member_id = user["id"];
-    auto _member = user_create(member_id);
-    auto  _guild = find_guild(guild_id);
-    if (_guild == nullptr)
+    // same presence relayed for another shared guild. only skip it once the member is
+    // known to be in that guild so the member lists still fill from presences
+    if (_presence_filter
+        && _presence_filter->repeat(result["d"]["user"]["id"], presence_filter::signature(result["d"])))
     {
-        log->warn("Shard#{}: member without guild M:{} G:{} null:{}", _shard->get_id(), member_id, guild_id, _member == nullptr);
+#if !defined(AEGIS_DISABLE_ALL_CACHE)
+        auto _member = find_user(result["d"]["user"]["id"]);
+        if (_member != nullptr && _member->get_guild_info_nocreate(result["d"]["guild_id"]) != nullptr)
+            return;
+#else
         return;
+#endif
     }
-    std::unique_lock<shared_mutex> l(_member->mtx(), std::defer_lock);
-    std::unique_lock<shared_mutex> l2(_guild->mtx(), std::defer_lock);
-    std::lock(l, l2);
-    _member->_load_nolock(_guild, result["d"], _shard, true, false);
 
-    using user_status = aegis::gateway::objects::presence::user_status;
+#if !defined(AEGIS_DISABLE_ALL_CACHE)
+    if (_cache_policy._presences)
+    {
+        json user = result["d"]["user"];
+        snowflake guild_id = result["d"]["guild_id"];
+        snowflake member_id = user["id"];
+        auto _member = user_create(member_id);
+        auto  _guild = find_guild(guild_id);
+        if (_guild == nullptr)
+        {
+            log->warn("Shard#{}: member without guild M:{} G:{} null:{}", _shard->get_id(), member_id, guild_id, _member == nullptr);
+            return;
+        }
+        std::unique_lock<shared_mutex> l(_member->mtx(), std::defer_lock);
+        std::unique_lock<shared_mutex> l2(_guild->mtx(), std::defer_lock);
+        std::lock(l, l2);
+        _member->_load_nolock(_cache_policy.cache_members(_guild->member_count) ? _guild : nullptr, result["d"], _shard, true, false);
 
-    const std::string & sts = result["d"]["status"];
+        using user_status = aegis::gateway::objects::presence::user_status;
 
-    if (sts == "idle")
-        _member->_status = user_status::Idle;
-    else if (sts == "dnd")
-        _member->_status = user_status::DoNotDisturb;
-    else if (sts == "online")
-        _member->_status = user_status::Online;
-    else
-        _member->_status = user_status::Offline;
+        const std::string & sts = result["d"]["status"];
+
+        if (sts == "idle")
+            _member->_status = user_status::Idle;
+        else if (sts == "dnd")
+            _member->_status = user_status::DoNotDisturb;
+        else if (sts == "online")
+            _member->_status = user_status::Online;
+        else
+            _member->_status = user_status::Offline;
 
-    //TODO: this is where rich presence might be stored if it's relevant to do so
-    //_member->rich_presence = result["d"]["game"]; //activity object
+        //TODO: this is where rich presence might be stored if it's relevant to do so
+        //_member->rich_presence = result["d"]["game"]; //activity object
+    }
 #endif
 
     gateway::events::presence_update obj{*_shard};
@@ -1206,8 +1547,7 @@ AEGIS_DECL void core::ws_presence_update(const json & result, shards::shard * _s
             obj.roles.push_back(_role);
 
 
-    if (i_presence_update)
-        i_presence_update(obj);
+    _dispatch(i_presence_update, std::move(obj));
 }
 
 AEGIS_DECL void core::ws_typing_start(const json & result, shards::shard * _shard)
@@ -1217,8 +1557,7 @@ AEGIS_DECL void core::ws_typing_start(const json & result, shards::shard * _shar
                                       , *user_create(result["d"]["user_id"]) };
     obj.timestamp = static_cast<int64_t>(result["d"]["timestamp"]);
 
-    if (i_typing_start)
-        i_typing_start(obj);
+    _dispatch(i_typing_start, std::move(obj));
 }
 
 
@@ -1240,8 +1579,10 @@ AEGIS_DECL void core::ws_message_create(const json & result, shards::shard * _sh
         obj.msg = result["d"];
         obj.msg._core = this;
 
-        if (i_message_create_dm)
-            i_message_create_dm(obj);
+        if (_message_cache)
+            _message_cache->add(obj.msg);
+
+        _dispatch(i_message_create_dm, std::move(obj));
     }
     else
     {
@@ -1252,8 +1593,10 @@ AEGIS_DECL void core::ws_message_create(const json & result, shards::shard * _sh
         obj.msg = result["d"];
         obj.msg._core = this;
 
-        if (i_message_create)
-            i_message_create(obj);
+        if (_message_cache)
+            _message_cache->add(obj.msg);
+
+        _dispatch(i_message_create, std::move(obj));
     }
 }
 
@@ -1273,8 +1616,10 @@ AEGIS_DECL void core::ws_message_update(const json & result, shards::shard * _sh
 	
     obj.msg = result["d"];
 
-    if (i_message_update)
-        i_message_update(obj);
+    if (_message_cache)
+        obj.cached = _message_cache->update(obj.msg.get_channel_id(), obj.msg.get_id(), result["d"]);
+
+    _dispatch(i_message_update, std::move(obj));
 }
 
 AEGIS_DECL void core::ws_guild_create(const json & result, shards::shard * _shard)
@@ -1299,8 +1644,7 @@ AEGIS_DECL void core::ws_guild_create(const json & result, shards::shard * _shar
     gateway::events::guild_create obj{ *_shard };
     obj.guild = result["d"];
 
-    if (i_guild_create)
-        i_guild_create(obj);
+    _dispatch(i_guild_create, std::move(obj));
 }
 
 AEGIS_DECL void core::ws_guild_update(const json & result, shards::shard * _shard)
@@ -1320,8 +1664,7 @@ AEGIS_DECL void core::ws_guild_update(const json & result, shards::shard * _shar
     gateway::events::guild_update obj{ *_shard };
     obj.guild = result["d"];
 
-    if (i_guild_update)
-        i_guild_update(obj);
+    _dispatch(i_guild_update, std::move(obj));
 }
 
 AEGIS_DECL void core::ws_guild_delete(const json & result, shards::shard * _shard)
@@ -1333,8 +1676,7 @@ AEGIS_DECL void core::ws_guild_delete(const json & result, shards::shard * _shar
     else
         obj.unavailable = false;
 
-    if (i_guild_delete)
-        i_guild_delete(obj);
+    _dispatch(i_guild_delete, obj);
 
     if (obj.unavailable == true)
     {
@@ -1356,11 +1698,10 @@ AEGIS_DECL void core::ws_guild_delete(const json & result, shards::shard * _shar
         _guild->unavailable = obj.unavailable;
 #endif
 
-        std::unique_lock<shared_mutex> l(_guild_m);
         //kicked or left
         //websocket_o.set_timer(5000, [this, id, _shard](const asio::error_code & ec)
         //{
-        remove_guild_nolock(guild_id);
+        remove_guild(guild_id);
         //guilds.erase(guild_id);
         //});
     }
@@ -1371,8 +1712,10 @@ AEGIS_DECL void core::ws_message_delete(const json & result, shards::shard * _sh
     gateway::events::message_delete obj{ *_shard, *channel_create(result["d"]["channel_id"]) };
     obj.id = static_cast<snowflake>(std::stoll(result["d"]["id"].get<std::string>()));
 
-    if (i_message_delete)
-        i_message_delete(obj);
+    if (_message_cache)
+        obj.cached = _message_cache->remove(obj.channel.get_id(), obj.id);
+
+    _dispatch(i_message_delete, std::move(obj));
 }
 
 AEGIS_DECL void core::ws_message_delete_bulk(const json & result, shards::shard * _shard)
@@ -1386,8 +1729,17 @@ AEGIS_DECL void core::ws_message_delete_bulk(const json & result, shards::shard
     for (const auto & id : j["ids"])
         obj.ids.push_back(id);
 
-    if (i_message_delete_bulk)
-        i_message_delete_bulk(obj);
+    if (_message_cache)
+    {
+        for (auto & id : obj.ids)
+        {
+            auto msg = _message_cache->remove(obj.channel_id, id);
+            if (msg)
+                obj.cached.push_back(std::move(msg));
+        }
+    }
+
+    _dispatch(i_message_delete_bulk, std::move(obj));
 }
 
 AEGIS_DECL void core::ws_user_update(const json & result, shards::shard * _shard)
@@ -1398,9 +1750,9 @@ AEGIS_DECL void core::ws_user_update(const json & result, shards::shard * _shard
 
     const json & user = result["d"];
     if (user.count("username") && !user["username"].is_null())
-        _member->_name = user["username"].get<std::string>();
+        _member->_name.assign(user["username"].get<std::string>());
     if (user.count("avatar") && !user["avatar"].is_null())
-        _member->_avatar = user["avatar"].get<std::string>();
+        _member->_avatar.assign(user["avatar"].get<std::string>());
     if (user.count("discriminator") && !user["discriminator"].is_null())
         _member->_discriminator = static_cast<uint16_t>(std::stoi(user["discriminator"].get<std::string>()));
     if (user.count("mfa_enabled") && !user["mfa_enabled"].is_null())
@@ -1415,8 +1767,7 @@ AEGIS_DECL void core::ws_user_update(const json & result, shards::shard * _shard
 
     obj._user = j;
 
-    if (i_user_update)
-        i_user_update(obj);
+    _dispatch(i_user_update, std::move(obj));
 }
 
 AEGIS_DECL void core::ws_voice_state_update(const json & result, shards::shard * _shard)
@@ -1436,8 +1787,7 @@ AEGIS_DECL void core::ws_voice_state_update(const json & result, shards::shard *
     obj.self_mute = j["self_mute"];
     obj.suppress = j["suppress"];
 
-    if (i_voice_state_update)
-        i_voice_state_update(obj);
+    _dispatch(i_voice_state_update, std::move(obj));
 }
 
 AEGIS_DECL void core::ws_resumed(const json & result, shards::shard * _shard)
@@ -1461,8 +1811,7 @@ AEGIS_DECL void core::ws_resumed(const json & result, shards::shard * _shard)
 
     _shard->_trace = obj._trace;
 
-    if (i_resumed)
-        i_resumed(obj);
+    _dispatch(i_resumed, std::move(obj));
 }
 
 AEGIS_DECL void core::ws_ready(const json & result, shards::shard * _shard)
@@ -1491,8 +1840,7 @@ AEGIS_DECL void core::ws_ready(const json & result, shards::shard * _shard)
 
     _shard->_trace = obj._trace;
 
-    if (i_ready)
-        i_ready(obj);
+    _dispatch(i_ready, std::move(obj));
 }
 
 AEGIS_DECL void core::ws_channel_create(const json & result, shards::shard * _shard)
@@ -1506,15 +1854,17 @@ AEGIS_DECL void core::ws_channel_create(const json & result, shards::shard * _sh
         auto _guild = find_guild(guild_id);
         if (_guild == nullptr)//TODO: errors
             return;
-        auto _channel = channel_create(channel_id);
-        std::unique_lock<shared_mutex> l(_channel->mtx(), std::defer_lock);
-        std::unique_lock<shared_mutex> l2(_channel_m, std::defer_lock);
-        std::unique_lock<shared_mutex> l3(_guild->mtx(), std::defer_lock);
-        std::lock(l, l2, l3);
-        _channel->_load_with_guild_nolock(*_guild, result["d"], _shard);
-        _guild->channels.emplace(channel_id, _channel);
-        _channel->guild_id = guild_id;
-        _channel->_guild = _guild;
+        if (_cache_policy._channels)
+        {
+            auto _channel = channel_create(channel_id);
+            std::unique_lock<shared_mutex> l(_channel->mtx(), std::defer_lock);
+            std::unique_lock<shared_mutex> l2(_guild->mtx(), std::defer_lock);
+            std::lock(l, l2);
+            _channel->_load_with_guild_nolock(*_guild, result["d"], _shard);
+            _guild->channels.emplace(channel_id, _channel);
+            _channel->guild_id = guild_id;
+            _channel->_guild = _guild;
+        }
     }
     else
     {
@@ -1540,8 +1890,7 @@ AEGIS_DECL void core::ws_channel_create(const json & result, shards::shard * _sh
 
     obj.channel = j;
 
-    if (i_channel_create)
-        i_channel_create(obj);
+    _dispatch(i_channel_create, std::move(obj));
 }
 
 AEGIS_DECL void core::ws_channel_update(const json & result, shards::shard * _shard)
@@ -1555,12 +1904,16 @@ AEGIS_DECL void core::ws_channel_update(const json & result, shards::shard * _sh
         auto _guild = find_guild(guild_id);
         if (_guild == nullptr)//TODO: errors
             return;
-        auto _channel = channel_create(channel_id);
-        std::unique_lock<shared_mutex> l(_channel->mtx(), std::defer_lock);
-        std::unique_lock<shared_mutex> l2(_channel_m, std::defer_lock);
-        std::lock(l, l2);
-        _channel->_load_with_guild_nolock(*_guild, result["d"], _shard);
-        _guild->channels.emplace(channel_id, _channel);
+        // without channel caching only channels already known, e.g. from messages, are updated
+        auto _channel = _cache_policy._channels ? channel_create(channel_id) : find_channel(channel_id);
+        if (_channel != nullptr)
+        {
+            std::unique_lock<shared_mutex> l(_channel->mtx(), std::defer_lock);
+            std::unique_lock<shared_mutex> l2(_guild->mtx(), std::defer_lock);
+            std::lock(l, l2);
+            _channel->_load_with_guild_nolock(*_guild, result["d"], _shard);
+            _guild->channels.emplace(channel_id, _channel);
+        }
     }
     else
     {
@@ -1575,8 +1928,7 @@ AEGIS_DECL void core::ws_channel_update(const json & result, shards::shard * _sh
 
     obj.channel = j;
 
-    if (i_channel_update)
-        i_channel_update(obj);
+    _dispatch(i_channel_update, std::move(obj));
 }
 
 AEGIS_DECL void core::ws_channel_delete(const json & result, shards::shard * _shard)
@@ -1592,11 +1944,10 @@ AEGIS_DECL void core::ws_channel_delete(const json & result, shards::shard * _sh
         auto _channel = find_channel(channel_id);
         if (_channel == nullptr)//TODO: errors
             return;
-        std::unique_lock<shared_mutex> l(_channel->mtx(), std::defer_lock);
-        std::unique_lock<shared_mutex> l2(_channel_m, std::defer_lock);
-        std::lock(l, l2);
+        // locks only the guild. Holding the channel lock here as well would take them in the
+        // opposite order to readers such as guild::get_channel_permissions()
         _guild->_remove_channel(channel_id);
-        remove_channel_nolock(channel_id);
+        remove_channel(channel_id);
     }
 
     gateway::events::channel_delete obj{ *_shard };
@@ -1605,8 +1956,7 @@ AEGIS_DECL void core::ws_channel_delete(const json & result, shards::shard * _sh
 
     obj.channel = j;
 
-    if (i_channel_delete)
-        i_channel_delete(obj);
+    _dispatch(i_channel_delete, std::move(obj));
 }
 
 AEGIS_DECL void core::ws_guild_ban_add(const json & result, shards::shard * _shard)
@@ -1618,8 +1968,7 @@ AEGIS_DECL void core::ws_guild_ban_add(const json & result, shards::shard * _sha
     obj.guild_id = j["guild_id"];
     obj.user = j["user"];
 
-    if (i_guild_ban_add)
-        i_guild_ban_add(obj);
+    _dispatch(i_guild_ban_add, std::move(obj));
 }
 
 AEGIS_DECL void core::ws_guild_ban_remove(const json & result, shards::shard * _shard)
@@ -1631,8 +1980,7 @@ AEGIS_DECL void core::ws_guild_ban_remove(const json & result, shards::shard * _
     obj.guild_id = j["guild_id"];
     obj.user = j["user"];
 
-    if (i_guild_ban_remove)
-        i_guild_ban_remove(obj);
+    _dispatch(i_guild_ban_remove, std::move(obj));
 }
 
 AEGIS_DECL void core::ws_guild_emojis_update(const json & result, shards::shard * _shard)
@@ -1646,8 +1994,7 @@ AEGIS_DECL void core::ws_guild_emojis_update(const json & result, shards::shard
         for (const auto & _emoji : j["emojis"])
             obj.emojis.push_back(_emoji);
 
-    if (i_guild_emojis_update)
-        i_guild_emojis_update(obj);
+    _dispatch(i_guild_emojis_update, std::move(obj));
 }
 
 AEGIS_DECL void core::ws_guild_integrations_update(const json & result, shards::shard * _shard)
@@ -1658,8 +2005,7 @@ AEGIS_DECL void core::ws_guild_integrations_update(const json & result, shards::
 
     obj.guild_id = j["guild_id"];
 
-    if (i_guild_integrations_update)
-        i_guild_integrations_update(obj);
+    _dispatch(i_guild_integrations_update, std::move(obj));
 }
 
 AEGIS_DECL void core::ws_guild_member_add(const json & result, shards::shard * _shard)
@@ -1671,10 +2017,13 @@ AEGIS_DECL void core::ws_guild_member_add(const json & result, shards::shard * _
     auto _member = user_create(member_id);
     auto _guild = find_guild(guild_id);
 
-    std::unique_lock<shared_mutex> l(_member->mtx(), std::defer_lock);
-    std::unique_lock<shared_mutex> l2(_guild->mtx(), std::defer_lock);
-    std::lock(l, l2);
-    _member->_load_nolock(_guild, result["d"], _shard, true, false);
+    if (_guild != nullptr)
+    {
+        std::unique_lock<shared_mutex> l(_member->mtx(), std::defer_lock);
+        std::unique_lock<shared_mutex> l2(_guild->mtx(), std::defer_lock);
+        std::lock(l, l2);
+        _member->_load_nolock(_cache_policy.cache_members(_guild->member_count) ? _guild : nullptr, result["d"], _shard, true, false);
+    }
 #endif
 
     gateway::events::guild_member_add obj{ *_shard };
@@ -1683,8 +2032,7 @@ AEGIS_DECL void core::ws_guild_member_add(const json & result, shards::shard * _
 
     obj.member = j;
 
-    if (i_guild_member_add)
-        i_guild_member_add(obj);
+    _dispatch(i_guild_member_add, std::move(obj));
 }
 
 AEGIS_DECL void core::ws_guild_member_remove(const json & result, shards::shard * _shard)
@@ -1711,8 +2059,7 @@ AEGIS_DECL void core::ws_guild_member_remove(const json & result, shards::shard
     if (j.count("guild_id") && !j["guild_id"].is_null())
         obj.guild_id = j["guild_id"];
 
-    if (i_guild_member_remove)
-        i_guild_member_remove(obj);
+    _dispatch(i_guild_member_remove, std::move(obj));
 }
 
 AEGIS_DECL void core::ws_guild_member_update(const json & result, shards::shard * _shard)
@@ -1747,7 +2094,7 @@ AEGIS_DECL void core::ws_guild_member_update(const json & result, shards::shard
     std::unique_lock<shared_mutex> l(_member->mtx(), std::defer_lock);
     std::unique_lock<shared_mutex> l2(_guild->mtx(), std::defer_lock);
     std::lock(l, l2);
-    _member->_load_nolock(_guild, result["d"], _shard, true, false);
+    _member->_load_nolock(_cache_policy.cache_members(_guild->member_count) ? _guild : nullptr, result["d"], _shard, true, false);
 #endif
 
     gateway::events::guild_member_update obj{ *_shard };
@@ -1763,8 +2110,7 @@ AEGIS_DECL void core::ws_guild_member_update(const json & result, shards::shard
         for (const auto & i : j["roles"])
             obj.roles.push_back(i);
 
-    if (i_guild_member_update)
-        i_guild_member_update(obj);
+    _dispatch(i_guild_member_update, std::move(obj));
 }
 
 AEGIS_DECL void core::ws_guild_members_chunk(const json & result, shards::shard * _shard)
@@ -1775,7 +2121,7 @@ AEGIS_DECL void core::ws_guild_members_chunk(const json & result, shards::shard
     if (_guild == nullptr)
         return;
     auto & members = result["d"]["members"];
-    if (!members.empty())
+    if (!members.empty() && _cache_policy.cache_members(_guild->member_count))
     {
         for (auto & _member : members)
         {
@@ -1800,8 +2146,7 @@ AEGIS_DECL void core::ws_guild_members_chunk(const json & result, shards::shard
         for (const auto & i : j["members"])
             obj.members.push_back(i);
 
-    if (i_guild_members_chunk)
-        i_guild_members_chunk(obj);
+    _dispatch(i_guild_members_chunk, std::move(obj));
 }
 
 AEGIS_DECL void core::ws_guild_role_create(const json & result, shards::shard * _shard)
@@ -1810,7 +2155,11 @@ AEGIS_DECL void core::ws_guild_role_create(const json & result, shards::shard *
     snowflake guild_id = result["d"]["guild_id"];
 
     auto _guild = find_guild(guild_id);
-    _guild->_load_role(result["d"]["role"]);
+    if (_guild != nullptr)
+    {
+        std::unique_lock<shared_mutex> l(_guild->mtx());
+        _guild->_load_role(result["d"]["role"]);
+    }
 #endif
 
     gateway::events::guild_role_create obj{ *_shard };
@@ -1820,8 +2169,7 @@ AEGIS_DECL void core::ws_guild_role_create(const json & result, shards::shard *
     obj.guild_id = j["guild_id"];
     obj.role = j["role"];
 
-    if (i_guild_role_create)
-        i_guild_role_create(obj);
+    _dispatch(i_guild_role_create, std::move(obj));
 }
 
 AEGIS_DECL void core::ws_guild_role_update(const json & result, shards::shard * _shard)
@@ -1830,7 +2178,11 @@ AEGIS_DECL void core::ws_guild_role_update(const json & result, shards::shard *
     snowflake guild_id = result["d"]["guild_id"];
 
     auto _guild = find_guild(guild_id);
-    _guild->_load_role(result["d"]["role"]);
+    if (_guild != nullptr)
+    {
+        std::unique_lock<shared_mutex> l(_guild->mtx());
+        _guild->_load_role(result["d"]["role"]);
+    }
 #endif
 
     gateway::events::guild_role_update obj{ *_shard };
@@ -1840,8 +2192,7 @@ AEGIS_DECL void core::ws_guild_role_update(const json & result, shards::shard *
     obj.guild_id = j["guild_id"];
     obj.role = j["role"];
 
-    if (i_guild_role_update)
-        i_guild_role_update(obj);
+    _dispatch(i_guild_role_update, std::move(obj));
 }
 
 AEGIS_DECL void core::ws_guild_role_delete(const json & result, shards::shard * _shard)
@@ -1866,8 +2217,7 @@ AEGIS_DECL void core::ws_guild_role_delete(const json & result, shards::shard *
     obj.guild_id = j["guild_id"];
     obj.role_id = j["role_id"];
 
-    if (i_guild_role_delete)
-        i_guild_role_delete(obj);
+    _dispatch(i_guild_role_delete, std::move(obj));
 }
 
 AEGIS_DECL void core::ws_voice_server_update(const json & result, shards::shard * _shard)
@@ -1882,8 +2232,7 @@ AEGIS_DECL void core::ws_voice_server_update(const json & result, shards::shard
         obj.endpoint = j["endpoint"].get<std::string>();
 
 
-    if (i_voice_server_update)
-        i_voice_server_update(obj);
+    _dispatch(i_voice_server_update, std::move(obj));
 }
 
 AEGIS_DECL void core::ws_message_reaction_add(const json & result, shards::shard * _shard)
@@ -1899,8 +2248,10 @@ AEGIS_DECL void core::ws_message_reaction_add(const json & result, shards::shard
         obj.guild_id = j["guild_id"];
     obj.emoji = j["emoji"];
 
-    if (i_message_reaction_add)
-        i_message_reaction_add(obj);
+    if (_message_cache)
+        obj.cached = _message_cache->find(obj.channel_id, obj.message_id);
+
+    _dispatch(i_message_reaction_add, std::move(obj));
 }
 
 AEGIS_DECL void core::ws_message_reaction_remove(const json & result, shards::shard * _shard)
@@ -1916,8 +2267,10 @@ AEGIS_DECL void core::ws_message_reaction_remove(const json & result, shards::sh
         obj.guild_id = j["guild_id"];
     obj.emoji = j["emoji"];
 
-    if (i_message_reaction_remove)
-        i_message_reaction_remove(obj);
+    if (_message_cache)
+        obj.cached = _message_cache->find(obj.channel_id, obj.message_id);
+
+    _dispatch(i_message_reaction_remove, std::move(obj));
 }
 
 AEGIS_DECL void core::ws_message_reaction_remove_all(const json & result, shards::shard * _shard)
@@ -1930,8 +2283,10 @@ AEGIS_DECL void core::ws_message_reaction_remove_all(const json & result, shards
     obj.message_id = j["message_id"];
     obj.guild_id = j["guild_id"];
 
-    if (i_message_reaction_remove_all)
-        i_message_reaction_remove_all(obj);
+    if (_message_cache)
+        obj.cached = _message_cache->find(obj.channel_id, obj.message_id);
+
+    _dispatch(i_message_reaction_remove_all, std::move(obj));
 }
 
 AEGIS_DECL void core::ws_channel_pins_update(const json & result, shards::shard * _shard)
@@ -1944,8 +2299,7 @@ AEGIS_DECL void core::ws_channel_pins_update(const json & result, shards::shard
     if (j.count("last_pin_timestamp") && !j["last_pin_timestamp"].is_null())
         obj.last_pin_timestamp = j["last_pin_timestamp"].get<std::string>();
 
-    if (i_channel_pins_update)
-        i_channel_pins_update(obj);
+    _dispatch(i_channel_pins_update, std::move(obj));
 }
 
 AEGIS_DECL void core::ws_webhooks_update(const json & result, shards::shard * _shard)
@@ -1957,8 +2311,7 @@ AEGIS_DECL void core::ws_webhooks_update(const json & result, shards::shard * _s
     obj.guild_id = j["guild_id"];
     obj.channel_id = j["channel_id"];
 
-    if (i_webhooks_update)
-        i_webhooks_update(obj);
+    _dispatch(i_webhooks_update, std::move(obj));
 }
 
 AEGIS_DECL aegis::future<gateway::objects::guild> core::create_guild(
@@ -1996,11 +2349,10 @@ AEGIS_DECL aegis::future<gateway::objects::message> core::create_message(snowfla
     guild* _guild = nullptr;
     if (perform_lookup)
     {
-        auto it = channels.find(channel_id);
-        if (it == channels.end())
+        _channel = channels.find(channel_id);
+        if (_channel == nullptr)
             return aegis::make_exception_future<gateway::objects::message>(error::channel_not_found);
-        _channel = it->second.get();
-        _guild = &it->second->get_guild();
+        _guild = &_channel->get_guild();
         if (_guild != nullptr)//probably a DM
             if (!_channel->perms().can_send_messages())
                 return aegis::make_exception_future<gateway::objects::message>(error::no_permission);
@@ -2023,11 +2375,10 @@ AEGIS_DECL aegis::future<gateway::objects::message> core::create_message_embed(s
     guild* _guild = nullptr;
     if (perform_lookup)
     {
-        auto it = channels.find(channel_id);
-        if (it == channels.end())
+        _channel = channels.find(channel_id);
+        if (_channel == nullptr)
             return aegis::make_exception_future<gateway::objects::message>(error::channel_not_found);
-        _channel = it->second.get();
-        _guild = &it->second->get_guild();
+        _guild = &_channel->get_guild();
         if (_guild != nullptr)//probably a DM
             if (!_channel->perms().can_send_messages())
                 return aegis::make_exception_future<gateway::objects::message>(error::no_permission);
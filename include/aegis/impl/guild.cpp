@@ -10,6 +10,7 @@
 #include "aegis/guild.hpp"
 #include <string>
 #include <memory>
+#include <algorithm>
 #include "aegis/core.hpp"
 #include "aegis/user.hpp"
 #include "aegis/channel.hpp"
@@ -25,6 +26,9 @@ using json = nlohmann::json;
 AEGIS_DECL guild::guild(const int32_t _shard_id, const snowflake _id, core * _bot, asio::io_context & _io)
     : shard_id(_shard_id)
     , guild_id(_id)
+#if !defined(AEGIS_DISABLE_ALL_CACHE)
+    , _perm_cache(_bot->get_cache_policy()._permissions)
+#endif
     , _bot(_bot)
     , _io_context(_io)
 {
@@ -33,12 +37,7 @@ AEGIS_DECL guild::guild(const int32_t _shard_id, const snowflake _id, core * _bo
 
 AEGIS_DECL guild::~guild()
 {
-#if !defined(AEGIS_DISABLE_ALL_CACHE)
-    //TODO: remove guilds from members elsewhere when bot is removed from guild
-//     if (get_bot().get_state() != Shutdown)
-//         for (auto & v : members)
-//             v.second->leave(guild_id);
-#endif
+    // members were detached by core::remove_guild when the guild was unlinked
 }
 
 AEGIS_DECL core & guild::get_bot() const noexcept
@@ -74,24 +73,74 @@ AEGIS_DECL void guild::_remove_member(snowflake member_id) noexcept
     }
     _member->second->leave(guild_id);
     members.erase(member_id);
+    auto g = _find_member_info(member_id);
+    if (g != nullptr)
+    {
+        for (auto & r : g->roles)
+            _role_index.remove(g->role_slot, r);
+        _role_index.remove_member(g->role_slot);
+    }
+    member_info.erase(member_id);
+}
+
+AEGIS_DECL user::guild_info & guild::_member_info_nolock(snowflake member_id)
+{
+    auto & gi = member_info[member_id];
+    if (!gi)
+    {
+        gi = std::make_unique<user::guild_info>(guild_id);
+        gi->role_slot = _role_index.add_member(member_id);
+    }
+    return *gi;
+}
+
+AEGIS_DECL user::guild_info * guild::_find_member_info(snowflake member_id) const noexcept
+{
+    auto it = member_info.find(member_id);
+    if (it == member_info.end())
+        return nullptr;
+    return it->second.get();
 }
 
 AEGIS_DECL bool guild::member_has_role(snowflake member_id, snowflake role_id) const noexcept
 {
     std::shared_lock<shared_mutex> l(_m);
-    auto _member = find_member(member_id);
-    if (_member == nullptr)
-        return false;
-    auto & gi = _member->get_guild_info(guild_id);
-    auto it = std::find_if(std::begin(gi.roles), std::end(gi.roles), [&](const snowflake & id)
-    {
-        if (id == role_id)
-            return true;
+    auto _member = _find_member(member_id);
+    auto gi = _find_member_info(member_id);
+    if (_member == nullptr || gi == nullptr)
         return false;
-    });
-    if (it != std::end(gi.roles))
-        return true;
-    return false;
+    std::shared_lock<shared_mutex> ul(_member->mtx());
+    return std::find(std::begin(gi->roles), std::end(gi->roles), role_id) != std::end(gi->roles);
+}
+
+AEGIS_DECL std::vector<snowflake> guild::get_role_members(snowflake role_id) const
+{
+    std::shared_lock<shared_mutex> l(_m);
+    return _role_index.members(role_id);
+}
+
+AEGIS_DECL std::size_t guild::get_role_member_count(snowflake role_id) const noexcept
+{
+    std::shared_lock<shared_mutex> l(_m);
+    return _role_index.count(role_id);
+}
+
+AEGIS_DECL void guild::_set_member_roles(user::guild_info & g, const json & member_roles)
+{
+    small_vector<snowflake, 4> updated;
+    updated.emplace_back(guild_id);//default everyone role
+    for (auto & r : member_roles)
+        updated.emplace_back(std::stoull(r.get<std::string>()));
+
+    for (auto & r : g.roles)
+        if (std::find(updated.begin(), updated.end(), r) == updated.end())
+            _role_index.remove(g.role_slot, r);
+    for (auto & r : updated)
+        if (std::find(g.roles.begin(), g.roles.end(), r) == g.roles.end())
+            _role_index.add(g.role_slot, r);
+
+    g.roles = std::move(updated);
+    g.perm_generation = permission_cache::next_generation();
 }
 
 AEGIS_DECL void guild::_load_emoji(const json & obj) noexcept
@@ -128,6 +177,8 @@ AEGIS_DECL void guild::_load_role(const json & obj) noexcept
     snowflake role_id = obj["id"];
     auto & _role = roles[role_id];
     _role = obj;
+    _role_table.set(role_id, _role._permission.get_allow_perms());
+    _perm_generation = permission_cache::next_generation();
 }
 
 AEGIS_DECL const snowflake guild::get_owner() const noexcept
@@ -172,9 +223,12 @@ AEGIS_DECL channel * guild::_find_channel(snowflake channel_id) const noexcept
 AEGIS_DECL permission guild::get_permissions(snowflake member_id, snowflake channel_id) const
 {
     std::shared_lock<shared_mutex> l(_m);
-    if (!members.count(member_id) || !channels.count(channel_id))
+    auto _member = _find_member(member_id);
+    auto _channel = _find_channel(channel_id);
+    if (_member == nullptr || _channel == nullptr)
         return 0;
-    return get_permissions(_find_member(member_id), _find_channel(channel_id));
+    std::shared_lock<shared_mutex> ul(_member->mtx());
+    return _get_permissions(member_id, _find_member_info(member_id), *_channel);
 }
 
 AEGIS_DECL permission guild::get_permissions(const user * _member, const channel * _channel) const
@@ -182,75 +236,211 @@ AEGIS_DECL permission guild::get_permissions(const user * _member, const channel
     if (_member == nullptr || _channel == nullptr)
         return 0;
 
-    int64_t _base_permissions = base_permissions(_member);
-
-    return compute_overwrites(_base_permissions, *_member, *_channel);
+    std::shared_lock<shared_mutex> l(_m);
+    std::shared_lock<shared_mutex> ul(_member->_m);
+    return _get_permissions(_member->_member_id, _find_member_info(_member->_member_id), *_channel);
 }
 
-AEGIS_DECL int64_t guild::base_permissions(const user & _member) const noexcept
+AEGIS_DECL int64_t guild::_get_permissions(snowflake member_id, const user::guild_info * g, const channel & _channel) const
 {
-    try
-    {
-        if (owner_id == _member._member_id)
-            return ~0;
+    if (g == nullptr)
+        return _compute_overwrites(_base_permissions(member_id, g), member_id, g, _channel);
 
-        auto & role_everyone = get_role(guild_id);
-        int64_t permissions = role_everyone._permission.get_allow_perms();
+    const permission_cache::stamp current{ _perm_generation, _channel._perm_generation.load(std::memory_order_acquire), g->perm_generation };
+    int64_t permissions = 0;
+    if (_perm_cache.find(member_id, _channel.channel_id, current, permissions))
+        return permissions;
 
-        auto g = _member.get_guild_info_nocreate(guild_id);
+    permissions = _compute_overwrites(_base_permissions(member_id, g), member_id, g, _channel);
+    _perm_cache.store(member_id, _channel.channel_id, current, permissions);
+    return permissions;
+}
 
-        for (auto & rl : g->roles)
-            permissions |= get_role(rl)._permission.get_allow_perms();
+struct guild::channel_masks
+{
+    int64_t everyone = 0; /**< Allow mask of the everyone role */
+    int64_t everyone_allow = 0;
+    int64_t everyone_deny = 0;
+    std::vector<int64_t> role_allow; /**< Overwrite allow mask of each role_table slot */
+    std::vector<int64_t> role_deny; /**< Overwrite deny mask of each role_table slot */
+    bool member_overwrites = false; /**< Whether any overwrite is not for a known role */
+};
+
+AEGIS_DECL std::vector<std::pair<snowflake, permission>> guild::get_channel_permissions(snowflake channel_id) const
+{
+    std::vector<std::pair<snowflake, permission>> result;
+    std::shared_lock<shared_mutex> l(_m);
+    auto _channel = _find_channel(channel_id);
+    if (_channel == nullptr)
+        return result;
+    std::shared_lock<shared_mutex> cl(_channel->mtx());
 
-        if (permissions & 0x8)//admin
-            return ~0;
+    channel_masks masks;
+    _channel_masks(*_channel, masks);
 
-        return permissions;
-    }
-    catch (std::out_of_range &)
+    result.reserve(members.size());
+    for (auto & kv : members)
     {
-        return 0;
+        std::shared_lock<shared_mutex> ul(kv.second->_m);
+        result.emplace_back(kv.first, _masked_permissions(masks, *_channel, kv.first, _find_member_info(kv.first)));
     }
-    catch (std::exception & e)
+    return result;
+}
+
+AEGIS_DECL std::vector<std::pair<snowflake, permission>> guild::get_channel_permissions(snowflake channel_id, const std::vector<snowflake> & member_ids) const
+{
+    std::vector<std::pair<snowflake, permission>> result;
+    std::shared_lock<shared_mutex> l(_m);
+    auto _channel = _find_channel(channel_id);
+    if (_channel == nullptr)
+        return result;
+    std::shared_lock<shared_mutex> cl(_channel->mtx());
+
+    channel_masks masks;
+    _channel_masks(*_channel, masks);
+
+    result.reserve(member_ids.size());
+    for (auto & member_id : member_ids)
     {
-        _bot->log->error(fmt::format("guild::base_permissions() [{}]", e.what()));
-        return 0;
+        auto _member = _find_member(member_id);
+        if (_member == nullptr)
+        {
+            result.emplace_back(member_id, 0);
+            continue;
+        }
+        std::shared_lock<shared_mutex> ul(_member->_m);
+        result.emplace_back(member_id, _masked_permissions(masks, *_channel, member_id, _find_member_info(member_id)));
     }
-    catch (...)
+    return result;
+}
+
+AEGIS_DECL void guild::_channel_masks(const channel & _channel, channel_masks & masks) const
+{
+    masks.everyone = _role_table.allow(guild_id);
+    masks.role_allow.assign(_role_table.size(), 0);
+    masks.role_deny.assign(_role_table.size(), 0);
+    for (auto & kv : _channel.overrides)
     {
-        _bot->log->error("guild::base_permissions uncaught");
-        return 0;
+        auto & ow = kv.second;
+        if (ow.id == guild_id)
+        {
+            masks.everyone_allow = ow.allow;
+            masks.everyone_deny = ow.deny;
+            continue;
+        }
+        const auto slot = _role_table.index(ow.id);
+        if (slot == role_table::npos)
+        {
+            masks.member_overwrites = true;
+            continue;
+        }
+        masks.role_allow[slot] = ow.allow;
+        masks.role_deny[slot] = ow.deny;
     }
 }
 
-AEGIS_DECL int64_t guild::compute_overwrites(const int64_t _base_permissions, const user & _member, const channel & _channel) const noexcept
+AEGIS_DECL int64_t guild::_masked_permissions(const channel_masks & masks, const channel & _channel, snowflake member_id, const user::guild_info * g) const noexcept
 {
-    try
+    if (owner_id == member_id)
+        return ~0;
+    if (g == nullptr)
+        return 0;
+
+    // same result as _compute_overwrites(_base_permissions()) with one slot lookup per role
+    int64_t permissions = masks.everyone;
+    int64_t allow = 0;
+    int64_t deny = 0;
+    for (auto & rl : g->roles)
     {
-        if (_base_permissions & 0x8)//admin
-            return ~0;
+        const auto slot = _role_table.index(rl);
+        if (slot == role_table::npos)
+            continue;
+        permissions |= _role_table.allow_at(slot);
+        allow |= masks.role_allow[slot];
+        deny |= masks.role_deny[slot];
+    }
 
-        int64_t permissions = _base_permissions;
+    if (permissions & 0x8)//admin
+        return ~0;
+
+    permissions &= ~masks.everyone_deny;
+    permissions |= masks.everyone_allow;
+    permissions &= ~deny;
+    permissions |= allow;
+
+    if (masks.member_overwrites)
+    {
+        auto it = _channel.overrides.find(member_id);
+        if (it != _channel.overrides.end())
         {
-            auto it = _channel.overrides.find(guild_id);
-            if (it != _channel.overrides.end())
-            {
-                auto & overwrite_everyone = it->second;
-                permissions &= ~overwrite_everyone.deny;
-                permissions |= overwrite_everyone.allow;
-            }
+            permissions &= ~it->second.deny;
+            permissions |= it->second.allow;
         }
+    }
+
+    return permissions;
+}
+
+AEGIS_DECL int64_t guild::base_permissions(const user & _member) const noexcept
+{
+    std::shared_lock<shared_mutex> l(_m);
+    std::shared_lock<shared_mutex> ul(_member._m);
+    return _base_permissions(_member._member_id, _find_member_info(_member._member_id));
+}
+
+AEGIS_DECL int64_t guild::compute_overwrites(const int64_t _base_permissions, const user & _member, const channel & _channel) const noexcept
+{
+    std::shared_lock<shared_mutex> l(_m);
+    std::shared_lock<shared_mutex> ul(_member._m);
+    return _compute_overwrites(_base_permissions, _member._member_id, _find_member_info(_member._member_id), _channel);
+}
+
+AEGIS_DECL int64_t guild::_base_permissions(snowflake member_id, const user::guild_info * g) const noexcept
+{
+    if (owner_id == member_id)
+        return ~0;
+
+    int64_t permissions = _role_table.allow(guild_id);
+    if (g == nullptr)
+        return permissions;
+
+    for (auto & rl : g->roles)
+        permissions |= _role_table.allow(rl);
+
+    if (permissions & 0x8)//admin
+        return ~0;
+
+    return permissions;
+}
 
-        auto & overwrites = _channel.overrides;
-        int64_t allow = 0;
-        int64_t deny = 0;
-        auto g = _member.get_guild_info_nocreate(guild_id);
-        if (g == nullptr)
+AEGIS_DECL int64_t guild::_compute_overwrites(const int64_t _base_permissions, snowflake member_id, const user::guild_info * g, const channel & _channel) const noexcept
+{
+    if (_base_permissions & 0x8)//admin
+        return ~0;
+
+    int64_t permissions = _base_permissions;
+    auto & overwrites = _channel.overrides;
+    {
+        auto it = overwrites.find(guild_id);
+        if (it != overwrites.end())
         {
-            //could not find guild cache within member - use base permissions
-            _bot->log->warn("Member does not have guild info struct : m:[{}] g:[{}]", _member.get_id(), guild_id);
-            return 0;
+            auto & overwrite_everyone = it->second;
+            permissions &= ~overwrite_everyone.deny;
+            permissions |= overwrite_everyone.allow;
         }
+    }
+
+    if (g == nullptr)
+    {
+        //could not find guild cache within member - use base permissions
+        _bot->log->warn("Member does not have guild info struct : m:[{}] g:[{}]", member_id, guild_id);
+        return 0;
+    }
+
+    int64_t allow = 0;
+    int64_t deny = 0;
+    if (!overwrites.empty())
+    {
         for (auto & rl : g->roles)
         {
             if (rl == guild_id)
@@ -263,34 +453,30 @@ AEGIS_DECL int64_t guild::compute_overwrites(const int64_t _base_permissions, co
                 deny |= ow_role.deny;
             }
         }
+    }
 
-        permissions &= ~deny;
-        permissions |= allow;
+    permissions &= ~deny;
+    permissions |= allow;
 
+    {
+        auto it = overwrites.find(member_id);
+        if (it != overwrites.end())
         {
-            auto it = overwrites.find(_member._member_id);
-            if (it != overwrites.end())
-            {
-                auto & ow_role = it->second;
-                permissions &= ~ow_role.deny;
-                permissions |= ow_role.allow;
-            }
+            auto & ow_role = it->second;
+            permissions &= ~ow_role.deny;
+            permissions |= ow_role.allow;
         }
-
-        return permissions;
-    }
-    catch (std::exception &)
-    {
-        return 0;
     }
+
+    return permissions;
 }
 
 AEGIS_DECL const gateway::objects::role guild::get_role(int64_t r) const
 {
     std::shared_lock<shared_mutex> l(_m);
-    for (auto & kv : roles)
-        if (kv.second.role_id == r)
-            return kv.second;
+    auto it = roles.find(r);
+    if (it != roles.end())
+        return it->second;
     throw std::out_of_range(fmt::format("G: {} role:[{}] does not exist", guild_id, r));
 }
 
@@ -299,21 +485,22 @@ AEGIS_DECL void guild::_remove_role(snowflake role_id) noexcept
     std::unique_lock<shared_mutex> l(_m);
     try
     {
-        for (auto & kv : members)
+        // only the members that have the role
+        for (auto slot : _role_index.erase_role(role_id))
         {
-            auto g = kv.second->get_guild_info(guild_id);
-            for (auto & rl : g.roles)
-            {
-                if (rl == role_id)
-                {
-                    auto it = std::find(g.roles.begin(), g.roles.end(), role_id);
-                    if (it != g.roles.end())
-                        g.roles.erase(it);
-                    break;
-                }
-            }
+            const auto member_id = _role_index.member_at(slot);
+            auto _member = _find_member(member_id);
+            auto g = _find_member_info(member_id);
+            if (_member == nullptr || g == nullptr)
+                continue;
+            std::unique_lock<shared_mutex> ul(_member->mtx());
+            auto it = std::find(g->roles.begin(), g->roles.end(), role_id);
+            if (it != g->roles.end())
+                g->roles.erase(it);
         }
         roles.erase(role_id);
+        _role_table.erase(role_id);
+        _perm_generation = permission_cache::next_generation();
     }
     catch (std::out_of_range &)
     {
@@ -334,6 +521,8 @@ AEGIS_DECL void guild::_load(const json & obj, shards::shard * _shard) noexcept
 
     shard_id = _shard->get_id();
     is_init = false;
+    const bool restored = _restored;
+    _restored = false;
 
     core & bot = get_bot();
     try
@@ -366,57 +555,79 @@ AEGIS_DECL void guild::_load(const json & obj, shards::shard * _shard) noexcept
         {
             const json & roles = obj["roles"];
 
+            // roles deleted while the snapshot was on disk
+            if (restored)
+            {
+                this->roles.clear();
+                _role_table.clear();
+            }
+
             for (auto & role : roles)
             {
                 _load_role(role);
             }
         }
 
-        if (obj.count("members"))
+        // owner may have changed
+        _perm_generation = permission_cache::next_generation();
+
+        const auto & policy = bot.get_cache_policy();
+        const bool cache_members = policy.cache_members(member_count);
+
+        if (cache_members && obj.count("members"))
         {
             const json & members = obj["members"];
 
             for (auto & member : members)
             {
-                const json & obj = member["user"];
-                snowflake member_id = obj["id"];
+                snowflake member_id = member["user"]["id"];
                 auto _member = bot.user_create(member_id);
                 _member->_load(this, member, _shard, false);
                 this->members.emplace(member_id, _member);
 
                 {
-                    auto & g_info = _member->_join(guild_id);
+                    std::unique_lock<shared_mutex> ul(_member->mtx());
+                    auto & g_info = _member->_join_nolock(this, false);
 
+                    if (member.count("deaf") && !member["deaf"].is_null()) g_info.deaf = member["deaf"];
+                    if (member.count("mute") && !member["mute"].is_null()) g_info.mute = member["mute"];
 
-                    if (obj.count("deaf") && !obj["deaf"].is_null()) g_info.deaf = obj["deaf"];
-                    if (obj.count("mute") && !obj["mute"].is_null()) g_info.mute = obj["mute"];
-
-                    if (obj.count("joined_at") && !obj["joined_at"].is_null())// g_info.value()->joined_at = obj["joined_at"];
+                    if (member.count("joined_at") && !member["joined_at"].is_null())
                     {
-                        g_info.joined_at = utility::from_iso8601(obj["joined_at"]).time_since_epoch().count();
+                        g_info.joined_at = utility::from_iso8601(member["joined_at"]).time_since_epoch().count();
                     }
 
-                    if (obj.count("roles") && !obj["roles"].is_null())
-                    {
-                        g_info.roles.clear();
-                        g_info.roles.emplace_back(guild_id);//default everyone role
+                    if (member.count("roles") && !member["roles"].is_null())
+                        _set_member_roles(g_info, member["roles"]);
 
-                        json roles = obj["roles"];
-                        for (auto & r : roles)
-                            g_info.roles.emplace_back(std::stoull(r.get<std::string>()));
-                    }
-
-                    if (obj.count("nick") && !obj["nick"].is_null())
-                        g_info.nickname = obj["nick"].get<std::string>();
+                    if (member.count("nick") && !member["nick"].is_null())
+                        g_info.nickname.assign(member["nick"].get<std::string>());
                 }
 
             }
         }
 
-        if (obj.count("channels"))
+        if (policy._channels && obj.count("channels"))
         {
             const json & channels = obj["channels"];
 
+            // channels deleted while the snapshot was on disk
+            if (restored)
+            {
+                std::vector<snowflake> listed, stale;
+                for (auto & channel_obj : channels)
+                    listed.push_back(channel_obj["id"].get<snowflake>());
+                std::sort(listed.begin(), listed.end());
+                for (auto & c : this->channels)
+                    if (!std::binary_search(listed.begin(), listed.end(), c.first))
+                        stale.push_back(c.first);
+                for (auto & id : stale)
+                {
+                    this->channels.erase(id);
+                    bot.remove_channel(id);
+                }
+            }
+
             for (auto & channel_obj : channels)
             {
                 snowflake channel_id = channel_obj["id"];
@@ -428,7 +639,7 @@ AEGIS_DECL void guild::_load(const json & obj, shards::shard * _shard) noexcept
             }
         }
 
-        if (obj.count("presences"))
+        if (cache_members && policy._presences && obj.count("presences"))
         {
             const json & presences = obj["presences"];
 
@@ -438,7 +649,7 @@ AEGIS_DECL void guild::_load(const json & obj, shards::shard * _shard) noexcept
             }
         }
 
-        if (obj.count("emojis"))
+        if (policy._emojis && obj.count("emojis"))
         {
             const json & emojis = obj["emojis"];
 
@@ -0,0 +1,101 @@
+//
+// handler_pool.cpp
+// ****************
+//
+// Copyright (c) 2019 Sharon W (sharon at aegis dot gg)
+//
+// Distributed under the MIT License. (See accompanying file LICENSE)
+//
+
+#include "aegis/config.hpp"
+#include "aegis/handler_pool.hpp"
+#include <algorithm>
+
+namespace aegis
+{
+
+AEGIS_DECL handler_pool::handler_pool(std::size_t threads, std::size_t capacity, overflow_policy policy)
+    : _capacity(std::max<std::size_t>(capacity, 1))
+    , _policy(policy)
+    , _sched(threads, threads)
+{
+}
+
+AEGIS_DECL bool handler_pool::_acquire()
+{
+    auto cur = _inflight.load(std::memory_order_relaxed);
+    while (cur < _capacity)
+        if (_inflight.compare_exchange_weak(cur, cur + 1, std::memory_order_relaxed))
+            return true;
+
+    // posters checked has_room() first, so this only overshoots when they raced for the last slot
+    if (_policy == overflow_policy::defer)
+    {
+        _inflight.fetch_add(1, std::memory_order_seq_cst);
+        return true;
+    }
+
+    if (_policy != overflow_policy::block)
+        return false;
+
+    _blocked.fetch_add(1, std::memory_order_relaxed);
+    std::unique_lock<std::mutex> l(_m);
+    _waiters.fetch_add(1, std::memory_order_seq_cst);
+    _cv.wait(l, [this]
+    {
+        auto c = _inflight.load(std::memory_order_seq_cst);
+        while (c < _capacity)
+            if (_inflight.compare_exchange_weak(c, c + 1, std::memory_order_seq_cst))
+                return true;
+        return false;
+    });
+    _waiters.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
+
+AEGIS_DECL bool handler_pool::wait_for_room(std::function<void()> func)
+{
+    std::lock_guard<std::mutex> l(_m);
+    _room_callbacks.push_back(std::move(func));
+    _room_waiters.store(_room_callbacks.size(), std::memory_order_seq_cst);
+    // a slot freed before the callback was visible to _release() would never call it
+    if (has_room())
+    {
+        _room_callbacks.pop_back();
+        _room_waiters.store(_room_callbacks.size(), std::memory_order_seq_cst);
+        return false;
+    }
+    _deferred.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+AEGIS_DECL void handler_pool::_release() noexcept
+{
+    _inflight.fetch_sub(1, std::memory_order_seq_cst);
+    if (_waiters.load(std::memory_order_seq_cst) > 0)
+    {
+        std::lock_guard<std::mutex> l(_m);
+        _cv.notify_one();
+    }
+    if (_room_waiters.load(std::memory_order_seq_cst) > 0)
+    {
+        std::vector<std::function<void()>> callbacks;
+        {
+            std::lock_guard<std::mutex> l(_m);
+            callbacks.swap(_room_callbacks);
+            _room_waiters.store(0, std::memory_order_seq_cst);
+        }
+        for (auto & f : callbacks)
+        {
+            try
+            {
+                f();
+            }
+            catch (...)
+            {
+            }
+        }
+    }
+}
+
+}
@@ -0,0 +1,95 @@
+//
+// intern.cpp
+// **********
+//
+// Copyright (c) 2019 Sharon W (sharon at aegis dot gg)
+//
+// Distributed under the MIT License. (See accompanying file LICENSE)
+//
+
+#include "aegis/config.hpp"
+#include "aegis/intern.hpp"
+#include <algorithm>
+#include <vector>
+
+namespace aegis
+{
+
+AEGIS_DECL interned_string::interned_string(const std::string & str)
+{
+    *this = string_table::instance().intern(str);
+}
+
+AEGIS_DECL interned_string string_table::intern(const std::string & str)
+{
+    const auto h = deref_hash()(&str);
+    auto & s = _stripes[(h >> 32) % stripe_count];
+
+    interned_string res;
+    std::lock_guard<std::mutex> l(s.m);
+    auto it = s.map.find(&str);
+    if (it != s.map.end())
+    {
+        // may revive a node whose last handle just went away. Sweeps hold the lock too
+        it->second->refs.fetch_add(1, std::memory_order_relaxed);
+        res._node = it->second;
+        return res;
+    }
+
+    if (s.map.size() >= s.sweep_at)
+    {
+        _sweep(s);
+        s.sweep_at = std::max<std::size_t>(64, s.map.size() * 2);
+    }
+
+    auto n = new node(str);
+    try
+    {
+        s.map.emplace(&n->str, n);
+    }
+    catch (...)
+    {
+        delete n;
+        throw;
+    }
+    res._node = n;
+    return res;
+}
+
+AEGIS_DECL std::size_t string_table::sweep()
+{
+    std::size_t count = 0;
+    for (auto & s : _stripes)
+    {
+        std::lock_guard<std::mutex> l(s.m);
+        count += _sweep(s);
+    }
+    return count;
+}
+
+AEGIS_DECL std::size_t string_table::size() const
+{
+    std::size_t count = 0;
+    for (auto & s : _stripes)
+    {
+        std::lock_guard<std::mutex> l(s.m);
+        count += s.map.size();
+    }
+    return count;
+}
+
+AEGIS_DECL std::size_t string_table::_sweep(stripe & s)
+{
+    std::vector<node *> dead;
+    for (auto & kv : s.map)
+        if (kv.second->refs.load(std::memory_order_acquire) == 0)
+            dead.push_back(kv.second);
+    for (auto n : dead)
+    {
+        s.map.erase(&n->str);
+        delete n;
+    }
+    return dead.size();
+}
+
+}
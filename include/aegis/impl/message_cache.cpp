@@ -0,0 +1,210 @@
+//
+// message_cache.cpp
+// *****************
+//
+// Copyright (c) 2019 Sharon W (sharon at aegis dot gg)
+//
+// Distributed under the MIT License. (See accompanying file LICENSE)
+//
+
+#include "aegis/config.hpp"
+#include "aegis/message_cache.hpp"
+#include <algorithm>
+
+namespace aegis
+{
+
+AEGIS_DECL message_cache::message_cache(std::size_t per_channel, std::size_t max_bytes)
+    : _per_channel((std::max)(per_channel, std::size_t(1)))
+    , _max_bytes(max_bytes)
+{
+}
+
+AEGIS_DECL void message_cache::add(gateway::objects::message msg)
+{
+    const auto channel_id = msg.get_channel_id();
+    const auto size = footprint(msg);
+    message_ptr ptr = std::make_shared<const gateway::objects::message>(std::move(msg));
+
+    std::lock_guard<std::mutex> l(_m);
+    auto & r = _rings[channel_id];
+    if (r.count == _per_channel)
+        _pop(r);
+
+    entry e{ ++_seq, size, std::move(ptr) };
+    if (r.count == r.slots.size())
+    {
+        // full but below the limit, so grow with the oldest entry moved to the front
+        std::rotate(r.slots.begin(), r.slots.begin() + r.head, r.slots.end());
+        r.head = 0;
+        r.slots.push_back(std::move(e));
+    }
+    else
+        r.at(r.count) = std::move(e);
+    ++r.count;
+    ++_entries;
+    _order.emplace_back(channel_id, _seq);
+
+    _count.fetch_add(1, std::memory_order_relaxed);
+    _bytes.fetch_add(size, std::memory_order_relaxed);
+
+    if (_max_bytes > 0)
+        _trim();
+    if (_order.size() > _entries * 2 + 64)
+        _compact();
+}
+
+AEGIS_DECL message_cache::message_ptr message_cache::find(snowflake channel_id, snowflake message_id) const
+{
+    std::lock_guard<std::mutex> l(_m);
+    auto e = _find(channel_id, message_id);
+    if (e == nullptr)
+    {
+        _misses.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    _hits.fetch_add(1, std::memory_order_relaxed);
+    return e->msg;
+}
+
+AEGIS_DECL message_cache::message_ptr message_cache::update(snowflake channel_id, snowflake message_id, const nlohmann::json & partial)
+{
+    std::lock_guard<std::mutex> l(_m);
+    auto e = _find(channel_id, message_id);
+    if (e == nullptr)
+    {
+        _misses.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    _hits.fetch_add(1, std::memory_order_relaxed);
+
+    // from_json appends to lists, so the lists the update carries are replaced
+    auto updated = *e->msg;
+    if (partial.count("mentions"))
+        updated.mentions.clear();
+    if (partial.count("roles"))
+        updated.mention_roles.clear();
+    if (partial.count("attachments"))
+        updated.attachments.clear();
+    if (partial.count("embeds"))
+        updated.embeds.clear();
+    if (partial.count("reactions"))
+        updated.reactions.clear();
+    gateway::objects::from_json(partial, updated);
+
+    const auto size = footprint(updated);
+    message_ptr previous = std::move(e->msg);
+    e->msg = std::make_shared<const gateway::objects::message>(std::move(updated));
+    _bytes.fetch_add(size, std::memory_order_relaxed);
+    _bytes.fetch_sub(e->bytes, std::memory_order_relaxed);
+    e->bytes = size;
+
+    if (_max_bytes > 0)
+        _trim();
+    return previous;
+}
+
+AEGIS_DECL message_cache::message_ptr message_cache::remove(snowflake channel_id, snowflake message_id)
+{
+    std::lock_guard<std::mutex> l(_m);
+    auto e = _find(channel_id, message_id);
+    if (e == nullptr)
+    {
+        _misses.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    _hits.fetch_add(1, std::memory_order_relaxed);
+
+    // the slot stays until the ring or the memory limit reaches it
+    message_ptr previous = std::move(e->msg);
+    e->msg = nullptr;
+    _count.fetch_sub(1, std::memory_order_relaxed);
+    _bytes.fetch_sub(e->bytes, std::memory_order_relaxed);
+    e->bytes = 0;
+    return previous;
+}
+
+AEGIS_DECL void message_cache::remove_channel(snowflake channel_id)
+{
+    std::lock_guard<std::mutex> l(_m);
+    auto it = _rings.find(channel_id);
+    if (it == _rings.end())
+        return;
+    auto & r = it->second;
+    while (r.count > 0)
+        _pop(r);
+    _rings.erase(it);
+}
+
+AEGIS_DECL std::size_t message_cache::footprint(const gateway::objects::message & msg) noexcept
+{
+    return sizeof(gateway::objects::message) + sizeof(entry) + 2 * sizeof(void *)
+        + msg.get_content().capacity() + msg.timestamp.capacity() + msg.edited_timestamp.capacity() + msg.webhook_id.capacity()
+        + (msg.mentions.capacity() + msg.mention_roles.capacity()) * sizeof(snowflake)
+        + msg.attachments.capacity() * sizeof(gateway::objects::attachment)
+        + msg.embeds.capacity() * sizeof(gateway::objects::embed)
+        + msg.reactions.capacity() * sizeof(gateway::objects::reaction);
+}
+
+AEGIS_DECL const message_cache::entry * message_cache::_find(snowflake channel_id, snowflake message_id) const noexcept
+{
+    auto it = _rings.find(channel_id);
+    if (it == _rings.end())
+        return nullptr;
+    auto & r = it->second;
+    // lookups are mostly for recent messages, so search from the newest
+    for (std::size_t i = r.count; i > 0; --i)
+    {
+        auto & e = r.at(i - 1);
+        if (e.msg && e.msg->get_id() == message_id)
+            return &e;
+    }
+    return nullptr;
+}
+
+AEGIS_DECL void message_cache::_pop(ring & r) noexcept
+{
+    auto & e = r.at(0);
+    if (e.msg)
+    {
+        _count.fetch_sub(1, std::memory_order_relaxed);
+        _bytes.fetch_sub(e.bytes, std::memory_order_relaxed);
+    }
+    e = entry{ 0, 0, nullptr };
+    r.head = (r.head + 1) % r.slots.size();
+    --r.count;
+    --_entries;
+}
+
+AEGIS_DECL void message_cache::_trim() noexcept
+{
+    while (_bytes.load(std::memory_order_relaxed) > _max_bytes && !_order.empty())
+    {
+        const auto oldest = _order.front();
+        _order.pop_front();
+        auto it = _rings.find(oldest.first);
+        if (it == _rings.end())
+            continue;
+        auto & r = it->second;
+        // entries overwritten by their ring or dropped with their channel no longer match
+        if (r.count == 0 || r.at(0).seq != oldest.second)
+            continue;
+        _pop(r);
+        if (r.count == 0)
+            _rings.erase(it);
+    }
+}
+
+AEGIS_DECL void message_cache::_compact()
+{
+    std::deque<std::pair<snowflake, uint64_t>> live;
+    for (auto & o : _order)
+    {
+        auto it = _rings.find(o.first);
+        if (it != _rings.end() && it->second.count > 0 && o.second >= it->second.at(0).seq)
+            live.push_back(o);
+    }
+    _order.swap(live);
+}
+
+}
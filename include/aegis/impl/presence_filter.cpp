@@ -0,0 +1,71 @@
+//
+// presence_filter.cpp
+// *******************
+//
+// Copyright (c) 2019 Sharon W (sharon at aegis dot gg)
+//
+// Distributed under the MIT License. (See accompanying file LICENSE)
+//
+
+#include "aegis/config.hpp"
+#include "aegis/presence_filter.hpp"
+
+namespace aegis
+{
+
+AEGIS_DECL presence_filter::presence_filter(std::chrono::milliseconds window)
+    : _window(window)
+{
+    for (auto & s : _stripes)
+        s.swept = clock::now();
+}
+
+AEGIS_DECL uint64_t presence_filter::signature(const nlohmann::json & d)
+{
+    static const char * const fields[] = { "status", "game", "activities", "client_status", "user" };
+    std::hash<nlohmann::json> hasher;
+    uint64_t sig = 0;
+    for (auto f : fields)
+    {
+        const auto it = d.find(f);
+        uint64_t h = (it != d.end()) ? hasher(*it) : 0;
+        sig ^= h + 0x9e3779b97f4a7c15ULL + (sig << 6) + (sig >> 2);
+    }
+    return sig;
+}
+
+AEGIS_DECL bool presence_filter::repeat(snowflake user_id, uint64_t sig)
+{
+    const auto now = clock::now();
+    auto & s = _stripes[static_cast<uint64_t>(user_id.get() >> 22) % stripe_count];
+    std::lock_guard<std::mutex> l(s.m);
+
+    auto it = s.users.find(user_id);
+    if (it != s.users.end() && it->second.sig == sig && now - it->second.seen < _window)
+    {
+        _suppressed.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    if (now - s.swept > _window * 4)
+    {
+        for (auto r = s.users.begin(); r != s.users.end();)
+        {
+            if (now - r->second.seen >= _window)
+                r = s.users.erase(r);
+            else
+                ++r;
+        }
+        s.swept = now;
+        it = s.users.find(user_id);
+    }
+
+    if (it != s.users.end())
+        it->second = { sig, now };
+    else
+        s.users.emplace(user_id, record{ sig, now });
+    _passed.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+}
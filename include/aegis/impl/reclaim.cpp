@@ -0,0 +1,86 @@
+//
+// reclaim.cpp
+// ***********
+//
+// Copyright (c) 2019 Sharon W (sharon at aegis dot gg)
+//
+// Distributed under the MIT License. (See accompanying file LICENSE)
+//
+
+#include "aegis/config.hpp"
+#include "aegis/reclaim.hpp"
+
+namespace aegis
+{
+
+AEGIS_DECL epoch_reclaimer::~epoch_reclaimer()
+{
+    // oldest first, so objects retired earlier are gone before later ones that may refer to them
+    const auto e = _epoch.load(std::memory_order_relaxed);
+    for (uint64_t i = 1; i <= 3; ++i)
+        _free(_limbo[(e + i) % 3]);
+}
+
+AEGIS_DECL epoch_reclaimer::guard epoch_reclaimer::pin() noexcept
+{
+    for (;;)
+    {
+        auto e = _epoch.load(std::memory_order_seq_cst);
+        _active[e % 3].readers.fetch_add(1, std::memory_order_seq_cst);
+        // the epoch may have moved on between the load and the increment, in which case the
+        // collector did not see this reader
+        if (_epoch.load(std::memory_order_seq_cst) == e)
+            return guard(this, e);
+        _active[e % 3].readers.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+AEGIS_DECL void epoch_reclaimer::_retire(retired r)
+{
+    {
+        std::lock_guard<std::mutex> l(_m);
+        try
+        {
+            _limbo[_epoch.load(std::memory_order_relaxed) % 3].push_back(r);
+        }
+        catch (...)
+        {
+            // out of memory. Leaking is safer than freeing something a reader may hold
+            return;
+        }
+        _pending.fetch_add(1, std::memory_order_relaxed);
+    }
+    collect();
+}
+
+AEGIS_DECL std::size_t epoch_reclaimer::collect()
+{
+    std::vector<retired> list;
+    {
+        std::unique_lock<std::mutex> l(_m, std::try_to_lock);
+        if (!l.owns_lock())
+            return 0;
+        auto e = _epoch.load(std::memory_order_relaxed);
+        // readers of epoch e - 1 may still hold objects retired in e - 1 or e
+        if (_active[(e + 2) % 3].readers.load(std::memory_order_seq_cst) != 0)
+            return 0;
+        _epoch.store(e + 1, std::memory_order_seq_cst);
+        // retired in e - 2. Every reader that could see them has left
+        list.swap(_limbo[(e + 1) % 3]);
+    }
+    auto count = _free(list);
+    _pending.fetch_sub(count, std::memory_order_relaxed);
+    _freed.fetch_add(count, std::memory_order_relaxed);
+    return count;
+}
+
+AEGIS_DECL std::size_t epoch_reclaimer::_free(std::vector<retired> & list) noexcept
+{
+    for (auto & r : list)
+        r.destroy(r.ptr);
+    auto count = list.size();
+    list.clear();
+    return count;
+}
+
+}
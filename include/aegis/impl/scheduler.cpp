@@ -0,0 +1,225 @@
+//
+// scheduler.cpp
+// *************
+//
+// Copyright (c) 2019 Sharon W (sharon at aegis dot gg)
+//
+// Distributed under the MIT License. (See accompanying file LICENSE)
+//
+
+#include "aegis/config.hpp"
+#include "aegis/scheduler.hpp"
+#include <spdlog/spdlog.h>
+#include <algorithm>
+
+namespace aegis
+{
+
+AEGIS_DECL scheduler::scheduler(std::size_t threads, std::size_t max_threads)
+{
+    if (threads == 0)
+        threads = 1;
+    if (max_threads == 0)
+        max_threads = std::max<std::size_t>(threads, std::thread::hardware_concurrency());
+    max_threads = std::max(max_threads, threads);
+
+    _workers.reserve(max_threads);
+    for (std::size_t i = 0; i < max_threads; ++i)
+    {
+        auto w = std::make_unique<worker>();
+        w->owner = this;
+        w->index = i;
+        _workers.emplace_back(std::move(w));
+    }
+    resize(threads);
+}
+
+AEGIS_DECL scheduler::~scheduler()
+{
+    stop();
+}
+
+AEGIS_DECL void scheduler::stop()
+{
+    std::lock_guard<std::mutex> rl(_resize_m);
+    {
+        std::lock_guard<std::mutex> l(_sleep_m);
+        _stopping.store(true, std::memory_order_seq_cst);
+    }
+    _sleep_cv.notify_all();
+    for (auto & w : _workers)
+        if (w->thd.joinable())
+            w->thd.join();
+    _active.store(0, std::memory_order_release);
+}
+
+AEGIS_DECL void scheduler::resize(std::size_t threads)
+{
+    std::lock_guard<std::mutex> rl(_resize_m);
+    if (_stopping.load(std::memory_order_acquire))
+        return;
+
+    threads = std::min(std::max<std::size_t>(threads, 1), _workers.size());
+    auto active = _active.load(std::memory_order_acquire);
+
+    if (threads > active)
+    {
+        for (auto i = active; i < threads; ++i)
+        {
+            auto & w = *_workers[i];
+            if (w.thd.joinable())
+                w.thd.join();
+            w.retiring.store(false, std::memory_order_release);
+            _start(w);
+        }
+        if (_started.load(std::memory_order_acquire) < threads)
+            _started.store(threads, std::memory_order_release);
+        _active.store(threads, std::memory_order_release);
+    }
+    else if (threads < active)
+    {
+        _active.store(threads, std::memory_order_release);
+        {
+            std::lock_guard<std::mutex> l(_sleep_m);
+            for (auto i = threads; i < active; ++i)
+                _workers[i]->retiring.store(true, std::memory_order_release);
+        }
+        _sleep_cv.notify_all();
+    }
+}
+
+AEGIS_DECL std::vector<scheduler::worker_stats> scheduler::stats() const
+{
+    std::vector<worker_stats> res;
+    auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+    auto started = _started.load(std::memory_order_acquire);
+    res.reserve(started);
+    for (std::size_t i = 0; i < started; ++i)
+    {
+        auto & w = *_workers[i];
+        worker_stats s;
+        s.active = w.running.load(std::memory_order_acquire) && !w.retiring.load(std::memory_order_acquire);
+        {
+            std::lock_guard<std::mutex> l(w.m);
+            s.queued = w.queue.size();
+        }
+        s.executed = w.executed.load(std::memory_order_relaxed);
+        s.stolen = w.stolen.load(std::memory_order_relaxed);
+        s.busy = std::chrono::nanoseconds(w.busy_ns.load(std::memory_order_relaxed));
+        s.uptime = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::duration(now - w.started_at.load(std::memory_order_relaxed)));
+        res.push_back(s);
+    }
+    return res;
+}
+
+AEGIS_DECL void scheduler::_push(work_item && item)
+{
+    worker * target = current();
+    if (!target || target->owner != this || target->retiring.load(std::memory_order_relaxed))
+    {
+        auto active = std::max<std::size_t>(_active.load(std::memory_order_acquire), 1);
+        target = _workers[_next.fetch_add(1, std::memory_order_relaxed) % active].get();
+    }
+
+    {
+        std::lock_guard<std::mutex> l(target->m);
+        target->queue.push_back(std::move(item));
+    }
+
+    // pairs with the sleeper count in _run so either the push or the sleeper sees the other
+    _queued.fetch_add(1, std::memory_order_seq_cst);
+    if (_sleepers.load(std::memory_order_seq_cst) > 0)
+    {
+        std::lock_guard<std::mutex> l(_sleep_m);
+        _sleep_cv.notify_one();
+    }
+}
+
+AEGIS_DECL void scheduler::_start(worker & w)
+{
+    w.started_at.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+    w.busy_ns.store(0, std::memory_order_relaxed);
+    w.running.store(true, std::memory_order_release);
+    w.thd = std::thread([this, &w] { _run(w); });
+}
+
+AEGIS_DECL bool scheduler::_pop(worker & w, work_item & item)
+{
+    std::lock_guard<std::mutex> l(w.m);
+    if (w.queue.empty())
+        return false;
+    item = std::move(w.queue.back());
+    w.queue.pop_back();
+    return true;
+}
+
+AEGIS_DECL bool scheduler::_steal(worker & w, work_item & item)
+{
+    auto started = _started.load(std::memory_order_acquire);
+    for (std::size_t n = 1; n < started; ++n)
+    {
+        auto & victim = *_workers[(w.index + n) % started];
+        std::unique_lock<std::mutex> l(victim.m, std::try_to_lock);
+        if (!l.owns_lock() || victim.queue.empty())
+            continue;
+        item = std::move(victim.queue.front());
+        victim.queue.pop_front();
+        w.stolen.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
+AEGIS_DECL void scheduler::_run(worker & w)
+{
+    current() = &w;
+    auto log = spdlog::get("aegis");
+
+    for (;;)
+    {
+        work_item item;
+        if (_pop(w, item) || _steal(w, item))
+        {
+            _queued.fetch_sub(1, std::memory_order_relaxed);
+            auto start = std::chrono::steady_clock::now();
+            try
+            {
+                item();
+            }
+            catch (std::exception & e)
+            {
+                if (log)
+                    log->critical("Scheduler worker {} caught exception: {}", w.index, e.what());
+            }
+            catch (...)
+            {
+                if (log)
+                    log->critical("Scheduler worker {} caught unknown exception", w.index);
+            }
+            w.busy_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+            w.executed.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+
+        if (w.retiring.load(std::memory_order_acquire))
+            break;
+        if (_stopping.load(std::memory_order_acquire) && _queued.load(std::memory_order_acquire) <= 0)
+            break;
+
+        std::unique_lock<std::mutex> l(_sleep_m);
+        _sleepers.fetch_add(1, std::memory_order_seq_cst);
+        _sleep_cv.wait(l, [&]
+        {
+            return _queued.load(std::memory_order_seq_cst) > 0
+                || _stopping.load(std::memory_order_relaxed)
+                || w.retiring.load(std::memory_order_relaxed);
+        });
+        _sleepers.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    w.running.store(false, std::memory_order_release);
+    current() = nullptr;
+}
+
+}
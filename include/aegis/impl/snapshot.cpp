@@ -0,0 +1,563 @@
+//
+// snapshot.cpp
+// ************
+//
+// Copyright (c) 2019 Sharon W (sharon at aegis dot gg)
+//
+// Distributed under the MIT License. (See accompanying file LICENSE)
+//
+
+#include "aegis/config.hpp"
+#include "aegis/snapshot.hpp"
+#include "aegis/core.hpp"
+#include "aegis/guild.hpp"
+#include "aegis/channel.hpp"
+#include "aegis/user.hpp"
+#include "aegis/error.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#if !defined(AEGIS_DISABLE_ALL_CACHE)
+
+namespace aegis
+{
+
+namespace detail
+{
+
+static constexpr char snapshot_magic[8] = { 'A', 'E', 'G', 'I', 'S', 'N', 'A', 'P' };
+static constexpr uint32_t snapshot_byte_order = 0x01020304;
+
+/// Streams fields to the snapshot file
+struct snapshot_writer
+{
+    template<typename T>
+    void put(const T v)
+    {
+        out.write(reinterpret_cast<const char *>(&v), sizeof(T));
+    }
+
+    void put(const std::string & s)
+    {
+        put<uint32_t>(static_cast<uint32_t>(s.size()));
+        out.write(s.data(), static_cast<std::streamsize>(s.size()));
+    }
+
+    /// Reserve room for a count that is only known once the entries are written
+    std::streampos put_count()
+    {
+        const auto pos = out.tellp();
+        put<uint64_t>(0);
+        return pos;
+    }
+
+    void patch_count(const std::streampos pos, const uint64_t count)
+    {
+        const auto end = out.tellp();
+        out.seekp(pos);
+        put<uint64_t>(count);
+        out.seekp(end);
+    }
+
+    std::ostream & out;
+};
+
+/// Bounds checked cursor over a snapshot
+struct snapshot_reader
+{
+    void need(const std::size_t n) const
+    {
+        if (static_cast<std::size_t>(end - p) < n)
+            throw aegis::exception("Snapshot is truncated", make_error_code(error::snapshot_error));
+    }
+
+    template<typename T>
+    T get()
+    {
+        need(sizeof(T));
+        T v;
+        std::memcpy(&v, p, sizeof(T));
+        p += sizeof(T);
+        return v;
+    }
+
+    std::string str()
+    {
+        const auto n = get<uint32_t>();
+        need(n);
+        std::string s(p, n);
+        p += n;
+        return s;
+    }
+
+    void skip(const std::size_t n)
+    {
+        need(n);
+        p += n;
+    }
+
+    void skip_str()
+    {
+        skip(get<uint32_t>());
+    }
+
+    const char * p;
+    const char * end;
+};
+
+/// Read only view of a snapshot file, mapped where possible
+class snapshot_file
+{
+public:
+    snapshot_file() = default;
+    snapshot_file(const snapshot_file &) = delete;
+    snapshot_file & operator=(const snapshot_file &) = delete;
+
+    ~snapshot_file()
+    {
+#if !defined(_WIN32)
+        if (_map != nullptr)
+            ::munmap(_map, _size);
+#endif
+    }
+
+    /// @returns false if the file does not exist
+    bool open(const std::string & path)
+    {
+#if !defined(_WIN32)
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            if (errno == ENOENT)
+                return false;
+            throw aegis::exception(fmt::format("Unable to open snapshot {}: {}", path, std::strerror(errno)), make_error_code(error::snapshot_error));
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0)
+        {
+            ::close(fd);
+            throw aegis::exception(fmt::format("Unable to stat snapshot {}", path), make_error_code(error::snapshot_error));
+        }
+        _size = static_cast<std::size_t>(st.st_size);
+        if (_size > 0)
+        {
+            void * m = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (m == MAP_FAILED)
+            {
+                ::close(fd);
+                throw aegis::exception(fmt::format("Unable to map snapshot {}", path), make_error_code(error::snapshot_error));
+            }
+            _map = m;
+            _data = static_cast<const char *>(m);
+        }
+        ::close(fd);
+        return true;
+#else
+        std::ifstream f(path, std::ios::binary);
+        if (!f.is_open())
+            return false;
+        _contents.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+        _data = _contents.data();
+        _size = _contents.size();
+        return true;
+#endif
+    }
+
+    const char * data() const noexcept { return _data; }
+    std::size_t size() const noexcept { return _size; }
+
+private:
+    const char * _data = nullptr;
+    std::size_t _size = 0;
+#if !defined(_WIN32)
+    void * _map = nullptr;
+#else
+    std::string _contents;
+#endif
+};
+
+/// Flush a written file to disk
+inline bool snapshot_sync(const std::string & path) noexcept
+{
+#if !defined(_WIN32)
+    const int fd = ::open(path.c_str(), O_WRONLY);
+    if (fd < 0)
+        return false;
+    const bool ok = ::fsync(fd) == 0;
+    return (::close(fd) == 0) && ok;
+#else
+    const int fd = ::_open(path.c_str(), _O_WRONLY | _O_BINARY);
+    if (fd < 0)
+        return false;
+    const bool ok = ::_commit(fd) == 0;
+    return (::_close(fd) == 0) && ok;
+#endif
+}
+
+}
+
+AEGIS_DECL std::size_t snapshot::save(core & bot, const std::string & path)
+{
+    const std::string tmp = path + ".tmp";
+    std::size_t size = 0;
+    {
+        std::vector<char> buffer(1 << 20);
+        std::ofstream f;
+        f.rdbuf()->pubsetbuf(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        f.open(tmp, std::ios::binary | std::ios::trunc);
+        if (!f.is_open())
+            throw aegis::exception(fmt::format("Unable to open {} for writing", tmp), make_error_code(error::snapshot_error));
+
+        detail::snapshot_writer w{ f };
+        f.write(detail::snapshot_magic, sizeof(detail::snapshot_magic));
+        w.put<uint32_t>(version);
+        w.put<uint32_t>(detail::snapshot_byte_order);
+
+        // the maps are walked a stripe at a time. Pointers of a stripe are gathered first so no
+        // object lock is taken under a stripe lock, and the pin keeping them alive only lasts
+        // for that stripe so reclamation is not held up for the whole save
+        const auto user_count_pos = w.put_count();
+        uint64_t user_count = 0;
+        std::vector<user *> users;
+        for (std::size_t stripe = 0; stripe < bot.users.stripe_count; ++stripe)
+        {
+            auto pin = bot._reclaimer.pin();
+            users.clear();
+            bot.users.for_each_in_stripe(stripe, [&users](const snowflake &, user & _user)
+            {
+                users.push_back(&_user);
+            });
+            for (auto _user : users)
+            {
+                std::shared_lock<shared_mutex> l(_user->mtx());
+                w.put<int64_t>(_user->_member_id);
+                w.put(_user->_name.value());
+                w.put(_user->_avatar.value());
+                w.put<uint16_t>(_user->_discriminator);
+                w.put<uint8_t>((_user->_is_bot ? 1 : 0) | (_user->_mfa_enabled ? 2 : 0));
+            }
+            user_count += users.size();
+        }
+        w.patch_count(user_count_pos, user_count);
+
+        const auto guild_count_pos = w.put_count();
+        uint64_t guild_count = 0;
+        std::vector<guild *> guilds;
+        for (std::size_t stripe = 0; stripe < bot.guilds.stripe_count; ++stripe)
+        {
+            auto pin = bot._reclaimer.pin();
+            guilds.clear();
+            bot.guilds.for_each_in_stripe(stripe, [&guilds](const snowflake &, guild & _guild)
+            {
+                guilds.push_back(&_guild);
+            });
+            for (auto _guild : guilds)
+                _save_guild(w, *_guild);
+            guild_count += guilds.size();
+        }
+        w.patch_count(guild_count_pos, guild_count);
+
+        f.flush();
+        size = static_cast<std::size_t>(f.tellp());
+        if (!f)
+        {
+            f.close();
+            std::remove(tmp.c_str());
+            throw aegis::exception(fmt::format("Unable to write {}", tmp), make_error_code(error::snapshot_error));
+        }
+    }
+
+    // the data has to be on disk before the rename makes it the snapshot
+    if (!detail::snapshot_sync(tmp))
+    {
+        std::remove(tmp.c_str());
+        throw aegis::exception(fmt::format("Unable to sync {}", tmp), make_error_code(error::snapshot_error));
+    }
+#if defined(_WIN32)
+    // rename does not replace an existing file here
+    std::remove(path.c_str());
+#endif
+    if (std::rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        std::remove(tmp.c_str());
+        throw aegis::exception(fmt::format("Unable to replace {}", path), make_error_code(error::snapshot_error));
+    }
+    return size;
+}
+
+AEGIS_DECL void snapshot::_save_guild(detail::snapshot_writer & w, guild & _guild)
+{
+    // guild before channel, the order every other path takes them in
+    std::shared_lock<shared_mutex> l(_guild.mtx());
+    w.put<int64_t>(_guild.guild_id);
+    w.put<int32_t>(_guild.shard_id);
+    w.put(_guild.name);
+    w.put(_guild.icon);
+    w.put(_guild.splash);
+    w.put<int64_t>(_guild.owner_id);
+    w.put(_guild.region);
+    w.put<int64_t>(_guild.afk_channel_id);
+    w.put<uint32_t>(_guild.afk_timeout);
+    w.put<uint32_t>(_guild.verification_level);
+    w.put<uint32_t>(_guild.default_message_notifications);
+    w.put<uint32_t>(_guild.mfa_level);
+    w.put(_guild.joined_at);
+    w.put<uint32_t>(_guild.member_count);
+    w.put<uint8_t>((_guild.large ? 1 : 0) | (_guild.unavailable ? 2 : 0));
+
+    w.put<uint64_t>(_guild.roles.size());
+    for (auto & kv : _guild.roles)
+    {
+        auto & r = kv.second;
+        w.put<int64_t>(r.role_id);
+        w.put(r.name.value());
+        w.put<int64_t>(r._permission.get_allow_perms());
+        w.put<uint32_t>(r.color);
+        w.put<uint16_t>(r.position);
+        w.put<uint8_t>((r.hoist ? 1 : 0) | (r.managed ? 2 : 0) | (r.mentionable ? 4 : 0));
+    }
+
+    w.put<uint64_t>(_guild.channels.size());
+    for (auto & kv : _guild.channels)
+    {
+        auto c = kv.second;
+        std::shared_lock<shared_mutex> cl(c->mtx());
+        w.put<int64_t>(c->channel_id);
+        w.put<int64_t>(c->parent_id);
+        w.put<int64_t>(c->last_message_id);
+        w.put(c->name.value());
+        w.put(c->topic);
+        w.put<uint32_t>(c->position);
+        w.put<uint8_t>(static_cast<uint8_t>(c->type));
+        w.put<uint8_t>(c->_nsfw ? 1 : 0);
+        w.put<uint16_t>(c->bitrate);
+        w.put<uint16_t>(c->user_limit);
+        w.put<uint16_t>(c->rate_limit_per_user);
+        w.put<uint64_t>(c->overrides.size());
+        for (auto & o : c->overrides)
+        {
+            w.put<int64_t>(o.second.id);
+            w.put<uint8_t>(static_cast<uint8_t>(o.second.type));
+            w.put<int64_t>(o.second.allow);
+            w.put<int64_t>(o.second.deny);
+        }
+    }
+
+    // members whose information is missing are skipped, so the count is patched afterwards
+    const auto count_pos = w.put_count();
+    uint64_t member_count = 0;
+    for (auto & kv : _guild.members)
+    {
+        auto _user = kv.second;
+        std::shared_lock<shared_mutex> ul(_user->mtx());
+        auto gi = _guild._find_member_info(kv.first);
+        if (gi == nullptr)
+            continue;
+        w.put<int64_t>(kv.first);
+        w.put<uint64_t>(gi->joined_at);
+        w.put<uint8_t>((gi->deaf ? 1 : 0) | (gi->mute ? 2 : 0) | (gi->nickname.has_value() ? 4 : 0));
+        if (gi->nickname.has_value())
+            w.put(gi->nickname.value());
+        w.put<uint32_t>(static_cast<uint32_t>(gi->roles.size()));
+        for (auto & r : gi->roles)
+            w.put<int64_t>(r);
+        ++member_count;
+    }
+    w.patch_count(count_pos, member_count);
+}
+
+AEGIS_DECL bool snapshot::load(core & bot, const std::string & path)
+{
+    detail::snapshot_file file;
+    if (!file.open(path))
+        return false;
+
+    detail::snapshot_reader r{ file.data(), file.data() + file.size() };
+
+    r.need(sizeof(detail::snapshot_magic));
+    if (std::memcmp(r.p, detail::snapshot_magic, sizeof(detail::snapshot_magic)) != 0)
+        throw aegis::exception(fmt::format("{} is not a snapshot", path), make_error_code(error::snapshot_error));
+    r.p += sizeof(detail::snapshot_magic);
+    if (r.get<uint32_t>() != version)
+        throw aegis::exception(fmt::format("Snapshot {} is from another version", path), make_error_code(error::snapshot_error));
+    if (r.get<uint32_t>() != detail::snapshot_byte_order)
+        throw aegis::exception(fmt::format("Snapshot {} is from another platform", path), make_error_code(error::snapshot_error));
+
+    // entries the cache policy would not have kept are read past
+    const auto & policy = bot.get_cache_policy();
+
+    const auto user_count = r.get<uint64_t>();
+    for (uint64_t i = 0; i < user_count; ++i)
+    {
+        if (policy._user_limit > 0 && bot.users.size() >= policy._user_limit)
+        {
+            r.skip(sizeof(int64_t));
+            r.skip_str();
+            r.skip_str();
+            r.skip(sizeof(uint16_t) + sizeof(uint8_t));
+            continue;
+        }
+        auto _user = bot.user_create(r.get<int64_t>());
+        std::unique_lock<shared_mutex> l(_user->mtx());
+        _user->_name.assign(r.str());
+        _user->_avatar.assign(r.str());
+        _user->_discriminator = r.get<uint16_t>();
+        const auto flags = r.get<uint8_t>();
+        _user->_is_bot = (flags & 1) != 0;
+        _user->_mfa_enabled = (flags & 2) != 0;
+    }
+
+    const auto guild_count = r.get<uint64_t>();
+    for (uint64_t i = 0; i < guild_count; ++i)
+    {
+        const snowflake guild_id = r.get<int64_t>();
+        const auto shard_id = r.get<int32_t>();
+        auto _guild = bot.guilds.find_or_create(guild_id, [&]()
+        {
+            return std::make_unique<guild>(shard_id, guild_id, &bot, *bot._io_context);
+        });
+
+        std::unique_lock<shared_mutex> l(_guild->mtx());
+        _guild->_restored = true;
+        _guild->shard_id = shard_id;
+        _guild->name = r.str();
+        _guild->icon = r.str();
+        _guild->splash = r.str();
+        _guild->owner_id = r.get<int64_t>();
+        _guild->region = r.str();
+        _guild->afk_channel_id = r.get<int64_t>();
+        _guild->afk_timeout = r.get<uint32_t>();
+        _guild->verification_level = r.get<uint32_t>();
+        _guild->default_message_notifications = r.get<uint32_t>();
+        _guild->mfa_level = r.get<uint32_t>();
+        _guild->joined_at = r.str();
+        _guild->member_count = r.get<uint32_t>();
+        const auto flags = r.get<uint8_t>();
+        _guild->large = (flags & 1) != 0;
+        _guild->unavailable = (flags & 2) != 0;
+
+        const auto role_count = r.get<uint64_t>();
+        for (uint64_t j = 0; j < role_count; ++j)
+        {
+            gateway::objects::role _role;
+            _role.id = _role.role_id = r.get<int64_t>();
+            _role.name.assign(r.str());
+            _role._permission = permission(r.get<int64_t>());
+            _role.color = r.get<uint32_t>();
+            _role.position = r.get<uint16_t>();
+            const auto role_flags = r.get<uint8_t>();
+            _role.hoist = (role_flags & 1) != 0;
+            _role.managed = (role_flags & 2) != 0;
+            _role.mentionable = (role_flags & 4) != 0;
+            _guild->roles[_role.role_id] = _role;
+            _guild->_role_table.set(_role.role_id, _role._permission.get_allow_perms());
+        }
+        _guild->_perm_generation = permission_cache::next_generation();
+
+        const auto channel_count = r.get<uint64_t>();
+        for (uint64_t j = 0; j < channel_count; ++j)
+        {
+            if (!policy._channels)
+            {
+                r.skip(3 * sizeof(int64_t));
+                r.skip_str();
+                r.skip_str();
+                r.skip(sizeof(uint32_t) + 2 * sizeof(uint8_t) + 3 * sizeof(uint16_t));
+                const auto overwrite_count = r.get<uint64_t>();
+                for (uint64_t k = 0; k < overwrite_count; ++k)
+                    r.skip(3 * sizeof(int64_t) + sizeof(uint8_t));
+                continue;
+            }
+            const snowflake channel_id = r.get<int64_t>();
+            auto _channel = bot.channel_create(channel_id);
+            {
+                std::unique_lock<shared_mutex> cl(_channel->mtx());
+                _channel->guild_id = guild_id;
+                _channel->_guild = _guild;
+                _channel->parent_id = r.get<int64_t>();
+                _channel->last_message_id = r.get<int64_t>();
+                _channel->name.assign(r.str());
+                _channel->topic = r.str();
+                _channel->position = r.get<uint32_t>();
+                _channel->type = static_cast<gateway::objects::channel::channel_type>(r.get<uint8_t>());
+                _channel->_nsfw = r.get<uint8_t>() != 0;
+                _channel->bitrate = r.get<uint16_t>();
+                _channel->user_limit = r.get<uint16_t>();
+                _channel->rate_limit_per_user = r.get<uint16_t>();
+                _channel->overrides.clear();
+                const auto overwrite_count = r.get<uint64_t>();
+                for (uint64_t k = 0; k < overwrite_count; ++k)
+                {
+                    gateway::objects::permission_overwrite o;
+                    o.id = r.get<int64_t>();
+                    o.type = static_cast<gateway::objects::overwrite_type>(r.get<uint8_t>());
+                    o.allow = r.get<int64_t>();
+                    o.deny = r.get<int64_t>();
+                    _channel->overrides[o.id] = o;
+                }
+                _channel->_perm_generation.store(permission_cache::next_generation(), std::memory_order_release);
+            }
+            _guild->channels[channel_id] = _channel;
+        }
+
+        const bool cache_members = policy.cache_members(_guild->member_count);
+        const auto member_count = r.get<uint64_t>();
+        for (uint64_t j = 0; j < member_count; ++j)
+        {
+            if (!cache_members)
+            {
+                r.skip(sizeof(int64_t) + sizeof(uint64_t));
+                if (r.get<uint8_t>() & 4)
+                    r.skip_str();
+                r.skip(r.get<uint32_t>() * sizeof(int64_t));
+                continue;
+            }
+            const snowflake member_id = r.get<int64_t>();
+            auto _member = bot.user_create(member_id);
+            _guild->members[member_id] = _member;
+
+            std::unique_lock<shared_mutex> ul(_member->mtx());
+            auto & g_info = _member->_join_nolock(_guild, false);
+            g_info.joined_at = r.get<uint64_t>();
+            const auto member_flags = r.get<uint8_t>();
+            g_info.deaf = (member_flags & 1) != 0;
+            g_info.mute = (member_flags & 2) != 0;
+            if (member_flags & 4)
+                g_info.nickname.assign(r.str());
+            else
+                g_info.nickname.reset();
+            for (auto & role_id : g_info.roles)
+                _guild->_role_index.remove(g_info.role_slot, role_id);
+            g_info.roles.clear();
+            const auto member_role_count = r.get<uint32_t>();
+            for (uint32_t k = 0; k < member_role_count; ++k)
+            {
+                g_info.roles.emplace_back(r.get<int64_t>());
+                _guild->_role_index.add(g_info.role_slot, g_info.roles.back());
+            }
+            g_info.perm_generation = permission_cache::next_generation();
+        }
+    }
+
+    if (r.p != r.end)
+        throw aegis::exception(fmt::format("Snapshot {} has trailing data", path), make_error_code(error::snapshot_error));
+    return true;
+}
+
+}
+
+#endif
@@ -26,7 +26,7 @@ AEGIS_DECL std::string user::get_full_name() const noexcept
 {
     std::shared_lock<shared_mutex> l(_m);
 
-    return fmt::format("{}#{:0=4}", std::string(_name), _discriminator);
+    return fmt::format("{}#{:0=4}", _name.value(), _discriminator);
 }
 
 AEGIS_DECL void user::_load(guild * _guild, const json & obj, shards::shard * _shard, bool self_add)
@@ -42,8 +42,8 @@ AEGIS_DECL void user::_load_nolock(guild * _guild, const json & obj, shards::sha
 
     try
     {
-        if (user.count("username") && !user["username"].is_null()) _name = user["username"].get<std::string>();
-        if (user.count("avatar") && !user["avatar"].is_null()) _avatar = user["avatar"].get<std::string>();
+        if (user.count("username") && !user["username"].is_null()) _name.assign(user["username"].get<std::string>());
+        if (user.count("avatar") && !user["avatar"].is_null()) _avatar.assign(user["avatar"].get<std::string>());
         if (user.count("discriminator") && !user["discriminator"].is_null()) _discriminator = static_cast<uint16_t>(std::stoi(user["discriminator"].get<std::string>()));
         if (user.count("bot"))
             _is_bot = user["bot"].is_null() ? false : true;
@@ -57,13 +57,13 @@ AEGIS_DECL void user::_load_nolock(guild * _guild, const json & obj, shards::sha
             if (guild_lock)
             {
                 _guild->_add_member(this);
-                g_info = &_join(_guild->guild_id);
+                g_info = &_join(_guild);
 
             }
             else
             {
                 _guild->_add_member_nolock(this);
-                g_info = &_join_nolock(_guild->guild_id);
+                g_info = &_join_nolock(_guild, false);
             }
 
             if (obj.count("deaf") && !obj["deaf"].is_null()) g_info->deaf = obj["deaf"];
@@ -75,17 +75,10 @@ AEGIS_DECL void user::_load_nolock(guild * _guild, const json & obj, shards::sha
             }
 
             if (obj.count("roles") && !obj["roles"].is_null())
-            {
-                g_info->roles.clear();
-                g_info->roles.emplace_back(_guild->guild_id);//default everyone role
-
-                json roles = obj["roles"];
-                for (auto & r : roles)
-                    g_info->roles.emplace_back(std::stoull(r.get<std::string>()));
-            }
+                _guild->_set_member_roles(*g_info, obj["roles"]);
 
             if (obj.count("nick") && !obj["nick"].is_null())
-                g_info->nickname = obj["nick"].get<std::string>();
+                g_info->nickname.assign(obj["nick"].get<std::string>());
             else
                 g_info->nickname.reset();
         }
@@ -99,94 +92,65 @@ AEGIS_DECL void user::_load_nolock(guild * _guild, const json & obj, shards::sha
     }
 }
 
-AEGIS_DECL user::guild_info & user::get_guild_info(snowflake guild_id) noexcept
+AEGIS_DECL user::guild_info & user::get_guild_info(snowflake guild_id)
 {
-    std::unique_lock<shared_mutex> l(_m);
-
-    auto g = std::find_if(std::begin(guilds), std::end(guilds), [&guild_id](const std::unique_ptr<guild_info> & gi)
-    {
-        if (gi->id == guild_id)
-            return true;
-        return false;
-    });
-    if (g == guilds.end())
-    {
-#if defined(AEGIS_CXX17)
-        return *guilds.emplace_back(std::make_unique<guild_info>(guild_id));
-#else
-        return **guilds.insert(guilds.end(), std::make_unique<guild_info>(guild_id));
-#endif
-    }
-    return **g;
+    std::shared_lock<shared_mutex> l(_m);
+    return get_guild_info_nolock(guild_id);
 }
 
-AEGIS_DECL user::guild_info & user::get_guild_info_nolock(snowflake guild_id) noexcept
+AEGIS_DECL user::guild_info & user::get_guild_info_nolock(snowflake guild_id)
 {
-    auto g = std::find_if(std::begin(guilds), std::end(guilds), [&guild_id](const std::unique_ptr<guild_info> & gi)
-    {
-        if (gi->id == guild_id)
-            return true;
-        return false;
-    });
-    if (g == guilds.end())
-    {
-#if defined(AEGIS_CXX17)
-        return *guilds.emplace_back(std::make_unique<guild_info>(guild_id));
-#else
-        return **guilds.insert(guilds.end(), std::make_unique<guild_info>(guild_id));
-#endif
-    }
-    return **g;
+    auto g = _find_guild_info(guild_id);
+    if (g == nullptr)
+        throw exception(fmt::format("User [{}] is not a member of guild [{}]", _member_id, guild_id), make_error_code(error::member_not_found));
+    return *g;
 }
 
 AEGIS_DECL user::guild_info * user::get_guild_info_nocreate(snowflake guild_id) const noexcept
 {
-    std::unique_lock<shared_mutex> l(_m);
+    std::shared_lock<shared_mutex> l(_m);
+    return _find_guild_info(guild_id);
+}
 
-    auto g = std::find_if(std::begin(guilds), std::end(guilds), [&guild_id](const std::unique_ptr<guild_info> & gi)
-    {
+AEGIS_DECL user::guild_info * user::_find_guild_info(snowflake guild_id) const noexcept
+{
+    for (auto gi : guilds)
         if (gi->id == guild_id)
-            return true;
-        return false;
-    });
-    if (g == guilds.end())
-    {
-        return nullptr;
-    }
-    return (*g).get();
+            return gi;
+    return nullptr;
 }
 
 AEGIS_DECL std::string user::get_name(snowflake guild_id) noexcept
 {
-    std::unique_lock<shared_mutex> l(_m);
+    std::shared_lock<shared_mutex> l(_m);
 
-    const auto & def = get_guild_info_nolock(guild_id).nickname;
-    return def.has_value() ? def.value() : "";
+    auto g = _find_guild_info(guild_id);
+    if (g == nullptr)
+        return "";
+    return g->nickname.value();
 }
 
-AEGIS_DECL user::guild_info & user::_join(snowflake guild_id)
+AEGIS_DECL user::guild_info & user::_join(guild * _guild, bool guild_lock)
 {
     std::unique_lock<shared_mutex> l(_m);
-    return _join_nolock(guild_id);
+    return _join_nolock(_guild, guild_lock);
 }
 
-AEGIS_DECL user::guild_info & user::_join_nolock(snowflake guild_id)
+AEGIS_DECL user::guild_info & user::_join_nolock(guild * _guild, bool guild_lock)
 {
-    auto g = std::find_if(std::begin(guilds), std::end(guilds), [&guild_id](const std::unique_ptr<guild_info> & gi)
-    {
-        if (gi->id == guild_id)
-            return true;
-        return false;
-    });
-    if (g == guilds.end())
+    auto g = _find_guild_info(_guild->guild_id);
+    if (g != nullptr)
+        return *g;
+
+    if (guild_lock)
     {
-#if defined(AEGIS_CXX17)
-        return *guilds.emplace_back(std::make_unique<guild_info>(guild_id));
-#else
-        return **guilds.insert(guilds.end(), std::make_unique<guild_info>(guild_id));
-#endif
+        std::unique_lock<shared_mutex> l(_guild->mtx());
+        g = &_guild->_member_info_nolock(_member_id);
     }
-    return **g;
+    else
+        g = &_guild->_member_info_nolock(_member_id);
+    guilds.push_back(g);
+    return *g;
 }
 
 AEGIS_DECL void user::_load_data(gateway::objects::user mbr)
@@ -194,9 +158,9 @@ AEGIS_DECL void user::_load_data(gateway::objects::user mbr)
     std::unique_lock<shared_mutex> l(_m);
 
     if (!mbr.avatar.empty())
-        _avatar = mbr.avatar;
+        _avatar.assign(mbr.avatar);
     if (!mbr.username.empty())
-        _name = mbr.username;
+        _name.assign(mbr.username);
     if (!mbr.avatar.empty())
         _discriminator = static_cast<uint16_t>(std::stoi(mbr.discriminator));
 
@@ -0,0 +1,268 @@
+//
+// intern.hpp
+// **********
+//
+// Copyright (c) 2019 Sharon W (sharon at aegis dot gg)
+//
+// Distributed under the MIT License. (See accompanying file LICENSE)
+//
+
+#pragma once
+
+#include "aegis/config.hpp"
+#include "aegis/flat_map.hpp"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+namespace aegis
+{
+
+class string_table;
+
+/// Handle to an immutable string shared by every holder of the same text
+/**
+ * Nicknames and the like repeat across guilds and members. Interning stores each distinct
+ * text once and makes the handle a single pointer. Copies only touch a reference count and
+ * equality is a pointer comparison.
+ *
+ * A default constructed handle holds no string, which mirrors an empty lib::optional.
+ */
+class interned_string
+{
+public:
+    interned_string() noexcept = default;
+
+    /// Intern a string
+    /**
+     * @param str Text to intern
+     */
+    AEGIS_DECL interned_string(const std::string & str);
+
+    interned_string(const char * str)
+        : interned_string(std::string(str))
+    {
+    }
+
+    interned_string(const interned_string & other) noexcept
+        : _node(other._node)
+    {
+        if (_node)
+            _node->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    interned_string(interned_string && other) noexcept
+        : _node(other._node)
+    {
+        other._node = nullptr;
+    }
+
+    interned_string & operator=(const interned_string & other) noexcept
+    {
+        interned_string tmp(other);
+        std::swap(_node, tmp._node);
+        return *this;
+    }
+
+    interned_string & operator=(interned_string && other) noexcept
+    {
+        std::swap(_node, other._node);
+        return *this;
+    }
+
+    ~interned_string()
+    {
+        reset();
+    }
+
+    /// Replace the string unless it already holds the same text
+    /**
+     * Unchanged values, the common case for member and presence updates, cost a comparison
+     * and no trip to the string table
+     * @param str Text to hold
+     * @returns true if the string changed
+     */
+    bool assign(const std::string & str)
+    {
+        if (_node && _node->str == str)
+            return false;
+        *this = interned_string(str);
+        return true;
+    }
+
+    /// Drop the string
+    void reset() noexcept
+    {
+        if (_node)
+        {
+            _node->refs.fetch_sub(1, std::memory_order_release);
+            _node = nullptr;
+        }
+    }
+
+    /// Check whether a string is held
+    bool has_value() const noexcept
+    {
+        return _node != nullptr;
+    }
+
+    explicit operator bool() const noexcept
+    {
+        return has_value();
+    }
+
+    /// Get the string
+    /**
+     * @returns The string or an empty string if none is held
+     */
+    const std::string & value() const noexcept
+    {
+        return _node ? _node->str : _empty();
+    }
+
+    const std::string & str() const noexcept
+    {
+        return value();
+    }
+
+    operator const std::string &() const noexcept
+    {
+        return value();
+    }
+
+    bool operator==(const interned_string & other) const noexcept
+    {
+        return _node == other._node;
+    }
+
+    bool operator!=(const interned_string & other) const noexcept
+    {
+        return _node != other._node;
+    }
+
+    bool operator==(const std::string & other) const noexcept
+    {
+        return value() == other;
+    }
+
+    bool operator!=(const std::string & other) const noexcept
+    {
+        return value() != other;
+    }
+
+    friend bool operator==(const std::string & a, const interned_string & b) noexcept
+    {
+        return b == a;
+    }
+
+    friend bool operator!=(const std::string & a, const interned_string & b) noexcept
+    {
+        return b != a;
+    }
+
+    friend std::ostream & operator<<(std::ostream & os, const interned_string & s)
+    {
+        return os << s.value();
+    }
+
+private:
+    friend class string_table;
+
+    struct node
+    {
+        explicit node(const std::string & s)
+            : str(s)
+        {
+        }
+
+        std::atomic<uint32_t> refs{ 1 };
+        const std::string str;
+    };
+
+    static const std::string & _empty() noexcept
+    {
+        static const std::string empty;
+        return empty;
+    }
+
+    node * _node = nullptr;
+};
+
+/// Process wide table backing interned_string
+/**
+ * Split into stripes, each a flat_map behind its own mutex. Strings no longer referenced are
+ * dropped by a sweep of their stripe once it has doubled in size since the last sweep.
+ */
+class string_table
+{
+public:
+    /// Get the table
+    static string_table & instance()
+    {
+        // never destroyed so handles released during static destruction stay valid
+        static string_table * t = new string_table();
+        return *t;
+    }
+
+    string_table(const string_table &) = delete;
+    string_table & operator=(const string_table &) = delete;
+
+    /// Intern a string
+    /**
+     * @param str Text to intern
+     * @returns Handle to the shared copy
+     */
+    AEGIS_DECL interned_string intern(const std::string & str);
+
+    /// Drop every string no longer referenced
+    /**
+     * @returns Amount of strings dropped
+     */
+    AEGIS_DECL std::size_t sweep();
+
+    /// Get the amount of distinct strings held, including unreferenced ones not swept yet
+    AEGIS_DECL std::size_t size() const;
+
+private:
+    using node = interned_string::node;
+
+    struct deref_hash
+    {
+        std::size_t operator()(const std::string * s) const noexcept
+        {
+            return std::hash<std::string>()(*s);
+        }
+    };
+
+    struct deref_equal
+    {
+        bool operator()(const std::string * a, const std::string * b) const noexcept
+        {
+            return *a == *b;
+        }
+    };
+
+    struct stripe
+    {
+        mutable std::mutex m;
+        flat_map<const std::string *, node *, deref_hash, deref_equal> map; /**< Keyed by the node's own string */
+        std::size_t sweep_at = 64;
+    };
+
+    static constexpr std::size_t stripe_count = 16;
+
+    string_table() = default;
+
+    AEGIS_DECL static std::size_t _sweep(stripe & s);
+
+    stripe _stripes[stripe_count];
+};
+
+}
+
+#if defined(AEGIS_HEADER_ONLY)
+#include "aegis/impl/intern.cpp"
+#endif
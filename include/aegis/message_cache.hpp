@@ -0,0 +1,176 @@
+//
+// message_cache.hpp
+// *****************
+//
+// Copyright (c) 2019 Sharon W (sharon at aegis dot gg)
+//
+// Distributed under the MIT License. (See accompanying file LICENSE)
+//
+
+#pragma once
+
+#include "aegis/config.hpp"
+#include "aegis/snowflake.hpp"
+#include "aegis/gateway/objects/message.hpp"
+#include <nlohmann/json.hpp>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace aegis
+{
+
+/// Recent messages of each channel, kept from MESSAGE_CREATE
+/**
+ * Update, delete and reaction events only carry message ids. With the cache enabled they come
+ * with the message as it was last seen, saving a REST call for it.
+ *
+ * Each channel keeps its newest messages in a ring that grows up to the per channel limit and
+ * then overwrites the oldest. Across channels the oldest messages are dropped once the
+ * estimated memory use exceeds the global limit. Messages are shared and immutable, so handing
+ * one out is a reference count increment.
+ *
+ * Enable through cache_policy::messages().
+ */
+class message_cache
+{
+public:
+    using message_ptr = std::shared_ptr<const gateway::objects::message>;
+
+    /// Create a cache
+    /**
+     * @param per_channel Messages kept per channel
+     * @param max_bytes Estimated memory all messages may use. 0 for no limit
+     */
+    AEGIS_DECL message_cache(std::size_t per_channel, std::size_t max_bytes);
+
+    message_cache(const message_cache &) = delete;
+    message_cache & operator=(const message_cache &) = delete;
+
+    /// Add a new message
+    /**
+     * @param msg Message from MESSAGE_CREATE
+     */
+    AEGIS_DECL void add(gateway::objects::message msg);
+
+    /// Find a message
+    /**
+     * @param channel_id Snowflake of the channel of the message
+     * @param message_id Snowflake of the message
+     * @returns The message or nullptr if it is not cached
+     */
+    AEGIS_DECL message_ptr find(snowflake channel_id, snowflake message_id) const;
+
+    /// Apply a MESSAGE_UPDATE to a cached message
+    /**
+     * @param channel_id Snowflake of the channel of the message
+     * @param message_id Snowflake of the message
+     * @param partial The `d` field of the MESSAGE_UPDATE, holding only what changed
+     * @returns The message before the update or nullptr if it is not cached
+     */
+    AEGIS_DECL message_ptr update(snowflake channel_id, snowflake message_id, const nlohmann::json & partial);
+
+    /// Remove a deleted message
+    /**
+     * @param channel_id Snowflake of the channel of the message
+     * @param message_id Snowflake of the message
+     * @returns The removed message or nullptr if it is not cached
+     */
+    AEGIS_DECL message_ptr remove(snowflake channel_id, snowflake message_id);
+
+    /// Drop every message of a channel
+    /**
+     * @param channel_id Snowflake of the channel
+     */
+    AEGIS_DECL void remove_channel(snowflake channel_id);
+
+    /// Estimate the memory a message uses
+    AEGIS_DECL static std::size_t footprint(const gateway::objects::message & msg) noexcept;
+
+    /// Get the amount of messages held
+    std::size_t size() const noexcept
+    {
+        return _count.load(std::memory_order_relaxed);
+    }
+
+    /// Get the estimated memory used by the messages held
+    std::size_t bytes() const noexcept
+    {
+        return _bytes.load(std::memory_order_relaxed);
+    }
+
+    /// Get the amount of lookups that found their message
+    uint64_t hits() const noexcept
+    {
+        return _hits.load(std::memory_order_relaxed);
+    }
+
+    /// Get the amount of lookups that did not find their message
+    uint64_t misses() const noexcept
+    {
+        return _misses.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct entry
+    {
+        uint64_t seq;
+        std::size_t bytes;
+        message_ptr msg; /**< nullptr once the message was deleted */
+    };
+
+    struct ring
+    {
+        std::vector<entry> slots; /**< Grows up to the per channel limit, then wraps */
+        std::size_t head = 0; /**< Slot of the oldest entry */
+        std::size_t count = 0;
+
+        entry & at(std::size_t i) noexcept
+        {
+            return slots[(head + i) % slots.size()];
+        }
+
+        const entry & at(std::size_t i) const noexcept
+        {
+            return slots[(head + i) % slots.size()];
+        }
+    };
+
+    /// Find the entry of a message - caller must lock _m
+    AEGIS_DECL const entry * _find(snowflake channel_id, snowflake message_id) const noexcept;
+
+    entry * _find(snowflake channel_id, snowflake message_id) noexcept
+    {
+        return const_cast<entry *>(static_cast<const message_cache &>(*this)._find(channel_id, message_id));
+    }
+
+    /// Drop the oldest entry of a ring - caller must lock _m
+    AEGIS_DECL void _pop(ring & r) noexcept;
+
+    /// Drop the oldest messages across channels until under the memory limit - caller must lock _m
+    AEGIS_DECL void _trim() noexcept;
+
+    /// Rebuild the global order without entries that are already gone - caller must lock _m
+    AEGIS_DECL void _compact();
+
+    std::size_t _per_channel;
+    std::size_t _max_bytes;
+    mutable std::mutex _m;
+    std::unordered_map<snowflake, ring> _rings;
+    std::deque<std::pair<snowflake, uint64_t>> _order; /**< Channel and sequence of every entry, oldest first */
+    std::size_t _entries = 0; /**< Ring entries including deleted ones */
+    uint64_t _seq = 0;
+    std::atomic<std::size_t> _count{ 0 };
+    std::atomic<std::size_t> _bytes{ 0 };
+    mutable std::atomic<uint64_t> _hits{ 0 };
+    mutable std::atomic<uint64_t> _misses{ 0 };
+};
+
+}
+
+#if defined(AEGIS_HEADER_ONLY)
+#include "aegis/impl/message_cache.cpp"
+#endif
@@ -0,0 +1,174 @@
+//
+// permission_cache.hpp
+// ********************
+//
+// Copyright (c) 2019 Sharon W (sharon at aegis dot gg)
+//
+// Distributed under the MIT License. (See accompanying file LICENSE)
+//
+
+#pragma once
+
+#include "aegis/config.hpp"
+#include "aegis/snowflake.hpp"
+#include "aegis/flat_map.hpp"
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+namespace aegis
+{
+
+/// Computed permissions of members in channels of one guild
+/**
+ * Entries are not invalidated by walking the cache. Instead the guild, each channel and each
+ * member carry a generation that is replaced whenever something their permissions depend on
+ * changes: roles and the owner for the guild, overwrites for a channel and roles for a member.
+ * An entry records the generations it was computed under and only matches while all three are
+ * still current. Generations come from one process wide counter, so a member that leaves and
+ * rejoins or a channel that is recreated never matches an old entry.
+ *
+ * The cache is cleared once it reaches its size limit.
+ */
+class permission_cache
+{
+public:
+    /// Generations a computed permission depends on
+    struct stamp
+    {
+        uint64_t guild;
+        uint64_t channel;
+        uint64_t member;
+
+        bool operator==(const stamp & other) const noexcept
+        {
+            return guild == other.guild && channel == other.channel && member == other.member;
+        }
+    };
+
+    /// Create a cache
+    /**
+     * @param limit Entries to hold before clearing. 0 disables the cache
+     */
+    explicit permission_cache(std::size_t limit = 4096) noexcept
+        : _limit(limit)
+    {
+    }
+
+    permission_cache(const permission_cache &) = delete;
+    permission_cache & operator=(const permission_cache &) = delete;
+
+    /// Get a new generation, distinct from every one handed out before
+    static uint64_t next_generation() noexcept
+    {
+        static std::atomic<uint64_t> generation{ 0 };
+        return generation.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    /// Look up the permissions of a member in a channel
+    /**
+     * @param member_id Snowflake of the member
+     * @param channel_id Snowflake of the channel
+     * @param current Current generations of the guild, channel and member
+     * @param permissions Set to the cached permissions on a hit
+     * @returns true on a hit
+     */
+    bool find(snowflake member_id, snowflake channel_id, const stamp & current, int64_t & permissions) const
+    {
+        if (_limit == 0)
+            return false;
+        std::lock_guard<std::mutex> l(_m);
+        auto it = _entries.find(key{ member_id, channel_id });
+        if (it == _entries.end() || !(it->second.generations == current))
+        {
+            ++_misses;
+            return false;
+        }
+        ++_hits;
+        permissions = it->second.permissions;
+        return true;
+    }
+
+    /// Store the permissions of a member in a channel
+    /**
+     * @param member_id Snowflake of the member
+     * @param channel_id Snowflake of the channel
+     * @param current Generations read before the permissions were computed
+     * @param permissions Computed permissions
+     */
+    void store(snowflake member_id, snowflake channel_id, const stamp & current, int64_t permissions)
+    {
+        if (_limit == 0)
+            return;
+        std::lock_guard<std::mutex> l(_m);
+        if (_entries.size() >= _limit)
+            _entries.clear();
+        _entries[key{ member_id, channel_id }] = entry{ current, permissions };
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> l(_m);
+        _entries.clear();
+    }
+
+    std::size_t size() const
+    {
+        std::lock_guard<std::mutex> l(_m);
+        return _entries.size();
+    }
+
+    /// Get the amount of lookups answered from the cache
+    uint64_t hits() const
+    {
+        std::lock_guard<std::mutex> l(_m);
+        return _hits;
+    }
+
+    /// Get the amount of lookups that had to compute the permissions
+    uint64_t misses() const
+    {
+        std::lock_guard<std::mutex> l(_m);
+        return _misses;
+    }
+
+private:
+    struct key
+    {
+        snowflake member_id;
+        snowflake channel_id;
+
+        bool operator==(const key & other) const noexcept
+        {
+            return member_id == other.member_id && channel_id == other.channel_id;
+        }
+    };
+
+    struct key_hash
+    {
+        std::size_t operator()(const key & k) const noexcept
+        {
+            // flat_map uses the hash as is, so mix both ids fully
+            uint64_t h = static_cast<uint64_t>(k.member_id.get()) * 0x9e3779b97f4a7c15ULL;
+            h ^= static_cast<uint64_t>(k.channel_id.get()) + 0x632be59bd9b4e019ULL + (h << 6) + (h >> 2);
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdULL;
+            h ^= h >> 33;
+            return static_cast<std::size_t>(h);
+        }
+    };
+
+    struct entry
+    {
+        stamp generations;
+        int64_t permissions;
+    };
+
+    std::size_t _limit;
+    mutable std::mutex _m;
+    flat_map<key, entry, key_hash> _entries;
+    mutable uint64_t _hits = 0;
+    mutable uint64_t _misses = 0;
+};
+
+}
@@ -0,0 +1,98 @@
+//
+// presence_filter.hpp
+// *******************
+//
+// Copyright (c) 2019 Sharon W (sharon at aegis dot gg)
+//
+// Distributed under the MIT License. (See accompanying file LICENSE)
+//
+
+#pragma once
+
+#include "aegis/config.hpp"
+#include "aegis/snowflake.hpp"
+#include <nlohmann/json.hpp>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
+
+namespace aegis
+{
+
+/// Detects PRESENCE_UPDATE events that carry nothing new
+/**
+ * The gateway sends a presence once per guild the user shares with the bot. The filter
+ * remembers a signature of the guild independent fields (status, activities, client status and
+ * user) per user. An identical signature seen again within the window is reported as a repeat.
+ * The window starts at the first sighting, so unchanged presences still pass once per window.
+ */
+class presence_filter
+{
+public:
+    /// Create a filter
+    /**
+     * @param window How long a signature suppresses identical ones
+     */
+    AEGIS_DECL explicit presence_filter(std::chrono::milliseconds window);
+
+    presence_filter(const presence_filter &) = delete;
+    presence_filter & operator=(const presence_filter &) = delete;
+
+    /// Compute the signature of a presence
+    /**
+     * @param d The `d` field of a PRESENCE_UPDATE
+     * @returns Hash of the guild independent fields
+     */
+    AEGIS_DECL static uint64_t signature(const nlohmann::json & d);
+
+    /// Check a presence against the last one of the same user
+    /**
+     * Records the signature if it is not a repeat
+     * @param user_id Id of the user
+     * @param sig Result of signature()
+     * @returns true if the same signature was recorded within the window
+     */
+    AEGIS_DECL bool repeat(snowflake user_id, uint64_t sig);
+
+    /// Get the amount of presences reported as repeats
+    uint64_t suppressed() const noexcept
+    {
+        return _suppressed.load(std::memory_order_relaxed);
+    }
+
+    /// Get the amount of presences that were new or changed
+    uint64_t passed() const noexcept
+    {
+        return _passed.load(std::memory_order_relaxed);
+    }
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    struct record
+    {
+        uint64_t sig;
+        clock::time_point seen;
+    };
+
+    struct stripe
+    {
+        std::mutex m;
+        std::unordered_map<snowflake, record> users;
+        clock::time_point swept;
+    };
+
+    static constexpr std::size_t stripe_count = 16;
+
+    clock::duration _window;
+    stripe _stripes[stripe_count];
+    std::atomic<uint64_t> _suppressed{ 0 };
+    std::atomic<uint64_t> _passed{ 0 };
+};
+
+}
+
+#if defined(AEGIS_HEADER_ONLY)
+#include "aegis/impl/presence_filter.cpp"
+#endif
@@ -16,7 +16,11 @@
 #include <future>
 #include <chrono>
 #include <queue>
+#include <deque>
+#include <algorithm>
 #include <atomic>
+#include <asio/post.hpp>
+#include <asio/steady_timer.hpp>
 #include <spdlog/spdlog.h>
 
 namespace aegis
@@ -45,6 +49,10 @@ enum bucket_type
  * Bucket class for tracking the ratelimits per snowflake per major parameter.
  * Each bucket tracks a single major parameter and a single snowflake
  * Current major parameters are GUILD, CHANNEL, and EMOJI
+ *
+ * Requests pass through a bucket one at a time and in the order they were queued. While the
+ * ratelimit is exhausted the bucket waits on a timer rather than a thread, and a request
+ * cancelled while queued leaves the queue right away.
  */
 class bucket
 {
@@ -59,6 +67,7 @@ public:
         , _call(call)
         , _io_context(_io_context)
         , _global_limit(global_limit)
+        , _timer(_io_context)
     {
 
     }
@@ -95,37 +104,57 @@ public:
         return true;
     }
 
-    rest::rest_reply perform(rest::request_params params)
+    /// Queue a request behind the bucket
+    /**
+     * start is posted to the io_context with true once the bucket lets the request through,
+     * after which the caller has to call perform() and then release(). If the request is
+     * cancelled while queued, start is posted with false instead and the bucket is not held.
+     * @param handle Cancellation handle of the request
+     * @param start Callable taking whether the request was let through
+     */
+    void acquire(const std::shared_ptr<rest::request_handle> & handle, std::function<void(bool)> start)
     {
-        std::lock_guard<std::mutex> lock(m);
-        while (!can_perform())
         {
-            //TODO: find a better solution - wrap asio execution handling, poll ratelimit object to track ordering and execution
-            // not an ideal scenario, but by current design rescheduling a message that would be ratelimited
-            // would cause out of order messages
-            auto waitfor = milliseconds((reset.load(std::memory_order_relaxed)
-                                         - std::chrono::duration_cast<milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count())/* + _time_delay*/);
-            spdlog::get("aegis")->debug("Ratelimit almost hit: {}({}) - waiting {}ms", rest::rest_controller::get_method(params.method), params.path, waitfor.count());
-            std::this_thread::sleep_for(waitfor);
+            std::lock_guard<std::mutex> lock(m);
+            _waiters.push_back(waiter{ handle, std::move(start) });
         }
-        rest::rest_reply reply(_call(params));
-        auto _now = std::chrono::duration_cast<milliseconds>(std::chrono::system_clock::now().time_since_epoch());
-        if (reply.reply_code == 429)
+        if (handle && !handle->_wait([this, h = handle.get()] { _cancel_waiter(h); }))
+            _cancel_waiter(handle.get());
+
         {
-            if (reset_bypass)
-            {
-                spdlog::get("aegis")->warn("Ratelimit hit - retrying in {}ms...", reset_bypass);
-                std::this_thread::sleep_for(milliseconds(reset_bypass));
-            }
-            else
-            {
-                spdlog::get("aegis")->warn("Ratelimit hit - retrying in {}s...", reply.retry / 1000);
-                std::this_thread::sleep_for(milliseconds(reply.retry));
-            }
-            reply = _call(params);
-            if (reply.reply_code == 429)
-                spdlog::get("aegis")->error("Ratelimit hit twice. Giving up.");
+            std::lock_guard<std::mutex> lock(m);
+            if (_busy)
+                return;
+            _busy = true;
         }
+        _next();
+    }
+
+    /// Let the next queued request through once the ratelimit allows it
+    /**
+     * Must follow every perform() of a request let through by acquire()
+     */
+    void release()
+    {
+        _next();
+    }
+
+    /// Perform a request let through by acquire()
+    /**
+     * A 429 reply is returned to the caller, which schedules the retry
+     * @see retry_after
+     * @param params Request to perform
+     * @throws aegis::exception Thrown when the request was cancelled while queued
+     * @returns rest::rest_reply
+     */
+    rest::rest_reply perform(rest::request_params params)
+    {
+        if (params.handle)
+            params.handle->_check();
+        rest::rest_reply reply(_call(params));
+        auto _now = std::chrono::duration_cast<milliseconds>(std::chrono::system_clock::now().time_since_epoch());
+        if (reply.transport_error)
+            return reply;
 
         limit.store(reply.limit, std::memory_order_relaxed);
         remaining.store(reply.remaining, std::memory_order_relaxed);
@@ -140,6 +169,16 @@ public:
         return reply;
     }
 
+    /// Get the time to wait before retrying a ratelimited request
+    /**
+     * @param reply 429 reply of the request
+     * @returns Delay before the request may be retried
+     */
+    milliseconds retry_after(const rest::rest_reply & reply) const noexcept
+    {
+        return milliseconds(reset_bypass ? reset_bypass : reply.retry);
+    }
+
     bool ignore_rates = false;
     std::mutex m;
     rest_call & _call;
@@ -147,9 +186,69 @@ public:
     int32_t reset_bypass = 0;
 
 private:
+    struct waiter
+    {
+        std::shared_ptr<rest::request_handle> handle;
+        std::function<void(bool)> start;
+    };
+
+    /// Hand the bucket to the first queued request, or wait for the ratelimit to reset
+    void _next()
+    {
+        std::function<void(bool)> start;
+        {
+            std::lock_guard<std::mutex> lock(m);
+            if (_waiters.empty())
+            {
+                _busy = false;
+                return;
+            }
+            if (!can_perform())
+            {
+                auto waitfor = milliseconds(reset.load(std::memory_order_relaxed)
+                                            - duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count());
+                spdlog::get("aegis")->debug("Ratelimit almost hit: {} queued - waiting {}ms", _waiters.size(), waitfor.count());
+                _timer.expires_after(waitfor);
+                _timer.async_wait([this](const asio::error_code & ec)
+                {
+                    if (ec != asio::error::operation_aborted)
+                        _next();
+                });
+                return;
+            }
+            auto & w = _waiters.front();
+            if (w.handle)
+                w.handle->_stop_waiting();
+            start = std::move(w.start);
+            _waiters.pop_front();
+        }
+        asio::post(_io_context, [start = std::move(start)] { start(true); });
+    }
+
+    /// Drop a request cancelled while queued
+    void _cancel_waiter(const rest::request_handle * handle)
+    {
+        std::function<void(bool)> start;
+        {
+            std::lock_guard<std::mutex> lock(m);
+            auto it = std::find_if(_waiters.begin(), _waiters.end(), [handle](const waiter & w)
+            {
+                return w.handle.get() == handle;
+            });
+            if (it == _waiters.end())
+                return;
+            start = std::move(it->start);
+            _waiters.erase(it);
+        }
+        asio::post(_io_context, [start = std::move(start)] { start(false); });
+    }
+
     asio::io_context & _io_context;
     std::atomic<int64_t> & _global_limit;
     std::atomic<int64_t> _time_delay;
+    asio::steady_timer _timer; /**< Guarded by m */
+    std::deque<waiter> _waiters; /**< Requests in the order queued. Guarded by m */
+    bool _busy = false; /**< A request is let through or the timer is waiting. Guarded by m */
 };
 
 }
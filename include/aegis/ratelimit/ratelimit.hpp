@@ -13,6 +13,7 @@
 #include "aegis/rest/rest_controller.hpp"
 #include "aegis/snowflake.hpp"
 #include "aegis/ratelimit/bucket.hpp"
+#include "aegis/ratelimit/retry_policy.hpp"
 #include "aegis/futures.hpp"
 #include "aegis/core.hpp"
 
@@ -24,6 +25,9 @@
 #include <atomic>
 #include <mutex>
 #include <type_traits>
+#include <asio/post.hpp>
+#include <asio/steady_timer.hpp>
+
 namespace aegis
 {
 
@@ -51,7 +55,7 @@ public:
         , _io_context(_io)
         , _bot(_b)
     {
-
+        _budget.configure(_retry_policy);
     }
 
     ratelimit_mgr(const ratelimit_mgr &) = delete;
@@ -84,56 +88,271 @@ public:
         return *_buckets.emplace(path, std::make_unique<bucket>(_call, _io_context, global_limit)).first->second;
     }
 
+    /// Queue a REST request and parse its reply into ResultType
+    /**
+     * The returned future can be cancelled through aegis::future::cancel()
+     * @param params Request to perform
+     * @returns aegis::future<ResultType>
+     */
     template<typename ResultType, typename V = std::enable_if_t<!std::is_same<ResultType, rest::rest_reply>::value>>
     aegis::future<ResultType> post_task(rest::request_params params) noexcept
     {
-        return _bot->async([=]() -> ResultType
-        {
-            auto & bkt = get_bucket(params.path);
-            auto res = bkt.perform(params);
-            if (res.reply_code < rest::ok || res.reply_code >= rest::multiple_choices)//error
-                throw aegis::exception(fmt::format("REST Reply Code: {}", static_cast<int>(res.reply_code)), bad_request);
-            return res.content.empty() ? ResultType(_bot) : ResultType(res.content, _bot);
-        });
+        std::string _bucket = params.path;
+        return post_task<ResultType>(std::move(_bucket), std::move(params));
     }
 
+    /// Queue a REST request
+    /**
+     * The returned future can be cancelled through aegis::future::cancel()
+     * @param params Request to perform
+     * @returns aegis::future<rest::rest_reply>
+     */
     aegis::future<rest::rest_reply> post_task(rest::request_params params) noexcept
     {
-        return _bot->async([=]() -> rest::rest_reply
-        {
-            auto & bkt = get_bucket(params.path);
-            return bkt.perform(params);
-        });
+        std::string _bucket = params.path;
+        return post_task(std::move(_bucket), std::move(params));
     }
 
+    /// Queue a REST request on a specific bucket and parse its reply into ResultType
+    /**
+     * The returned future can be cancelled through aegis::future::cancel()
+     * @param _bucket Name of the bucket to ratelimit the request under
+     * @param params Request to perform
+     * @returns aegis::future<ResultType>
+     */
     template<typename ResultType, typename V = std::enable_if_t<!std::is_same<ResultType, rest::rest_reply>::value>>
     aegis::future<ResultType> post_task(std::string _bucket, rest::request_params params) noexcept
     {
-        return _bot->async([=]() -> ResultType
-        {
-            auto & bkt = get_bucket(_bucket);
-            auto res = bkt.perform(params);
-            if (res.reply_code < rest::ok || res.reply_code >= rest::multiple_choices)//error
-                throw aegis::exception(fmt::format("REST Reply Code: {}", static_cast<int>(res.reply_code)), bad_request);
-            return res.content.empty() ? ResultType(_bot) : ResultType(res.content, _bot);
-        });
+        return _post<ResultType>(std::move(_bucket), std::move(params));
     }
 
+    /// Queue a REST request on a specific bucket
+    /**
+     * The returned future can be cancelled through aegis::future::cancel()
+     * @param _bucket Name of the bucket to ratelimit the request under
+     * @param params Request to perform
+     * @returns aegis::future<rest::rest_reply>
+     */
     aegis::future<rest::rest_reply> post_task(std::string _bucket, rest::request_params params) noexcept
     {
-        return _bot->async([=]() -> rest::rest_reply
-        {
-            auto & bkt = get_bucket(_bucket);
-            return bkt.perform(params);
-        });
+        return _post<rest::rest_reply>(std::move(_bucket), std::move(params));
+    }
+
+    /// Queue a REST request and resolve its future on an executor
+    /**
+     * Continuations chained onto the returned future without an executor run on the executor,
+     * or on the calling thread if it is already resolved when they are chained
+     * @param ex Executor to deliver the result on. An asio executor or aegis executor.
+     * @param params Request to perform
+     * @returns aegis::future<ResultType>
+     */
+    template<typename ResultType = rest::rest_reply, typename Executor, typename V = std::enable_if_t<!std::is_convertible<Executor, std::string>::value>>
+    aegis::future<ResultType> post_task(const Executor & ex, rest::request_params params) noexcept
+    {
+        std::string _bucket = params.path;
+        return _post<ResultType>(std::move(_bucket), std::move(params)).via(ex);
+    }
+
+    /// Queue a REST request on a specific bucket and resolve its future on an executor
+    /**
+     * Continuations chained onto the returned future without an executor run on the executor,
+     * or on the calling thread if it is already resolved when they are chained
+     * @param ex Executor to deliver the result on. An asio executor or aegis executor.
+     * @param _bucket Name of the bucket to ratelimit the request under
+     * @param params Request to perform
+     * @returns aegis::future<ResultType>
+     */
+    template<typename ResultType = rest::rest_reply, typename Executor>
+    aegis::future<ResultType> post_task(const Executor & ex, std::string _bucket, rest::request_params params) noexcept
+    {
+        return _post<ResultType>(std::move(_bucket), std::move(params)).via(ex);
+    }
+
+    /// Set the policy used to retry failed requests
+    /**
+     * Should be set before any requests are made. Resets the retry budget.
+     * @param policy Retry policy
+     */
+    void set_retry_policy(const retry_policy & policy) noexcept
+    {
+        _retry_policy = policy;
+        _budget.configure(policy);
+    }
+
+    /// Get the policy used to retry failed requests
+    /**
+     * @returns retry_policy
+     */
+    const retry_policy & get_retry_policy() const noexcept
+    {
+        return _retry_policy;
+    }
+
+    /// Get the retry budget shared by all requests
+    /**
+     * @returns retry_budget
+     */
+    const retry_budget & get_retry_budget() const noexcept
+    {
+        return _budget;
     }
 
 private:
     friend class bucket;
 
+    /// State of a request that lives across its attempts
+    template<typename ResultType>
+    struct pending_request
+    {
+        pending_request(asio::io_context * io, std::string && bkt, rest::request_params && p)
+            : pr(io)
+            , _bucket(std::move(bkt))
+            , params(std::move(p))
+        {
+        }
+
+        aegis::promise<ResultType> pr;
+        std::string _bucket;
+        rest::request_params params;
+        uint32_t attempts = 0;
+    };
+
+    template<typename ResultType>
+    aegis::future<ResultType> _post(std::string && _bucket, rest::request_params && params) noexcept
+    {
+        if (!params.handle)
+            params.handle = std::make_shared<rest::request_handle>();
+        auto handle = params.handle;
+        auto req = std::make_shared<pending_request<ResultType>>(&_io_context, std::move(_bucket), std::move(params));
+        auto fut = req->pr.get_future();
+        fut.set_cancellation(std::move(handle));
+        _attempt(std::move(req));
+        return fut;
+    }
+
+    template<typename ResultType>
+    void _attempt(std::shared_ptr<pending_request<ResultType>> req)
+    {
+        asio::post(_io_context, [this, req = std::move(req)]() mutable
+        {
+            auto & bkt = get_bucket(req->_bucket);
+            auto handle = req->params.handle;
+            bkt.acquire(handle, [this, &bkt, req = std::move(req)](bool granted) mutable
+            {
+                if (!granted)
+                {
+                    req->params.handle->_complete();
+                    req->pr.set_exception(std::make_exception_ptr(aegis::exception(make_error_code(error::request_cancelled))));
+                    return;
+                }
+                _perform(bkt, std::move(req));
+            });
+        });
+    }
+
+    template<typename ResultType>
+    void _perform(bucket & bkt, std::shared_ptr<pending_request<ResultType>> req)
+    {
+        rest::rest_reply res;
+        try
+        {
+            res = bkt.perform(req->params);
+        }
+        catch (...)
+        {
+            bkt.release();
+            req->params.handle->_complete();
+            req->pr.set_exception(std::current_exception());
+            return;
+        }
+        bkt.release();
+        ++req->attempts;
+
+        try
+        {
+            milliseconds delay;
+            if (_should_retry(bkt, req->params, res, req->attempts, delay))
+            {
+                auto timer = std::make_shared<asio::steady_timer>(_io_context, delay);
+                timer->async_wait([this, req, timer](const asio::error_code & ec) mutable
+                {
+                    if (ec)
+                    {
+                        req->params.handle->_complete();
+                        req->pr.set_exception(std::make_exception_ptr(aegis::exception(make_error_code(error::request_cancelled))));
+                        return;
+                    }
+                    _attempt(std::move(req));
+                });
+                return;
+            }
+
+            if (res.success())
+                _budget.deposit();
+            req->params.handle->_complete();
+            _fulfill(req->pr, std::move(res));
+        }
+        catch (...)
+        {
+            req->params.handle->_complete();
+            req->pr.set_exception(std::current_exception());
+        }
+    }
+
+    bool _should_retry(const bucket & bkt, const rest::request_params & params, const rest::rest_reply & res, uint32_t attempts, milliseconds & delay) noexcept
+    {
+        auto log = spdlog::get("aegis");
+        if (attempts >= _retry_policy.max_attempts)
+        {
+            if (res.reply_code == rest::too_many_requests)
+                log->error("Ratelimit hit {} times. Giving up.", attempts);
+            return false;
+        }
+        if (res.reply_code == rest::too_many_requests)
+        {
+            delay = bkt.retry_after(res);
+            log->warn("Ratelimit hit - retrying in {}ms...", delay.count());
+            return true;
+        }
+        if (!retry_policy::is_idempotent(params.method) || !_retry_policy.is_transient(res))
+            return false;
+        if (!_budget.withdraw())
+        {
+            log->warn("Retry budget exhausted - not retrying {}({})", rest::rest_controller::get_method(params.method), params.path);
+            return false;
+        }
+        delay = _retry_policy.backoff(attempts);
+        log->debug("Transient REST failure: {}({}) - attempt {} retrying in {}ms", rest::rest_controller::get_method(params.method), params.path, attempts, delay.count());
+        return true;
+    }
+
+    void _fulfill(aegis::promise<rest::rest_reply> & pr, rest::rest_reply && res) noexcept
+    {
+        pr.set_value(std::move(res));
+    }
+
+    template<typename ResultType>
+    void _fulfill(aegis::promise<ResultType> & pr, rest::rest_reply && res) noexcept
+    {
+        try
+        {
+            if (res.transport_error)
+                throw aegis::exception(res.transport_error);
+            if (res.reply_code < rest::ok || res.reply_code >= rest::multiple_choices)//error
+                throw aegis::exception(fmt::format("REST Reply Code: {}", static_cast<int>(res.reply_code)), bad_request);
+            pr.set_value(res.content.empty() ? ResultType(_bot) : ResultType(res.content, _bot));
+        }
+        catch (...)
+        {
+            pr.set_exception(std::current_exception());
+        }
+    }
+
     std::atomic<int64_t> global_limit; /**< Timestamp in seconds when global ratelimit expires */
 
     std::unordered_map<std::string, std::unique_ptr<bucket>> _buckets;
+    retry_policy _retry_policy;
+    retry_budget _budget;
     rest_call _call;
     asio::io_context & _io_context;
     core * _bot;
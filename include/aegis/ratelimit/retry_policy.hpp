@@ -0,0 +1,173 @@
+//
+// retry_policy.hpp
+// ****************
+//
+// Copyright (c) 2019 Sharon W (sharon at aegis dot gg)
+//
+// Distributed under the MIT License. (See accompanying file LICENSE)
+//
+
+#pragma once
+
+#include "aegis/config.hpp"
+#include "aegis/rest/rest_controller.hpp"
+#include "aegis/rest/rest_reply.hpp"
+#include <asio/error.hpp>
+#include <asio/ssl/error.hpp>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+
+namespace aegis
+{
+
+namespace ratelimit
+{
+
+using namespace std::chrono;
+
+/// Controls how REST requests that fail transiently are retried
+/**
+ * Only idempotent requests (GET, PUT, DELETE) are retried on upstream and transport
+ * errors. Ratelimited (429) requests are retried regardless of method as Discord did
+ * not process them.
+ */
+struct retry_policy
+{
+    uint32_t max_attempts = 3; /**< Total attempts including the first. 1 disables retries */
+    milliseconds base_delay = 200ms; /**< Backoff before the first retry */
+    milliseconds max_delay = 5s; /**< Upper bound of any single backoff */
+    double budget_ratio = 0.1; /**< Retries earned per successful request */
+    uint32_t budget_burst = 10; /**< Retries available before any request succeeds */
+    bool retry_bad_gateway = true; /**< Retry 502 replies */
+    bool retry_service_unavailable = true; /**< Retry 503 replies */
+    bool retry_gateway_timeout = true; /**< Retry 504 replies */
+    bool retry_transport = true; /**< Retry connection resets and TLS failures */
+
+    /// Check if a request may be retried on upstream or transport errors
+    /**
+     * @param method HTTP method of the request
+     * @returns true if the method is idempotent
+     */
+    static bool is_idempotent(rest::RequestMethod method) noexcept
+    {
+        return method == rest::Get || method == rest::Put || method == rest::Delete;
+    }
+
+    /// Check if a reply is a transient failure under this policy
+    /**
+     * @param reply Reply of the last attempt
+     * @returns true if retrying may succeed
+     */
+    bool is_transient(const rest::rest_reply & reply) const noexcept
+    {
+        if (reply.transport_error)
+        {
+            if (!retry_transport)
+                return false;
+            auto & ec = reply.transport_error;
+            return ec == asio::error::connection_reset
+                || ec == asio::error::connection_aborted
+                || ec == asio::error::connection_refused
+                || ec == asio::error::broken_pipe
+                || ec == asio::error::eof
+                || ec == asio::error::timed_out
+                || ec.category() == asio::error::get_ssl_category()
+                || ec == asio::ssl::error::stream_truncated;
+        }
+        switch (reply.reply_code)
+        {
+            case rest::bad_gateway:
+                return retry_bad_gateway;
+            case rest::service_unavailable:
+                return retry_service_unavailable;
+            case rest::gateway_timeout:
+                return retry_gateway_timeout;
+            default:
+                return false;
+        }
+    }
+
+    /// Get the backoff before a retry
+    /**
+     * Exponential backoff with equal jitter. Half of the delay is fixed and half is random
+     * so that clients failing together do not retry together.
+     * @param attempt Number of attempts made so far (1 after the first failure)
+     * @returns Delay before the next attempt
+     */
+    milliseconds backoff(uint32_t attempt) const noexcept
+    {
+        static thread_local std::minstd_rand rng{ std::random_device{}() };
+        int64_t delay = base_delay.count() << std::min<uint32_t>(attempt - 1, 20);
+        delay = std::min<int64_t>(delay, max_delay.count());
+        if (delay <= 1)
+            return milliseconds(delay);
+        std::uniform_int_distribution<int64_t> jitter(0, delay / 2);
+        return milliseconds(delay / 2 + jitter(rng));
+    }
+};
+
+/// Token bucket limiting the share of traffic spent on retries
+/**
+ * Every retry withdraws one token and every successful request deposits
+ * retry_policy::budget_ratio tokens, so during an outage retries stop once the burst is
+ * spent instead of multiplying the load on the upstream.
+ */
+class retry_budget
+{
+public:
+    retry_budget() = default;
+
+    retry_budget(const retry_budget &) = delete;
+    retry_budget & operator=(const retry_budget &) = delete;
+
+    /// Reset the budget to the burst size of a policy
+    /**
+     * @param policy Policy to size the budget from
+     */
+    void configure(const retry_policy & policy) noexcept
+    {
+        _max = static_cast<int64_t>(policy.budget_burst) * 1000;
+        _deposit = static_cast<int64_t>(policy.budget_ratio * 1000);
+        _tokens.store(_max, std::memory_order_relaxed);
+    }
+
+    /// Record a successful request
+    void deposit() noexcept
+    {
+        int64_t cur = _tokens.load(std::memory_order_relaxed);
+        while (cur < _max && !_tokens.compare_exchange_weak(cur, std::min(_max, cur + _deposit), std::memory_order_relaxed));
+    }
+
+    /// Take a token for a retry
+    /**
+     * @returns false if the budget is exhausted
+     */
+    bool withdraw() noexcept
+    {
+        int64_t cur = _tokens.load(std::memory_order_relaxed);
+        while (cur >= 1000)
+            if (_tokens.compare_exchange_weak(cur, cur - 1000, std::memory_order_relaxed))
+                return true;
+        return false;
+    }
+
+    /// Get the number of retries currently available
+    /**
+     * @returns Whole retries left in the budget
+     */
+    int64_t available() const noexcept
+    {
+        return _tokens.load(std::memory_order_relaxed) / 1000;
+    }
+
+private:
+    std::atomic<int64_t> _tokens{ 10000 };
+    int64_t _max = 10000;
+    int64_t _deposit = 100;
+};
+
+}
+
+}
@@ -0,0 +1,178 @@
+//
+// reclaim.hpp
+// ***********
+//
+// Copyright (c) 2019 Sharon W (sharon at aegis dot gg)
+//
+// Distributed under the MIT License. (See accompanying file LICENSE)
+//
+
+#pragma once
+
+#include "aegis/config.hpp"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace aegis
+{
+
+/// Epoch based reclamation of objects removed from the caches
+/**
+ * Readers pin the current epoch for as long as they may hold raw pointers into the caches.
+ * Removed objects are retired into the list of the epoch they were removed in. The epoch only
+ * advances once no reader is pinned to the previous one, so by the time it has moved on three
+ * times nobody can still see an object retired in it and the list is freed.
+ *
+ * Pinning is two atomic operations on a counter shared by all readers of an epoch, and retiring
+ * is a push under a mutex, so the cost stays off the per-event path. Objects are destroyed on
+ * whichever thread advances the epoch.
+ */
+class epoch_reclaimer
+{
+public:
+    /// Pins an epoch for its lifetime. Movable, so it can travel with queued work
+    class guard
+    {
+    public:
+        guard() noexcept = default;
+
+        guard(guard && other) noexcept
+            : _owner(other._owner)
+            , _epoch(other._epoch)
+        {
+            other._owner = nullptr;
+        }
+
+        guard & operator=(guard && other) noexcept
+        {
+            if (this != &other)
+            {
+                release();
+                _owner = other._owner;
+                _epoch = other._epoch;
+                other._owner = nullptr;
+            }
+            return *this;
+        }
+
+        guard(const guard &) = delete;
+        guard & operator=(const guard &) = delete;
+
+        ~guard()
+        {
+            release();
+        }
+
+        /// Unpin early
+        void release() noexcept
+        {
+            if (_owner)
+            {
+                _owner->_unpin(_epoch);
+                _owner = nullptr;
+            }
+        }
+
+    private:
+        friend class epoch_reclaimer;
+
+        guard(epoch_reclaimer * owner, uint64_t epoch) noexcept
+            : _owner(owner)
+            , _epoch(epoch)
+        {
+        }
+
+        epoch_reclaimer * _owner = nullptr;
+        uint64_t _epoch = 0;
+    };
+
+    epoch_reclaimer() = default;
+
+    /// Frees everything still retired. No reader may be pinned
+    AEGIS_DECL ~epoch_reclaimer();
+
+    epoch_reclaimer(const epoch_reclaimer &) = delete;
+    epoch_reclaimer & operator=(const epoch_reclaimer &) = delete;
+
+    /// Pin the current epoch
+    /**
+     * Objects retired after this call are not freed until the guard is released
+     * @returns Guard holding the pin
+     */
+    AEGIS_DECL guard pin() noexcept;
+
+    /// Hand over an object that was unlinked from every shared structure
+    /**
+     * @param obj Object to destroy once no pinned reader can still hold it
+     */
+    template<typename T>
+    void retire(std::unique_ptr<T> obj)
+    {
+        if (!obj)
+            return;
+        _retire(retired{ obj.release(), [](void * p) { delete static_cast<T *>(p); } });
+    }
+
+    /// Try to advance the epoch and free what became unreachable
+    /**
+     * Returns immediately if another thread is collecting or a reader is still pinned to the
+     * previous epoch
+     * @returns Amount of objects freed
+     */
+    AEGIS_DECL std::size_t collect();
+
+    /// Get the current epoch
+    uint64_t epoch() const noexcept
+    {
+        return _epoch.load(std::memory_order_relaxed);
+    }
+
+    /// Get the amount of objects waiting to be freed
+    std::size_t pending() const noexcept
+    {
+        return _pending.load(std::memory_order_relaxed);
+    }
+
+    /// Get the amount of objects freed so far
+    uint64_t freed() const noexcept
+    {
+        return _freed.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct retired
+    {
+        void * ptr;
+        void (*destroy)(void *);
+    };
+
+    struct alignas(64) counter
+    {
+        std::atomic<int64_t> readers{ 0 };
+    };
+
+    AEGIS_DECL void _retire(retired r);
+
+    void _unpin(uint64_t epoch) noexcept
+    {
+        _active[epoch % 3].readers.fetch_sub(1, std::memory_order_release);
+    }
+
+    AEGIS_DECL static std::size_t _free(std::vector<retired> & list) noexcept;
+
+    std::atomic<uint64_t> _epoch{ 0 };
+    counter _active[3];
+    std::mutex _m; /**< Guards the limbo lists and epoch advancement */
+    std::vector<retired> _limbo[3];
+    std::atomic<std::size_t> _pending{ 0 };
+    std::atomic<uint64_t> _freed{ 0 };
+};
+
+}
+
+#if defined(AEGIS_HEADER_ONLY)
+#include "aegis/impl/reclaim.cpp"
+#endif
@@ -20,6 +20,9 @@
 #include <asio/ssl.hpp>
 #include <asio/read.hpp>
 #include <asio/read_until.hpp>
+#include <asio/write.hpp>
+#include <asio/post.hpp>
+#include <spdlog/spdlog.h>
 #include <websocketpp/http/request.hpp>
 #include <websocketpp/http/parser.hpp>
 #include <websocketpp/http/response.hpp>
@@ -57,6 +60,69 @@ AEGIS_DECL rest_controller::rest_controller(const std::string & token, const std
 
 }
 
+AEGIS_DECL void rest_controller::set_route_timeout(const std::string & route, std::chrono::milliseconds timeout)
+{
+    std::lock_guard<std::mutex> l(_timeout_m);
+    _route_timeouts[route] = timeout;
+}
+
+AEGIS_DECL std::chrono::milliseconds rest_controller::get_timeout(const request_params & params) const
+{
+    if (params.timeout > 0ms)
+        return params.timeout;
+    std::lock_guard<std::mutex> l(_timeout_m);
+    if (!_route_timeouts.empty())
+    {
+        auto it = _route_timeouts.find(get_route(params.path));
+        if (it != _route_timeouts.end())
+            return it->second;
+    }
+    return _default_timeout;
+}
+
+AEGIS_DECL std::string rest_controller::get_route(const std::string & path)
+{
+    std::string route;
+    route.reserve(path.size());
+    std::string::size_type pos = 0;
+    while (pos < path.size())
+    {
+        auto next = path.find('/', pos + 1);
+        if (next == std::string::npos)
+            next = path.size();
+        // segment including its leading slash
+        bool numeric = (next - pos > 1) && path[pos] == '/';
+        for (auto i = pos + 1; numeric && i < next; ++i)
+            numeric = (path[i] >= '0' && path[i] <= '9');
+        if (numeric)
+            route.append("/{}");
+        else
+            route.append(path, pos, next - pos);
+        pos = next;
+    }
+    return route;
+}
+
+template<typename Socket>
+void rest_controller::_run(asio::io_context & ioc, std::chrono::steady_clock::time_point deadline, request_handle & handle, Socket & socket)
+{
+    ioc.restart();
+    ioc.run_until(deadline);
+    if (!ioc.stopped())
+    {
+        // deadline passed with the operation still pending
+        handle._expire();
+        asio::error_code ec;
+        socket.close(ec);
+        ioc.restart();
+        ioc.run();
+    }
+    if (handle.status() == request_handle::state::timed_out)
+        throw aegis::exception(make_error_code(error::request_timeout));
+    if (handle.status() == request_handle::state::cancelled)
+        throw aegis::exception(make_error_code(error::request_cancelled));
+}
+
 AEGIS_DECL rest_reply rest_controller::execute(rest::request_params && params)
 {
     if (_host.empty() && params.host.empty())
@@ -72,6 +138,9 @@ AEGIS_DECL rest_reply rest_controller::execute(rest::request_params && params)
     bool global = false;
 
     auto start_time = std::chrono::steady_clock::now();
+    auto deadline = start_time + get_timeout(params);
+    auto handle = params.handle ? params.handle : std::make_shared<request_handle>();
+    std::error_code transport_error;
  
     try
     {
@@ -97,13 +166,39 @@ AEGIS_DECL rest_reply rest_controller::execute(rest::request_params && params)
             | asio::ssl::context::no_sslv2
             | asio::ssl::context::no_sslv3);
 
-        asio::ssl::stream<asio::ip::tcp::socket> socket(*_io_context, ctx);
+        // each request runs its own io_context so a stalled peer can be timed out
+        // without depending on the shared worker threads being free
+        asio::io_context ioc;
+        asio::ssl::stream<asio::ip::tcp::socket> socket(ioc, ctx);
         SSL_set_tlsext_host_name(socket.native_handle(), tar_host.data());
 
-        asio::connect(socket.lowest_layer(), r);
+        auto & lowest = socket.lowest_layer();
+        if (!handle->_begin([&ioc, &lowest]
+        {
+            asio::post(ioc, [&lowest]
+            {
+                asio::error_code ec;
+                lowest.close(ec);
+            });
+        }))
+            throw aegis::exception(make_error_code(error::request_cancelled));
+        struct finish_guard
+        {
+            request_handle & h;
+            ~finish_guard() { h._finish(); }
+        } finish{ *handle };
+
+        asio::error_code ec;
+        asio::async_connect(lowest, r, [&ec](const asio::error_code & e, const asio::ip::tcp::endpoint &) { ec = e; });
+        _run(ioc, deadline, *handle, lowest);
+        if (ec)
+            throw asio::system_error(ec);
 
         asio::error_code handshake_ec;
-        socket.handshake(asio::ssl::stream_base::client, handshake_ec);
+        socket.async_handshake(asio::ssl::stream_base::client, [&handshake_ec](const asio::error_code & e) { handshake_ec = e; });
+        _run(ioc, deadline, *handle, lowest);
+        if (handshake_ec)
+            throw asio::system_error(handshake_ec);
 
         asio::streambuf request;
         std::ostream request_stream(&request);
@@ -140,15 +235,25 @@ AEGIS_DECL rest_reply rest_controller::execute(rest::request_params && params)
             request_stream << params.body;
         }
 
-        asio::write(socket, request);
+        asio::async_write(socket, request, [&ec](const asio::error_code & e, std::size_t) { ec = e; });
+        _run(ioc, deadline, *handle, lowest);
+        if (ec)
+            throw asio::system_error(ec);
+
         asio::streambuf response;
-        asio::read_until(socket, response, "\r\n");
         std::stringstream response_content;
-        response_content << &response;
 
         asio::error_code error;
-        while (asio::read(socket, response, asio::transfer_at_least(1), error))
+        do
+        {
+            asio::async_read(socket, response, asio::transfer_at_least(1), [&error](const asio::error_code & e, std::size_t) { error = e; });
+            _run(ioc, deadline, *handle, lowest);
             response_content << &response;
+        } while (!error);
+
+        // peer closed the connection without replying
+        if (response_content.tellp() <= 0)
+            throw asio::system_error(error ? error : make_error_code(asio::error::eof));
 
         std::istringstream istrm(response_content.str());
         hresponse.consume(istrm);
@@ -178,14 +283,30 @@ AEGIS_DECL rest_reply rest_controller::execute(rest::request_params && params)
         if (error != asio::error::eof && error != asio::ssl::error::stream_truncated)
             throw asio::system_error(error);
     }
-    catch (std::exception& e)
+    catch (aegis::exception &)
+    {
+        throw;
+    }
+    catch (asio::system_error & e)
+    {
+        transport_error = e.code();
+        auto log = spdlog::get("aegis");
+        if (log)
+            log->warn("REST {} {} failed: {}", get_method(params.method), params.path, e.what());
+    }
+    catch (std::exception & e)
     {
-        std::cout << "Exception: " << e.what() << "\n";
+        transport_error = make_error_code(error::general);
+        auto log = spdlog::get("aegis");
+        if (log)
+            log->error("REST {} {} failed: {}", get_method(params.method), params.path, e.what());
     }
 
-    return { static_cast<http_code>(hresponse.get_status_code()),
+    rest_reply reply{ static_cast<http_code>(hresponse.get_status_code()),
         global, limit, remaining, reset, retry, hresponse.get_body(), http_date,
         std::chrono::steady_clock::now() - start_time };
+    reply.transport_error = transport_error;
+    return reply;
 }
 
 AEGIS_DECL rest_reply rest_controller::execute2(rest::request_params && params)
@@ -203,6 +324,9 @@ AEGIS_DECL rest_reply rest_controller::execute2(rest::request_params && params)
     bool global = false;
 
     auto start_time = std::chrono::steady_clock::now();
+    auto deadline = start_time + get_timeout(params);
+    auto handle = params.handle ? params.handle : std::make_shared<request_handle>();
+    std::error_code transport_error;
     
     try
     {
@@ -221,6 +345,19 @@ AEGIS_DECL rest_reply rest_controller::execute2(rest::request_params && params)
         else
             r = it->second;
 
+        asio::streambuf request;
+        std::ostream request_stream(&request);
+        request_stream << get_method(params.method) << " " << (!params.path.empty() ? params.path : "/") << " HTTP/1.0\r\n";
+        request_stream << "Host: " << tar_host << "\r\n";
+        request_stream << "Accept: */*\r\n";
+        for (auto & h : params.headers)
+            request_stream << h << "\r\n";
+        request_stream << "Content-Length: " << params.body.size() << "\r\n";
+        request_stream << "Content-Type: application/json\r\n";
+        request_stream << "Connection: close\r\n\r\n";
+        request_stream << params.body;
+
+        asio::io_context ioc;
 
         if (params.port == "443")
         {
@@ -231,35 +368,55 @@ AEGIS_DECL rest_reply rest_controller::execute2(rest::request_params && params)
                 | asio::ssl::context::no_sslv2
                 | asio::ssl::context::no_sslv3);
 
-            asio::ssl::stream<asio::ip::tcp::socket> socket(*_io_context, ctx);
+            asio::ssl::stream<asio::ip::tcp::socket> socket(ioc, ctx);
             SSL_set_tlsext_host_name(socket.native_handle(), tar_host.data());
 
-            asio::connect(socket.lowest_layer(), r);
+            auto & lowest = socket.lowest_layer();
+            if (!handle->_begin([&ioc, &lowest]
+            {
+                asio::post(ioc, [&lowest]
+                {
+                    asio::error_code ec;
+                    lowest.close(ec);
+                });
+            }))
+                throw aegis::exception(make_error_code(error::request_cancelled));
+            struct finish_guard
+            {
+                request_handle & h;
+                ~finish_guard() { h._finish(); }
+            } finish{ *handle };
+
+            asio::error_code ec;
+            asio::async_connect(lowest, r, [&ec](const asio::error_code & e, const asio::ip::tcp::endpoint &) { ec = e; });
+            _run(ioc, deadline, *handle, lowest);
+            if (ec)
+                throw asio::system_error(ec);
 
             asio::error_code handshake_ec;
-            socket.handshake(asio::ssl::stream_base::client, handshake_ec);
-
-            asio::streambuf request;
-            std::ostream request_stream(&request);
-            request_stream << get_method(params.method) << " " << (!params.path.empty() ? params.path : "/") << " HTTP/1.0\r\n";
-            request_stream << "Host: " << tar_host << "\r\n";
-            request_stream << "Accept: */*\r\n";
-            for (auto & h : params.headers)
-                request_stream << h << "\r\n";
-            request_stream << "Content-Length: " << params.body.size() << "\r\n";
-            request_stream << "Content-Type: application/json\r\n";
-            request_stream << "Connection: close\r\n\r\n";
-            request_stream << params.body;
+            socket.async_handshake(asio::ssl::stream_base::client, [&handshake_ec](const asio::error_code & e) { handshake_ec = e; });
+            _run(ioc, deadline, *handle, lowest);
+            if (handshake_ec)
+                throw asio::system_error(handshake_ec);
+
+            asio::async_write(socket, request, [&ec](const asio::error_code & e, std::size_t) { ec = e; });
+            _run(ioc, deadline, *handle, lowest);
+            if (ec)
+                throw asio::system_error(ec);
 
-            asio::write(socket, request);
             asio::streambuf response;
-            asio::read_until(socket, response, "\r\n");
             std::stringstream response_content;
-            response_content << &response;
 
             asio::error_code error;
-            while (asio::read(socket, response, asio::transfer_at_least(1), error))
+            do
+            {
+                asio::async_read(socket, response, asio::transfer_at_least(1), [&error](const asio::error_code & e, std::size_t) { error = e; });
+                _run(ioc, deadline, *handle, lowest);
                 response_content << &response;
+            } while (!error);
+
+            if (response_content.tellp() <= 0)
+                throw asio::system_error(error ? error : make_error_code(asio::error::eof));
 
             std::istringstream istrm(response_content.str());
             hresponse.consume(istrm);
@@ -273,24 +430,39 @@ AEGIS_DECL rest_reply rest_controller::execute2(rest::request_params && params)
         }
         else
         {
-            asio::ip::tcp::socket socket(*_io_context);
-            asio::connect(socket, r);
-
-            asio::streambuf request;
-            std::ostream request_stream(&request);
-            request_stream << get_method(params.method) << " " << (!params.path.empty() ? params.path : "/") << " HTTP/1.0\r\n";
-            request_stream << "Host: " << tar_host << "\r\n";
-            request_stream << "Accept: */*\r\n";
-            for (auto & h : params.headers)
-                request_stream << h << "\r\n";
-            request_stream << "Content-Length: " << params.body.size() << "\r\n";
-            request_stream << "Content-Type: application/json\r\n";
-            request_stream << "Connection: close\r\n\r\n";
-            request_stream << params.body;
+            asio::ip::tcp::socket socket(ioc);
+
+            if (!handle->_begin([&ioc, &socket]
+            {
+                asio::post(ioc, [&socket]
+                {
+                    asio::error_code ec;
+                    socket.close(ec);
+                });
+            }))
+                throw aegis::exception(make_error_code(error::request_cancelled));
+            struct finish_guard
+            {
+                request_handle & h;
+                ~finish_guard() { h._finish(); }
+            } finish{ *handle };
+
+            asio::error_code ec;
+            asio::async_connect(socket, r, [&ec](const asio::error_code & e, const asio::ip::tcp::endpoint &) { ec = e; });
+            _run(ioc, deadline, *handle, socket);
+            if (ec)
+                throw asio::system_error(ec);
+
+            asio::async_write(socket, request, [&ec](const asio::error_code & e, std::size_t) { ec = e; });
+            _run(ioc, deadline, *handle, socket);
+            if (ec)
+                throw asio::system_error(ec);
 
-            asio::write(socket, request);
             asio::streambuf response;
-            asio::read_until(socket, response, "\r\n");
+            asio::async_read_until(socket, response, "\r\n", [&ec](const asio::error_code & e, std::size_t) { ec = e; });
+            _run(ioc, deadline, *handle, socket);
+            if (ec)
+                throw asio::system_error(ec);
             std::stringstream response_content;
             response_content << &response;
 
@@ -302,14 +474,30 @@ AEGIS_DECL rest_reply rest_controller::execute2(rest::request_params && params)
             //TODO: return reply headers
         }
     }
-    catch (std::exception& e)
+    catch (aegis::exception &)
+    {
+        throw;
+    }
+    catch (asio::system_error & e)
+    {
+        transport_error = e.code();
+        auto log = spdlog::get("aegis");
+        if (log)
+            log->warn("REST {} {} failed: {}", get_method(params.method), params.path, e.what());
+    }
+    catch (std::exception & e)
     {
-        std::cout << "Exception: " << e.what() << "\n";
+        transport_error = make_error_code(error::general);
+        auto log = spdlog::get("aegis");
+        if (log)
+            log->error("REST {} {} failed: {}", get_method(params.method), params.path, e.what());
     }
 
-    return { static_cast<http_code>(hresponse.get_status_code()),
+    rest_reply reply{ static_cast<http_code>(hresponse.get_status_code()),
         global, limit, remaining, reset, retry, hresponse.get_body(), http_date,
         std::chrono::steady_clock::now() - start_time };
+    reply.transport_error = transport_error;
+    return reply;
 }
 
 }
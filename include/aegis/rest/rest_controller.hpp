@@ -12,11 +12,15 @@
 #include "aegis/config.hpp"
 #include "aegis/fwd.hpp"
 #include "aegis/rest/rest_reply.hpp"
+#include "aegis/futures.hpp"
 #include <asio/ip/basic_resolver.hpp>
 #include <asio/ip/tcp.hpp>
 #include <string>
 #include <map>
 #include <functional>
+#include <atomic>
+#include <mutex>
+#include <chrono>
 
 namespace aegis
 {
@@ -40,6 +44,148 @@ struct aegis_file
     std::vector<char> data;
 };
 
+/// Tracks the lifetime of a single REST request so it can be cancelled
+/**
+ * A request that has not been sent yet is dropped when it reaches the front of its
+ * bucket. A request that is in flight has its socket closed.
+ */
+class request_handle : public aegis::cancellation
+{
+public:
+    enum class state : uint8_t
+    {
+        queued,
+        sending,
+        complete,
+        cancelled,
+        timed_out
+    };
+
+    /// Cancel the request
+    /**
+     * @returns true if the request was cancelled before it completed
+     */
+    bool cancel() noexcept override
+    {
+        state s = state::queued;
+        if (_state.compare_exchange_strong(s, state::cancelled))
+        {
+            std::function<void()> wake;
+            {
+                std::lock_guard<std::mutex> l(_m);
+                wake = std::move(_wake);
+            }
+            if (wake)
+                wake();
+            return true;
+        }
+        if (s != state::sending)
+            return false;
+        std::lock_guard<std::mutex> l(_m);
+        if (!_state.compare_exchange_strong(s, state::cancelled))
+            return false;
+        if (_abort)
+            _abort();
+        return true;
+    }
+
+    /// Get the current state of the request
+    /**
+     * @returns state
+     */
+    state status() const noexcept
+    {
+        return _state.load(std::memory_order_acquire);
+    }
+
+    /// Check if the request was cancelled
+    /**
+     * @returns true if cancelled
+     */
+    bool cancelled() const noexcept
+    {
+        return status() == state::cancelled;
+    }
+
+private:
+    friend class rest_controller;
+    friend class ratelimit::ratelimit_mgr;
+    friend class ratelimit::bucket;
+
+    /// Throw if the request was cancelled before being sent
+    void _check() const
+    {
+        if (cancelled())
+            throw aegis::exception(make_error_code(error::request_cancelled));
+    }
+
+    /// Set the function that removes the request from the bucket it waits on
+    /**
+     * @returns false if the request was already cancelled
+     */
+    bool _wait(std::function<void()> wake)
+    {
+        std::lock_guard<std::mutex> l(_m);
+        if (cancelled())
+            return false;
+        _wake = std::move(wake);
+        return true;
+    }
+
+    /// Release the function set by _wait() once the bucket lets the request through
+    void _stop_waiting() noexcept
+    {
+        std::lock_guard<std::mutex> l(_m);
+        _wake = nullptr;
+    }
+
+    /// Mark the request as sent and set the function that aborts it
+    /**
+     * @returns false if the request was cancelled before it could be sent
+     */
+    bool _begin(std::function<void()> abort)
+    {
+        std::lock_guard<std::mutex> l(_m);
+        state s = state::queued;
+        if (!_state.compare_exchange_strong(s, state::sending))
+            return false;
+        _abort = std::move(abort);
+        return true;
+    }
+
+    /// Mark the request as timed out if it is still in flight
+    void _expire() noexcept
+    {
+        std::lock_guard<std::mutex> l(_m);
+        state s = state::sending;
+        _state.compare_exchange_strong(s, state::timed_out);
+    }
+
+    /// Release the abort function. Must be called before the socket it refers to is destroyed
+    /**
+     * The request returns to the queued state so it may be attempted again
+     */
+    void _finish() noexcept
+    {
+        std::lock_guard<std::mutex> l(_m);
+        _abort = nullptr;
+        state s = state::sending;
+        _state.compare_exchange_strong(s, state::queued);
+    }
+
+    /// Mark the request as complete once no further attempts will be made
+    void _complete() noexcept
+    {
+        state s = state::queued;
+        _state.compare_exchange_strong(s, state::complete);
+    }
+
+    std::atomic<state> _state{ state::queued };
+    std::mutex _m;
+    std::function<void()> _abort;
+    std::function<void()> _wake;
+};
+
 struct request_params
 {
     std::string path;
@@ -50,6 +196,8 @@ struct request_params
     std::vector<std::string> headers;
     std::string _path_ex;
     lib::optional<aegis_file> file;
+    std::chrono::milliseconds timeout = 0ms; /**< Deadline of the request. 0 uses the route default */
+    std::shared_ptr<request_handle> handle; /**< Cancellation handle. Created on demand if empty */
 };
 
 class rest_controller
@@ -105,6 +253,38 @@ public:
         _prefix = prefix;
     }
 
+    /// Set the deadline of requests on routes without their own default
+    /**
+     * @param timeout Deadline of the whole request, from connecting to reading the reply
+     */
+    void set_default_timeout(std::chrono::milliseconds timeout) noexcept
+    {
+        std::lock_guard<std::mutex> l(_timeout_m);
+        _default_timeout = timeout;
+    }
+
+    /// Set the default deadline of requests on a route
+    /**
+     * @see get_route
+     * @param route Path with all snowflakes replaced by {} eg: /channels/{}/messages
+     * @param timeout Deadline of the whole request, from connecting to reading the reply
+     */
+    AEGIS_DECL void set_route_timeout(const std::string & route, std::chrono::milliseconds timeout);
+
+    /// Get the deadline that applies to a request
+    /**
+     * @param params Request to check
+     * @returns The timeout set on the request, else the route default, else the global default
+     */
+    AEGIS_DECL std::chrono::milliseconds get_timeout(const request_params & params) const;
+
+    /// Get the route of a path by replacing each numeric segment with {}
+    /**
+     * @param path Path to convert eg: /channels/123/messages
+     * @returns Route eg: /channels/{}/messages
+     */
+    AEGIS_DECL static std::string get_route(const std::string & path);
+
     std::chrono::hours tz_bias()
     {
         return _tz_bias;
@@ -117,6 +297,14 @@ public:
 
 private:
     friend aegis::core;
+
+    /// Run the request-local io_context until the pending operation completes
+    /**
+     * Closes the socket and throws when the deadline passes or the request is cancelled
+     */
+    template<typename Socket>
+    void _run(asio::io_context & ioc, std::chrono::steady_clock::time_point deadline, request_handle & handle, Socket & socket);
+
     std::string _token;
     std::string _prefix;
     std::string _host;
@@ -126,6 +314,9 @@ private:
     rest_end_t rest_end;
     asio::io_context * _io_context = nullptr;
     std::chrono::hours _tz_bias = 0h;
+    std::chrono::milliseconds _default_timeout = 30s;
+    std::unordered_map<std::string, std::chrono::milliseconds> _route_timeouts;
+    mutable std::mutex _timeout_m;
 };
 
 }
@@ -173,6 +173,7 @@ public:
     //bool permissions = true; /**< Whether the call had proper permissions */
     std::chrono::system_clock::time_point date; /**< Current time from the remote server */
     std::chrono::steady_clock::duration execution_time; /**< Time it took to perform the request */
+    std::error_code transport_error; /**< Set when the request failed before a full reply was read */
     //TODO: std::map<std::string, std::string> headers; /**< Reply headers */
 };
 
@@ -0,0 +1,333 @@
+//
+// role_index.hpp
+// **************
+//
+// Copyright (c) 2019 Sharon W (sharon at aegis dot gg)
+//
+// Distributed under the MIT License. (See accompanying file LICENSE)
+//
+
+#pragma once
+
+#include "aegis/config.hpp"
+#include "aegis/snowflake.hpp"
+#include "aegis/flat_map.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace aegis
+{
+
+/// Members of each role of a guild
+/**
+ * Every member gets a small guild local index, reused after the member leaves. Each role keeps
+ * the set of indices of its members as a compressed bitmap, so listing the members of a role or
+ * removing a role costs time in the amount of members that have it rather than in the size of
+ * the guild. The guild keeps the index in step with the roles of its members and guards it with
+ * its mutex.
+ */
+class role_index
+{
+public:
+    static constexpr uint32_t npos = ~uint32_t(0);
+
+    /// Set of member indices, split into chunks of 65536
+    /**
+     * A chunk holds a sorted array of the low 16 bits of its indices while it is sparse and
+     * switches to a plain bitmap once it holds more than 4096 of them.
+     */
+    class slot_set
+    {
+    public:
+        /// Add an index
+        /**
+         * @returns true if it was not in the set
+         */
+        bool insert(uint32_t slot)
+        {
+            const auto key = static_cast<uint16_t>(slot >> 16);
+            const auto low = static_cast<uint16_t>(slot & 0xffff);
+            auto it = std::lower_bound(_chunks.begin(), _chunks.end(), key, chunk_less{});
+            if (it == _chunks.end() || it->key != key)
+            {
+                it = _chunks.insert(it, chunk{});
+                it->key = key;
+            }
+            if (!it->insert(low))
+                return false;
+            ++_size;
+            return true;
+        }
+
+        /// Remove an index
+        /**
+         * @returns true if it was in the set
+         */
+        bool erase(uint32_t slot)
+        {
+            const auto key = static_cast<uint16_t>(slot >> 16);
+            auto it = std::lower_bound(_chunks.begin(), _chunks.end(), key, chunk_less{});
+            if (it == _chunks.end() || it->key != key)
+                return false;
+            if (!it->erase(static_cast<uint16_t>(slot & 0xffff)))
+                return false;
+            if (it->count == 0)
+                _chunks.erase(it);
+            --_size;
+            return true;
+        }
+
+        bool contains(uint32_t slot) const noexcept
+        {
+            const auto key = static_cast<uint16_t>(slot >> 16);
+            auto it = std::lower_bound(_chunks.begin(), _chunks.end(), key, chunk_less{});
+            return it != _chunks.end() && it->key == key && it->contains(static_cast<uint16_t>(slot & 0xffff));
+        }
+
+        /// Call a function with every index in ascending order
+        template<typename Func>
+        void for_each(Func && f) const
+        {
+            for (auto & c : _chunks)
+            {
+                const uint32_t base = uint32_t(c.key) << 16;
+                if (c.bitmap.empty())
+                {
+                    for (auto low : c.array)
+                        f(base | low);
+                    continue;
+                }
+                for (uint32_t w = 0; w < c.bitmap.size(); ++w)
+                {
+                    uint64_t word = c.bitmap[w];
+                    while (word)
+                    {
+                        f(base | (w << 6) | _lowest_bit(word));
+                        word &= word - 1;
+                    }
+                }
+            }
+        }
+
+        std::size_t size() const noexcept
+        {
+            return _size;
+        }
+
+    private:
+        static constexpr std::size_t array_limit = 4096;
+        static constexpr std::size_t bitmap_words = 65536 / 64;
+
+        struct chunk
+        {
+            uint16_t key = 0;
+            uint32_t count = 0;
+            std::vector<uint16_t> array; /**< Sorted, used while bitmap is empty */
+            std::vector<uint64_t> bitmap;
+
+            bool contains(uint16_t low) const noexcept
+            {
+                if (!bitmap.empty())
+                    return (bitmap[low >> 6] >> (low & 63)) & 1;
+                return std::binary_search(array.begin(), array.end(), low);
+            }
+
+            bool insert(uint16_t low)
+            {
+                if (bitmap.empty())
+                {
+                    auto it = std::lower_bound(array.begin(), array.end(), low);
+                    if (it != array.end() && *it == low)
+                        return false;
+                    if (array.size() < array_limit)
+                    {
+                        array.insert(it, low);
+                        ++count;
+                        return true;
+                    }
+                    bitmap.assign(bitmap_words, 0);
+                    for (auto v : array)
+                        bitmap[v >> 6] |= uint64_t(1) << (v & 63);
+                    array.clear();
+                    array.shrink_to_fit();
+                }
+                auto & word = bitmap[low >> 6];
+                const auto bit = uint64_t(1) << (low & 63);
+                if (word & bit)
+                    return false;
+                word |= bit;
+                ++count;
+                return true;
+            }
+
+            bool erase(uint16_t low)
+            {
+                if (bitmap.empty())
+                {
+                    auto it = std::lower_bound(array.begin(), array.end(), low);
+                    if (it == array.end() || *it != low)
+                        return false;
+                    array.erase(it);
+                    --count;
+                    return true;
+                }
+                auto & word = bitmap[low >> 6];
+                const auto bit = uint64_t(1) << (low & 63);
+                if (!(word & bit))
+                    return false;
+                word &= ~bit;
+                --count;
+                // back to an array well below the limit, so a chunk near it does not flip on every change
+                if (count < array_limit / 2)
+                {
+                    array.reserve(count);
+                    for (uint32_t w = 0; w < bitmap_words; ++w)
+                        for (uint64_t bits = bitmap[w]; bits; bits &= bits - 1)
+                            array.push_back(static_cast<uint16_t>((w << 6) | _lowest_bit(bits)));
+                    bitmap.clear();
+                    bitmap.shrink_to_fit();
+                }
+                return true;
+            }
+        };
+
+        struct chunk_less
+        {
+            bool operator()(const chunk & c, uint16_t key) const noexcept
+            {
+                return c.key < key;
+            }
+        };
+
+        static uint32_t _lowest_bit(uint64_t word) noexcept
+        {
+#if defined(_MSC_VER)
+            unsigned long index;
+            _BitScanForward64(&index, word);
+            return static_cast<uint32_t>(index);
+#else
+            return static_cast<uint32_t>(__builtin_ctzll(word));
+#endif
+        }
+
+        std::vector<chunk> _chunks; /**< Sorted by key */
+        std::size_t _size = 0;
+    };
+
+    /// Give a member an index
+    /**
+     * @param member_id Snowflake of the member
+     * @returns Index of the member
+     */
+    uint32_t add_member(snowflake member_id)
+    {
+        if (!_free.empty())
+        {
+            const auto slot = _free.back();
+            _free.pop_back();
+            _members[slot] = member_id;
+            return slot;
+        }
+        _members.push_back(member_id);
+        return static_cast<uint32_t>(_members.size() - 1);
+    }
+
+    /// Release the index of a member for reuse
+    /**
+     * The member must have been removed from all its roles first
+     * @param slot Index of the member
+     */
+    void remove_member(uint32_t slot)
+    {
+        _members[slot] = snowflake();
+        _free.push_back(slot);
+    }
+
+    /// Get the member with an index
+    snowflake member_at(uint32_t slot) const noexcept
+    {
+        return _members[slot];
+    }
+
+    /// Record that a member has a role
+    void add(uint32_t slot, snowflake role_id)
+    {
+        _roles[role_id].insert(slot);
+    }
+
+    /// Record that a member no longer has a role
+    void remove(uint32_t slot, snowflake role_id)
+    {
+        auto it = _roles.find(role_id);
+        if (it == _roles.end())
+            return;
+        it->second.erase(slot);
+        if (it->second.size() == 0)
+            _roles.erase(it);
+    }
+
+    /// Get the members of a role
+    /**
+     * @param role_id Snowflake of the role
+     * @returns Set of member indices or nullptr if no member has the role
+     */
+    const slot_set * find(snowflake role_id) const noexcept
+    {
+        auto it = _roles.find(role_id);
+        return (it == _roles.end()) ? nullptr : &it->second;
+    }
+
+    /// Get the snowflakes of the members of a role
+    std::vector<snowflake> members(snowflake role_id) const
+    {
+        std::vector<snowflake> result;
+        auto s = find(role_id);
+        if (s == nullptr)
+            return result;
+        result.reserve(s->size());
+        s->for_each([&](uint32_t slot) { result.push_back(_members[slot]); });
+        return result;
+    }
+
+    /// Get the amount of members of a role
+    std::size_t count(snowflake role_id) const noexcept
+    {
+        auto s = find(role_id);
+        return (s == nullptr) ? 0 : s->size();
+    }
+
+    /// Drop a role
+    /**
+     * @param role_id Snowflake of the role
+     * @returns Indices of the members that had the role
+     */
+    std::vector<uint32_t> erase_role(snowflake role_id)
+    {
+        std::vector<uint32_t> result;
+        auto it = _roles.find(role_id);
+        if (it == _roles.end())
+            return result;
+        result.reserve(it->second.size());
+        it->second.for_each([&](uint32_t slot) { result.push_back(slot); });
+        _roles.erase(it);
+        return result;
+    }
+
+    void clear() noexcept
+    {
+        _roles.clear();
+        _members.clear();
+        _free.clear();
+    }
+
+private:
+    flat_map<snowflake, slot_set> _roles;
+    std::vector<snowflake> _members; /**< Member of each index */
+    std::vector<uint32_t> _free; /**< Indices released by members that left */
+};
+
+}
@@ -0,0 +1,134 @@
+//
+// role_table.hpp
+// **************
+//
+// Copyright (c) 2019 Sharon W (sharon at aegis dot gg)
+//
+// Distributed under the MIT License. (See accompanying file LICENSE)
+//
+
+#pragma once
+
+#include "aegis/config.hpp"
+#include "aegis/snowflake.hpp"
+#include "aegis/flat_map.hpp"
+#include <cstdint>
+#include <vector>
+
+namespace aegis
+{
+
+/// Allow masks of the roles of a guild, stored densely for permission checks
+/**
+ * Each role gets a slot in a contiguous array of masks. Slots stay dense, so removing a role
+ * moves the last one into its slot. The guild keeps the table in step with its role map and
+ * guards both with its mutex.
+ */
+class role_table
+{
+public:
+    static constexpr uint32_t npos = ~uint32_t(0);
+
+    /// Get the slot of a role
+    /**
+     * @param id Snowflake of the role
+     * @returns Slot of the role or npos if it is unknown
+     */
+    uint32_t index(snowflake id) const noexcept
+    {
+        auto it = _index.find(id);
+        return (it == _index.end()) ? npos : it->second;
+    }
+
+    /// Get the allow mask of a role
+    /**
+     * @param id Snowflake of the role
+     * @returns Allow mask or 0 if the role is unknown
+     */
+    int64_t allow(snowflake id) const noexcept
+    {
+        auto it = _index.find(id);
+        return (it == _index.end()) ? 0 : _allow[it->second];
+    }
+
+    /// Get the allow mask in a slot
+    int64_t allow_at(uint32_t slot) const noexcept
+    {
+        return _allow[slot];
+    }
+
+    /// Get the role in a slot
+    snowflake id_at(uint32_t slot) const noexcept
+    {
+        return _ids[slot];
+    }
+
+    /// Add a role or update its allow mask
+    /**
+     * @param id Snowflake of the role
+     * @param allow Allow mask of the role
+     * @returns Slot of the role
+     */
+    uint32_t set(snowflake id, int64_t allow)
+    {
+        auto it = _index.find(id);
+        if (it != _index.end())
+        {
+            _allow[it->second] = allow;
+            return it->second;
+        }
+        const auto slot = static_cast<uint32_t>(_ids.size());
+        _ids.push_back(id);
+        _allow.push_back(allow);
+        _index.emplace(id, slot);
+        return slot;
+    }
+
+    /// Remove a role
+    /**
+     * The last role moves into the freed slot
+     * @param id Snowflake of the role
+     */
+    void erase(snowflake id) noexcept
+    {
+        auto it = _index.find(id);
+        if (it == _index.end())
+            return;
+        const auto slot = it->second;
+        _index.erase(it);
+        const auto last = static_cast<uint32_t>(_ids.size() - 1);
+        if (slot != last)
+        {
+            _ids[slot] = _ids[last];
+            _allow[slot] = _allow[last];
+            _index[_ids[slot]] = slot;
+        }
+        _ids.pop_back();
+        _allow.pop_back();
+    }
+
+    void clear() noexcept
+    {
+        _index.clear();
+        _ids.clear();
+        _allow.clear();
+    }
+
+    std::size_t size() const noexcept
+    {
+        return _ids.size();
+    }
+
+    /// Get the allow masks of all slots
+    const std::vector<int64_t> & masks() const noexcept
+    {
+        return _allow;
+    }
+
+private:
+    flat_map<snowflake, uint32_t> _index;
+    std::vector<snowflake> _ids;
+    std::vector<int64_t> _allow;
+};
+
+}
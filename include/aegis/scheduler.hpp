@@ -0,0 +1,312 @@
+//
+// scheduler.hpp
+// *************
+//
+// Copyright (c) 2019 Sharon W (sharon at aegis dot gg)
+//
+// Distributed under the MIT License. (See accompanying file LICENSE)
+//
+
+#pragma once
+
+#include "aegis/config.hpp"
+#include "aegis/futures.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace aegis
+{
+
+/// Work-stealing thread pool for CPU bound work
+/**
+ * Each worker owns a deque. Work posted from a worker goes to the back of its own deque and
+ * is taken from the back again, while idle workers steal from the front of the others, so
+ * related work stays on one core and no single queue lock is shared by every thread.
+ * Work posted from other threads is spread over the workers round-robin.
+ *
+ * Socket I/O stays on the asio::io_context. Work that must run in order, like the events of
+ * a single shard, should not be split across the scheduler.
+ *
+ * @code{.cpp}
+ * aegis::scheduler pool(8);
+ * bot.async(pool.get_executor(), []{ return expensive(); })
+ *     .then(pool.get_executor(), [](auto && result) { ... }); // continues on the pool
+ * @endcode
+ */
+class scheduler
+{
+public:
+    /// Executor posting work to a scheduler. Accepted wherever aegis takes an executor.
+    class executor_type
+    {
+    public:
+        using aegis_executor_tag = void;
+
+        explicit executor_type(scheduler * sched) noexcept
+            : _sched(sched)
+        {
+        }
+
+        template<typename Func>
+        void post(Func && func) const
+        {
+            _sched->post(std::forward<Func>(func));
+        }
+
+        scheduler & context() const noexcept
+        {
+            return *_sched;
+        }
+
+        bool operator==(const executor_type & other) const noexcept
+        {
+            return _sched == other._sched;
+        }
+
+        bool operator!=(const executor_type & other) const noexcept
+        {
+            return _sched != other._sched;
+        }
+
+    private:
+        scheduler * _sched;
+    };
+
+    /// Counters of a single worker
+    /**
+     * Counters are cumulative. Diff two snapshots to get the utilisation over an interval.
+     */
+    struct worker_stats
+    {
+        bool active = false; /**< Worker thread is running and accepting work */
+        std::size_t queued = 0; /**< Work waiting in the worker's deque */
+        uint64_t executed = 0; /**< Work run by the worker */
+        uint64_t stolen = 0; /**< Work taken from other workers */
+        std::chrono::nanoseconds busy{ 0 }; /**< Time spent running work */
+        std::chrono::nanoseconds uptime{ 0 }; /**< Time since the worker was started */
+
+        /// Get the share of its uptime the worker spent running work
+        /**
+         * @returns Value between 0 and 1
+         */
+        double utilisation() const noexcept
+        {
+            return uptime.count() > 0 ? static_cast<double>(busy.count()) / uptime.count() : 0.0;
+        }
+    };
+
+    /// Start a scheduler
+    /**
+     * @param threads Amount of workers to start
+     * @param max_threads Upper bound for resize(). Defaults to the larger of threads and the
+     * hardware concurrency
+     */
+    AEGIS_DECL explicit scheduler(std::size_t threads, std::size_t max_threads = 0);
+
+    /// Runs the remaining work and joins all workers
+    AEGIS_DECL ~scheduler();
+
+    scheduler(const scheduler &) = delete;
+    scheduler & operator=(const scheduler &) = delete;
+
+    /// Queue work on the scheduler
+    /**
+     * Exceptions escaping the work are logged and discarded
+     * @param func Callable taking no arguments. May be move-only.
+     */
+    template<typename Func>
+    void post(Func && func)
+    {
+        _push(work_item(std::forward<Func>(func)));
+    }
+
+    /// Get an executor posting to this scheduler
+    /**
+     * @returns executor_type
+     */
+    executor_type get_executor() noexcept
+    {
+        return executor_type(this);
+    }
+
+    /// Change the amount of workers
+    /**
+     * Removed workers stop accepting work, finish what is in their deque and exit. Growing
+     * joins workers that were removed earlier before restarting them.
+     * @param threads Amount of workers. Clamped to [1, max_size()]
+     */
+    AEGIS_DECL void resize(std::size_t threads);
+
+    /// Get the amount of workers accepting work
+    std::size_t size() const noexcept
+    {
+        return _active.load(std::memory_order_acquire);
+    }
+
+    /// Get the upper bound for resize()
+    std::size_t max_size() const noexcept
+    {
+        return _workers.size();
+    }
+
+    /// Get the amount of work queued and not yet started
+    std::size_t pending() const noexcept
+    {
+        auto n = _queued.load(std::memory_order_relaxed);
+        return n > 0 ? static_cast<std::size_t>(n) : 0;
+    }
+
+    /// Get the counters of every worker slot
+    /**
+     * @returns One entry per slot up to the highest started worker
+     */
+    AEGIS_DECL std::vector<worker_stats> stats() const;
+
+    /// Run the remaining work and join all workers
+    /**
+     * Work posted after stop() is not run
+     */
+    AEGIS_DECL void stop();
+
+private:
+    /// Type-erased move-only work
+    class work_item
+    {
+    public:
+        work_item() noexcept = default;
+
+        template<typename Func, typename = std::enable_if_t<!std::is_same<std::decay_t<Func>, work_item>::value>>
+        explicit work_item(Func && func)
+        {
+            using type = impl<std::decay_t<Func>>;
+            void * p = detail::block_pool::allocate(sizeof(type));
+            try
+            {
+                _impl = new (p) type(std::forward<Func>(func));
+            }
+            catch (...)
+            {
+                detail::block_pool::deallocate(p, sizeof(type));
+                throw;
+            }
+        }
+
+        work_item(work_item && other) noexcept
+            : _impl(other._impl)
+        {
+            other._impl = nullptr;
+        }
+
+        work_item & operator=(work_item && other) noexcept
+        {
+            if (this != &other)
+            {
+                reset();
+                _impl = other._impl;
+                other._impl = nullptr;
+            }
+            return *this;
+        }
+
+        ~work_item()
+        {
+            reset();
+        }
+
+        void operator()()
+        {
+            _impl->run();
+        }
+
+    private:
+        struct base
+        {
+            virtual ~base() = default;
+            virtual void run() = 0;
+            virtual void destroy() noexcept = 0;
+        };
+
+        template<typename Func>
+        struct impl final : base
+        {
+            template<typename F>
+            explicit impl(F && f)
+                : _func(std::forward<F>(f))
+            {
+            }
+
+            void run() override
+            {
+                _func();
+            }
+
+            void destroy() noexcept override
+            {
+                this->~impl();
+                detail::block_pool::deallocate(this, sizeof(impl));
+            }
+
+            Func _func;
+        };
+
+        void reset() noexcept
+        {
+            if (_impl)
+                _impl->destroy();
+            _impl = nullptr;
+        }
+
+        base * _impl = nullptr;
+    };
+
+    struct worker
+    {
+        scheduler * owner = nullptr;
+        std::size_t index = 0;
+        std::thread thd;
+        mutable std::mutex m;
+        std::deque<work_item> queue;
+        std::atomic<bool> running{ false };
+        std::atomic<bool> retiring{ false };
+        std::atomic<uint64_t> executed{ 0 };
+        std::atomic<uint64_t> stolen{ 0 };
+        std::atomic<int64_t> busy_ns{ 0 };
+        std::atomic<int64_t> started_at{ 0 };
+    };
+
+    /// Worker running on the calling thread, if any
+    static worker *& current() noexcept
+    {
+        static thread_local worker * w = nullptr;
+        return w;
+    }
+
+    AEGIS_DECL void _push(work_item && item);
+    AEGIS_DECL void _start(worker & w);
+    AEGIS_DECL void _run(worker & w);
+    AEGIS_DECL bool _pop(worker & w, work_item & item);
+    AEGIS_DECL bool _steal(worker & w, work_item & item);
+
+    std::vector<std::unique_ptr<worker>> _workers; /**< Fixed slots. Threads come and go, slots do not */
+    std::atomic<std::size_t> _active{ 0 }; /**< Slots [0, _active) accept work */
+    std::atomic<std::size_t> _started{ 0 }; /**< Slots [0, _started) may hold work */
+    std::atomic<std::size_t> _next{ 0 };
+    std::atomic<int64_t> _queued{ 0 };
+    std::atomic<std::size_t> _sleepers{ 0 };
+    std::atomic<bool> _stopping{ false };
+    std::mutex _sleep_m;
+    std::condition_variable _sleep_cv;
+    std::mutex _resize_m;
+};
+
+}
+
+#if defined(AEGIS_HEADER_ONLY)
+#include "aegis/impl/scheduler.cpp"
+#endif
@@ -0,0 +1,196 @@
+//
+// event_queue.hpp
+// ***************
+//
+// Copyright (c) 2019 Sharon W (sharon at aegis dot gg)
+//
+// Distributed under the MIT License. (See accompanying file LICENSE)
+//
+
+#pragma once
+
+#include "aegis/config.hpp"
+#include <nlohmann/json.hpp>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace aegis
+{
+
+namespace shards
+{
+
+/// How an event_queue treats an event type once the queue backs up
+enum class event_policy
+{
+    keep, /**< Queued past the limit. Reading from the shard pauses at the hard limit */
+    coalesce, /**< Replaces a queued event with the same key. Dropped past the limit */
+    shed /**< Dropped while the queue is at or above the shed threshold */
+};
+
+/// Order in which queued event types are processed
+enum class event_priority
+{
+    high, /**< Interactive traffic such as MESSAGE_CREATE */
+    normal, /**< State changes. Never overtaken within their guild */
+    low /**< Bulk traffic such as PRESENCE_UPDATE and GUILD_MEMBERS_CHUNK */
+};
+
+/// How an event type is queued
+struct event_traits
+{
+    event_policy policy = event_policy::keep;
+    event_priority priority = event_priority::normal;
+};
+
+/// Bounded queue of gateway events waiting to be processed for one shard
+/**
+ * Each priority level is processed in the order received and higher levels first, with one
+ * exception: no event overtakes a normal priority event of the same guild, so a message is
+ * never processed before the GUILD_CREATE or CHANNEL_CREATE ahead of it. Normal events
+ * without a guild (READY, RESUMED, DM channels) are not overtaken at all. Normal events in
+ * turn do not overtake low priority events of their guild, so a GUILD_MEMBER_REMOVE is not
+ * processed before a GUILD_MEMBERS_CHUNK or PRESENCE_UPDATE that would add the member back.
+ *
+ * Only one drain runs at a time, which push() and pop() track: push() returns true when the
+ * caller has to start one and pop() ends it by returning false.
+ *
+ * Events that are kept are never dropped, so the queue asks for reading from the shard to
+ * pause through take_pause() once it reaches its hard limit and for it to resume through
+ * take_resume() once it drained back to its limit.
+ */
+class event_queue
+{
+public:
+    /// Key of a coalescing event, e.g. guild and user id of a presence. Only events of the same type share keys
+    using key_type = std::pair<int64_t, int64_t>;
+
+    /// Queued event
+    struct entry
+    {
+        std::string type; /**< Event name, the `t` field */
+        nlohmann::json payload; /**< Full gateway message */
+    };
+
+    /// Queue counters. All but depth and high_water are cumulative
+    struct stats
+    {
+        std::size_t depth = 0; /**< Events currently queued */
+        std::size_t high_water = 0; /**< Highest depth seen */
+        uint64_t queued = 0; /**< Events accepted */
+        uint64_t coalesced = 0; /**< Events that replaced a queued one */
+        uint64_t dropped = 0; /**< Events discarded by their policy */
+        uint64_t pauses = 0; /**< Times reading paused at the hard limit */
+    };
+
+    event_queue() = default;
+    event_queue(const event_queue &) = delete;
+    event_queue & operator=(const event_queue &) = delete;
+
+    /// Set the queue bounds
+    /**
+     * @param limit Depth past which coalescing events are dropped
+     * @param shed_threshold Depth from which shed events are dropped
+     * @param hard_limit Depth at which reading from the shard pauses
+     */
+    AEGIS_DECL void set_limits(std::size_t limit, std::size_t shed_threshold, std::size_t hard_limit) noexcept;
+
+    /// Queue an event
+    /**
+     * @param type Event name
+     * @param payload Full gateway message
+     * @param traits Policy and priority of the event
+     * @param guild_id Guild the event belongs to or 0
+     * @param key Coalescing key, scoped to the event type. Only used with event_policy::coalesce
+     * @returns true if the queue was idle and the caller has to start draining it
+     */
+    AEGIS_DECL bool push(std::string type, nlohmann::json && payload, const event_traits & traits, int64_t guild_id, const key_type & key = {});
+
+    /// Take the oldest event
+    /**
+     * Returning false ends the current drain
+     * @param e Receives the event
+     * @returns false if the queue is empty
+     */
+    AEGIS_DECL bool pop(entry & e);
+
+    /// Check if reading from the shard has to pause
+    /**
+     * @returns true once each time the queue reaches its hard limit
+     */
+    AEGIS_DECL bool take_pause();
+
+    /// Check if reading from the shard can resume
+    /**
+     * @returns true once each time a paused queue drained back to its limit
+     */
+    AEGIS_DECL bool take_resume();
+
+    /// Get the amount of queued events
+    AEGIS_DECL std::size_t size() const;
+
+    /// Get the queue counters
+    AEGIS_DECL stats get_stats() const;
+
+private:
+    /// Event type and key of a coalescing event
+    using slot_key = std::pair<std::string, key_type>;
+
+    struct key_hash
+    {
+        std::size_t operator()(const slot_key & k) const noexcept
+        {
+            return std::hash<std::string>()(k.first) ^ std::hash<int64_t>()(k.second.first * 31 + k.second.second);
+        }
+    };
+
+    struct slot
+    {
+        entry e;
+        uint64_t seq = 0;
+        int64_t guild_id = 0;
+        bool keyed = false;
+        key_type key;
+    };
+
+    struct level
+    {
+        std::deque<slot> queue;
+        uint64_t head = 0; /**< Absolute position of the front slot */
+    };
+
+    static constexpr std::size_t level_count = 3;
+
+    /// Check if an earlier event has to be processed first
+    /**
+     * @param s Front slot of a level
+     * @param normal Whether the slot is on the normal level
+     */
+    AEGIS_DECL bool _blocked(const slot & s, bool normal) const;
+
+    mutable std::mutex _m;
+    level _levels[level_count];
+    std::unordered_map<slot_key, std::pair<std::size_t, uint64_t>, key_hash> _keys; /**< Key to level and absolute position of its slot */
+    std::unordered_map<int64_t, std::deque<uint64_t>> _barriers; /**< Sequence numbers of queued normal events per guild */
+    std::unordered_map<int64_t, std::deque<uint64_t>> _low_barriers; /**< Sequence numbers of queued low events per guild, except guild 0 */
+    std::size_t _depth = 0;
+    uint64_t _seq = 0;
+    bool _draining = false;
+    bool _paused = false;
+    std::size_t _limit = 10000;
+    std::size_t _shed_threshold = 1000;
+    std::size_t _hard_limit = 50000;
+    stats _stats;
+};
+
+}
+
+}
+
+#if defined(AEGIS_HEADER_ONLY)
+#include "aegis/shards/impl/event_queue.cpp"
+#endif
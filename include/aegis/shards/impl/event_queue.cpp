@@ -0,0 +1,173 @@
+//
+// event_queue.cpp
+// ***************
+//
+// Copyright (c) 2019 Sharon W (sharon at aegis dot gg)
+//
+// Distributed under the MIT License. (See accompanying file LICENSE)
+//
+
+#include "aegis/config.hpp"
+#include "aegis/shards/event_queue.hpp"
+#include <algorithm>
+
+namespace aegis
+{
+
+namespace shards
+{
+
+AEGIS_DECL void event_queue::set_limits(std::size_t limit, std::size_t shed_threshold, std::size_t hard_limit) noexcept
+{
+    std::lock_guard<std::mutex> l(_m);
+    _limit = std::max<std::size_t>(limit, 1);
+    _shed_threshold = std::min(shed_threshold, _limit);
+    _hard_limit = std::max(hard_limit, _limit);
+}
+
+AEGIS_DECL bool event_queue::push(std::string type, nlohmann::json && payload, const event_traits & traits, int64_t guild_id, const key_type & key)
+{
+    std::lock_guard<std::mutex> l(_m);
+
+    if (traits.policy == event_policy::coalesce)
+    {
+        auto it = _keys.find(slot_key(type, key));
+        if (it != _keys.end())
+        {
+            auto & lv = _levels[it->second.first];
+            lv.queue[static_cast<std::size_t>(it->second.second - lv.head)].e.payload = std::move(payload);
+            ++_stats.coalesced;
+            return false;
+        }
+        if (_depth >= _limit)
+        {
+            ++_stats.dropped;
+            return false;
+        }
+    }
+    else if (traits.policy == event_policy::shed && _depth >= _shed_threshold)
+    {
+        ++_stats.dropped;
+        return false;
+    }
+
+    const auto idx = static_cast<std::size_t>(traits.priority);
+    auto & lv = _levels[idx];
+
+    slot s;
+    s.e.type = std::move(type);
+    s.e.payload = std::move(payload);
+    s.seq = _seq++;
+    s.guild_id = guild_id;
+    if (traits.policy == event_policy::coalesce)
+    {
+        s.keyed = true;
+        s.key = key;
+        _keys.emplace(slot_key(s.e.type, key), std::make_pair(idx, lv.head + lv.queue.size()));
+    }
+    if (traits.priority == event_priority::normal)
+        _barriers[guild_id].push_back(s.seq);
+    else if (traits.priority == event_priority::low && guild_id != 0)
+        _low_barriers[guild_id].push_back(s.seq);
+    lv.queue.emplace_back(std::move(s));
+
+    ++_depth;
+    ++_stats.queued;
+    _stats.high_water = std::max(_stats.high_water, _depth);
+
+    if (_draining)
+        return false;
+    _draining = true;
+    return true;
+}
+
+AEGIS_DECL bool event_queue::_blocked(const slot & s, bool normal) const
+{
+    auto it = _barriers.find(0);
+    if (it != _barriers.end() && it->second.front() < s.seq)
+        return true;
+    if (s.guild_id == 0)
+        return false;
+    it = _barriers.find(s.guild_id);
+    if (it != _barriers.end() && it->second.front() < s.seq)
+        return true;
+    if (!normal)
+        return false;
+    it = _low_barriers.find(s.guild_id);
+    return it != _low_barriers.end() && it->second.front() < s.seq;
+}
+
+AEGIS_DECL bool event_queue::pop(entry & e)
+{
+    std::lock_guard<std::mutex> l(_m);
+    if (_depth == 0)
+    {
+        _draining = false;
+        return false;
+    }
+
+    // whichever of the normal and low fronts is older is never blocked, so this always finds one
+    for (std::size_t i = 0; i < level_count; ++i)
+    {
+        auto & lv = _levels[i];
+        const bool normal = i == static_cast<std::size_t>(event_priority::normal);
+        const bool low = i == static_cast<std::size_t>(event_priority::low);
+        if (lv.queue.empty() || _blocked(lv.queue.front(), normal))
+            continue;
+
+        auto & s = lv.queue.front();
+        if (s.keyed)
+            _keys.erase(slot_key(s.e.type, s.key));
+        if (normal || (low && s.guild_id != 0))
+        {
+            auto & barriers = normal ? _barriers : _low_barriers;
+            auto it = barriers.find(s.guild_id);
+            it->second.pop_front();
+            if (it->second.empty())
+                barriers.erase(it);
+        }
+        e = std::move(s.e);
+        lv.queue.pop_front();
+        ++lv.head;
+        --_depth;
+        return true;
+    }
+    return false;
+}
+
+AEGIS_DECL bool event_queue::take_pause()
+{
+    std::lock_guard<std::mutex> l(_m);
+    if (_paused || _depth < _hard_limit)
+        return false;
+    _paused = true;
+    ++_stats.pauses;
+    return true;
+}
+
+AEGIS_DECL bool event_queue::take_resume()
+{
+    std::lock_guard<std::mutex> l(_m);
+    if (!_paused || _depth > _limit)
+        return false;
+    _paused = false;
+    return true;
+}
+
+AEGIS_DECL std::size_t event_queue::size() const
+{
+    std::lock_guard<std::mutex> l(_m);
+    return _depth;
+}
+
+AEGIS_DECL event_queue::stats event_queue::get_stats() const
+{
+    std::lock_guard<std::mutex> l(_m);
+    auto res = _stats;
+    res.depth = _depth;
+    return res;
+}
+
+}
+
+}
@@ -31,6 +31,7 @@
 #include "aegis/zstr/zstr.hpp"
 #include "aegis/gateway/objects/presence.hpp"
 #include "aegis/gateway/objects/activity.hpp"
+#include "aegis/shards/event_queue.hpp"
 
 namespace aegis
 {
@@ -212,6 +213,15 @@ public:
         return _trace;
     }
 
+    /// Get the queue of events received on this shard and waiting to be processed
+    /**
+     * @returns Reference to the event queue
+     */
+    event_queue & get_event_queue() noexcept
+    {
+        return _events;
+    }
+
     /// Update presence on this shard
     /**
      * @see aegis::gateway::objects::activity
@@ -262,6 +272,7 @@ private:
     std::shared_ptr<asio::io_context::strand> _strand;
 
     heartbeat_status _heartbeat_status = heartbeat_status::normal;
+    event_queue _events;
 };
 
 }
@@ -0,0 +1,146 @@
+//
+// slab.hpp
+// ********
+//
+// Copyright (c) 2019 Sharon W (sharon at aegis dot gg)
+//
+// Distributed under the MIT License. (See accompanying file LICENSE)
+//
+
+#pragma once
+
+#include "aegis/config.hpp"
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace aegis
+{
+
+/// Fixed size object allocator carving objects out of large contiguous chunks
+/**
+ * Cache entities are allocated and freed in large numbers over the life of a bot. Serving
+ * them from chunks of adjacent slots keeps them close together, avoids the per-block
+ * overhead of the general purpose allocator and reuses freed slots before growing, which
+ * keeps fragmentation and RSS predictable. Objects never move, so pointers stay valid until
+ * the object is destroyed.
+ *
+ * Types opt in through class specific operator new/delete:
+ * @code{.cpp}
+ * static void * operator new(std::size_t size) { return slab<user>::instance().allocate(size); }
+ * static void operator delete(void * p, std::size_t size) noexcept { slab<user>::instance().deallocate(p, size); }
+ * @endcode
+ *
+ * Chunks are kept for the life of the process.
+ */
+template<typename T>
+class slab
+{
+public:
+    /// Get the slab of T
+    static slab & instance()
+    {
+        // never destroyed so objects freed during static destruction still have a home
+        static slab * s = new slab();
+        return *s;
+    }
+
+    slab(const slab &) = delete;
+    slab & operator=(const slab &) = delete;
+
+    /// Allocate storage for one T
+    /**
+     * @param size Requested size. Anything but sizeof(T), e.g. a derived type, is passed on
+     * to the global operator new
+     * @returns Uninitialised storage
+     */
+    void * allocate(std::size_t size)
+    {
+        if (size != sizeof(T))
+            return ::operator new(size);
+
+        std::lock_guard<std::mutex> l(_m);
+        if (_free == nullptr)
+            _grow();
+        auto n = _free;
+        _free = n->next;
+        ++_live;
+        return n;
+    }
+
+    /// Return storage obtained from allocate()
+    /**
+     * @param p Storage to free
+     * @param size Size passed to allocate()
+     */
+    void deallocate(void * p, std::size_t size) noexcept
+    {
+        if (p == nullptr)
+            return;
+        if (size != sizeof(T))
+        {
+            ::operator delete(p);
+            return;
+        }
+
+        std::lock_guard<std::mutex> l(_m);
+        auto n = static_cast<node *>(p);
+        n->next = _free;
+        _free = n;
+        --_live;
+    }
+
+    /// Get the amount of objects currently allocated
+    std::size_t live() const
+    {
+        std::lock_guard<std::mutex> l(_m);
+        return _live;
+    }
+
+    /// Get the amount of slots in all chunks
+    std::size_t capacity() const
+    {
+        std::lock_guard<std::mutex> l(_m);
+        return _chunks.size() * per_chunk;
+    }
+
+    /// Get the amount of bytes held in chunks
+    std::size_t bytes() const
+    {
+        std::lock_guard<std::mutex> l(_m);
+        return _chunks.size() * per_chunk * slot_size;
+    }
+
+private:
+    union node
+    {
+        node * next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    static constexpr std::size_t slot_size = sizeof(node);
+    /// Slots per chunk. Around 64 KiB but no fewer than 16
+    static constexpr std::size_t per_chunk = (65536 / slot_size) > 16 ? (65536 / slot_size) : 16;
+
+    slab() = default;
+
+    void _grow()
+    {
+        auto chunk = static_cast<node *>(::operator new(per_chunk * slot_size));
+        _chunks.push_back(chunk);
+        // link back to front so allocation walks the chunk in address order
+        for (std::size_t i = per_chunk; i > 0; --i)
+        {
+            chunk[i - 1].next = _free;
+            _free = &chunk[i - 1];
+        }
+    }
+
+    mutable std::mutex _m;
+    node * _free = nullptr;
+    std::vector<node *> _chunks;
+    std::size_t _live = 0;
+};
+
+}
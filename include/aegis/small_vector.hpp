@@ -0,0 +1,213 @@
+//
+// small_vector.hpp
+// ****************
+//
+// Copyright (c) 2019 Sharon W (sharon at aegis dot gg)
+//
+// Distributed under the MIT License. (See accompanying file LICENSE)
+//
+
+#pragma once
+
+#include "aegis/config.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace aegis
+{
+
+/// Vector storing up to N elements inline
+/**
+ * Only allocates once more than N elements are held, so short lists such as the roles of a
+ * member cost no allocation at all. Restricted to element types that are trivially destructible
+ * and nothrow copyable, e.g. snowflakes and pointers.
+ *
+ * Interface follows std::vector for the parts aegis uses.
+ */
+template<typename T, std::size_t N>
+class small_vector
+{
+    static_assert(std::is_trivially_destructible<T>::value, "small_vector requires trivially destructible elements");
+    static_assert(std::is_nothrow_copy_constructible<T>::value, "small_vector requires nothrow copyable elements");
+    static_assert(N > 0, "small_vector requires inline room for at least one element");
+
+public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using iterator = T *;
+    using const_iterator = const T *;
+    using reference = T &;
+    using const_reference = const T &;
+
+    small_vector() noexcept = default;
+
+    small_vector(std::initializer_list<T> init)
+    {
+        reserve(init.size());
+        for (auto & v : init)
+            push_back(v);
+    }
+
+    small_vector(const small_vector & other)
+    {
+        reserve(other.size());
+        for (auto & v : other)
+            push_back(v);
+    }
+
+    small_vector(small_vector && other) noexcept
+    {
+        _take(other);
+    }
+
+    small_vector & operator=(const small_vector & other)
+    {
+        if (this != &other)
+        {
+            clear();
+            reserve(other.size());
+            for (auto & v : other)
+                push_back(v);
+        }
+        return *this;
+    }
+
+    small_vector & operator=(small_vector && other) noexcept
+    {
+        if (this != &other)
+        {
+            _release();
+            _take(other);
+        }
+        return *this;
+    }
+
+    ~small_vector()
+    {
+        _release();
+    }
+
+    iterator begin() noexcept { return data(); }
+    iterator end() noexcept { return data() + _size; }
+    const_iterator begin() const noexcept { return data(); }
+    const_iterator end() const noexcept { return data() + _size; }
+    const_iterator cbegin() const noexcept { return begin(); }
+    const_iterator cend() const noexcept { return end(); }
+
+    T * data() noexcept { return _is_heap() ? _heap : reinterpret_cast<T *>(&_inline); }
+    const T * data() const noexcept { return _is_heap() ? _heap : reinterpret_cast<const T *>(&_inline); }
+
+    size_type size() const noexcept { return _size; }
+    size_type capacity() const noexcept { return _capacity; }
+    bool empty() const noexcept { return _size == 0; }
+
+    T & operator[](size_type i) noexcept { return data()[i]; }
+    const T & operator[](size_type i) const noexcept { return data()[i]; }
+    T & front() noexcept { return data()[0]; }
+    const T & front() const noexcept { return data()[0]; }
+    T & back() noexcept { return data()[_size - 1]; }
+    const T & back() const noexcept { return data()[_size - 1]; }
+
+    void push_back(const T & value)
+    {
+        emplace_back(value);
+    }
+
+    template<typename... Args>
+    T & emplace_back(Args &&... args)
+    {
+        // built first in case args refer to an element that growing would move
+        T value(std::forward<Args>(args)...);
+        if (_size == _capacity)
+            _grow(_capacity * 2);
+        auto p = new (data() + _size) T(value);
+        ++_size;
+        return *p;
+    }
+
+    void pop_back() noexcept
+    {
+        --_size;
+    }
+
+    /// Erase an element, keeping the order of the rest
+    iterator erase(const_iterator pos) noexcept
+    {
+        auto p = const_cast<T *>(pos);
+        std::copy(p + 1, end(), p);
+        --_size;
+        return p;
+    }
+
+    void clear() noexcept
+    {
+        _size = 0;
+    }
+
+    void reserve(size_type count)
+    {
+        if (count > _capacity)
+            _grow(count);
+    }
+
+    bool operator==(const small_vector & other) const noexcept
+    {
+        return _size == other._size && std::equal(begin(), end(), other.begin());
+    }
+
+    bool operator!=(const small_vector & other) const noexcept
+    {
+        return !(*this == other);
+    }
+
+private:
+    bool _is_heap() const noexcept
+    {
+        return _capacity > N;
+    }
+
+    void _grow(size_type cap)
+    {
+        auto p = static_cast<T *>(::operator new(cap * sizeof(T)));
+        std::uninitialized_copy(begin(), end(), p);
+        _release();
+        _heap = p;
+        _capacity = static_cast<uint32_t>(cap);
+    }
+
+    void _release() noexcept
+    {
+        if (_is_heap())
+            ::operator delete(_heap);
+        _capacity = N;
+    }
+
+    void _take(small_vector & other) noexcept
+    {
+        if (other._is_heap())
+        {
+            _heap = other._heap;
+            _capacity = other._capacity;
+        }
+        else
+            std::uninitialized_copy(other.begin(), other.end(), reinterpret_cast<T *>(&_inline));
+        _size = other._size;
+        other._capacity = N;
+        other._size = 0;
+    }
+
+    union
+    {
+        std::aligned_storage_t<sizeof(T) * N, alignof(T)> _inline;
+        T * _heap;
+    };
+    uint32_t _size = 0;
+    uint32_t _capacity = N;
+};
+
+}
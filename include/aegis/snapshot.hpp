@@ -0,0 +1,79 @@
+//
+// snapshot.hpp
+// ************
+//
+// Copyright (c) 2019 Sharon W (sharon at aegis dot gg)
+//
+// Distributed under the MIT License. (See accompanying file LICENSE)
+//
+
+#pragma once
+
+#include "aegis/config.hpp"
+#include "aegis/fwd.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#if !defined(AEGIS_DISABLE_ALL_CACHE)
+
+namespace aegis
+{
+
+namespace detail
+{
+struct snapshot_writer;
+}
+
+/// Binary snapshot of the guild, channel, role, user and member caches
+/**
+ * Lets a restarted bot answer lookups and permission checks straight away instead of waiting
+ * for READY, GUILD_CREATE and member chunking. Restored guilds are marked as such until the
+ * gateway sends them again, and READY removes the ones the bot is no longer in.
+ *
+ * The format is a flat little endian stream of fixed width fields and length prefixed strings
+ * led by a magic and a version. Snapshots are only meant to be read back by the same build on
+ * the same machine, so anything unexpected makes load() refuse the whole file.
+ *
+ * Enable through create_bot_t::snapshot_path() or call save() and load() directly. load() has
+ * to run before the shards connect.
+ */
+class snapshot
+{
+public:
+    /// Write the caches to a file
+    /**
+     * Streamed to a temporary file next to the target, synced to disk and renamed over it, so a
+     * crash mid write keeps the previous snapshot. Safe to call while events are processed
+     * @param bot Bot to take the caches of
+     * @param path File to write
+     * @throws aegis::exception Thrown when the file cannot be written
+     * @returns Size of the snapshot in bytes
+     */
+    AEGIS_DECL static std::size_t save(core & bot, const std::string & path);
+
+    /// Fill the caches from a file
+    /**
+     * The file is mapped rather than read where the platform allows. Users, channels and members
+     * the cache policy of the bot would not keep are skipped
+     * @param bot Bot to fill the caches of
+     * @param path File to read
+     * @throws aegis::exception Thrown when the file is corrupt or from another version
+     * @returns false if there is no snapshot to load
+     */
+    AEGIS_DECL static bool load(core & bot, const std::string & path);
+
+    static constexpr uint32_t version = 1;
+
+private:
+    /// Write one guild with its roles, channels and members
+    AEGIS_DECL static void _save_guild(detail::snapshot_writer & w, guild & _guild);
+};
+
+}
+
+#endif
+
+#if defined(AEGIS_HEADER_ONLY)
+#include "aegis/impl/snapshot.cpp"
+#endif
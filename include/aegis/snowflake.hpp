@@ -183,6 +183,26 @@ AEGIS_DECL void from_json(const nlohmann::json& j, snowflake& s);
 AEGIS_DECL void to_json(nlohmann::json& j, const snowflake& s);
 /// \endcond
 
+/// Hash for snowflakes and other 64-bit ids
+/**
+ * The low bits of a snowflake are a per-process increment counter that is mostly 0, so the
+ * identity hash clusters badly. This is the splitmix64 finalizer, which spreads every input
+ * bit over the whole result.
+ */
+struct snowflake_hash
+{
+    std::size_t operator()(int64_t k) const noexcept
+    {
+        uint64_t x = static_cast<uint64_t>(k);
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+        return static_cast<std::size_t>(x);
+    }
+};
+
 }
 
 /// \cond TEMPLATES
@@ -194,7 +214,7 @@ struct hash<aegis::snowflake>
 {
     std::size_t operator()(const aegis::snowflake& k) const
     {
-        return hash<int64_t>()(k.get());
+        return aegis::snowflake_hash()(k.get());
     }
 };
 
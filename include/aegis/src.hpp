@@ -27,11 +27,27 @@
 
 #include <aegis/ratelimit/ratelimit.hpp>
 #include <aegis/rest/rest_controller.hpp>
+#include <aegis/scheduler.hpp>
+#include <aegis/handler_pool.hpp>
+#include <aegis/presence_filter.hpp>
+#include <aegis/flat_map.hpp>
+#include <aegis/slab.hpp>
+#include <aegis/reclaim.hpp>
+#include <aegis/small_vector.hpp>
+#include <aegis/role_table.hpp>
+#include <aegis/role_index.hpp>
+#include <aegis/permission_cache.hpp>
+#include <aegis/intern.hpp>
+#include <aegis/cache_policy.hpp>
+#include <aegis/message_cache.hpp>
+#include <aegis/concurrent_map.hpp>
 #include <aegis/core.hpp>
 #include <aegis/shards/shard_mgr.hpp>
+#include <aegis/shards/event_queue.hpp>
 #include <aegis/user.hpp>
 #include <aegis/channel.hpp>
 #include <aegis/guild.hpp>
+#include <aegis/snapshot.hpp>
 
 #include <aegis/impl/core.cpp>
 #include <aegis/impl/user.cpp>
@@ -39,9 +55,17 @@
 #include <aegis/impl/guild.cpp>
 #include <aegis/impl/permission.cpp>
 #include <aegis/impl/snowflake.cpp>
+#include <aegis/impl/scheduler.cpp>
+#include <aegis/impl/handler_pool.cpp>
+#include <aegis/impl/presence_filter.cpp>
+#include <aegis/impl/reclaim.cpp>
+#include <aegis/impl/intern.cpp>
+#include <aegis/impl/snapshot.cpp>
+#include <aegis/impl/message_cache.cpp>
 
 #include <aegis/shards/impl/shard.cpp>
 #include <aegis/shards/impl/shard_mgr.cpp>
+#include <aegis/shards/impl/event_queue.cpp>
 
 #include <aegis/rest/impl/rest_controller.cpp>
 
@@ -13,12 +13,17 @@
 #include "aegis/utility.hpp"
 #if !defined(AEGIS_DISABLE_ALL_CACHE)
 #include "aegis/snowflake.hpp"
+#include "aegis/slab.hpp"
+#include "aegis/small_vector.hpp"
+#include "aegis/intern.hpp"
+#include "aegis/permission_cache.hpp"
 #include "aegis/gateway/objects/presence.hpp"
 #include "aegis/fwd.hpp"
 #include <nlohmann/json.hpp>
 #include <string>
 #include <queue>
 #include <memory>
+#include <atomic>
 #include <set>
 #include <shared_mutex>
 
@@ -41,16 +46,30 @@ public:
   
     explicit user(snowflake id) : _member_id(id) {}
 
-    /// Member owned guild information
+    /// Users are allocated from a slab. See aegis::slab
+    static void * operator new(std::size_t size) { return slab<user>::instance().allocate(size); }
+    static void operator delete(void * p, std::size_t size) noexcept { slab<user>::instance().deallocate(p, size); }
+
+    /// Guild specific information of a member
+    /**
+     * Owned by the guild and indexed by member there. The user keeps a pointer for each
+     * guild it is in. Fields are guarded by the user's mutex.
+     */
     struct guild_info
     {
         guild_info(snowflake _id) : id(_id) {};
+
+        static void * operator new(std::size_t size) { return slab<guild_info>::instance().allocate(size); }
+        static void operator delete(void * p, std::size_t size) noexcept { slab<guild_info>::instance().deallocate(p, size); }
+
         snowflake id;/**< Snowflake of the guild for this data */
-        std::vector<snowflake> roles;
-		lib::optional<std::string> nickname;/**< Nickname of the user in this guild */
+        small_vector<snowflake, 4> roles;/**< Roles of the member, including the guild's everyone role */
+        interned_string nickname;/**< Nickname of the user in this guild */
         uint64_t joined_at = 0;/**< Unix timestamp of when member joined this guild */
         bool deaf = false;/**< Whether member is deafened in a voice channel */
         bool mute = false;/**< Whether member is muted in a voice channel */
+        uint64_t perm_generation = permission_cache::next_generation();/**< Replaced whenever roles change. See aegis::permission_cache */
+        uint32_t role_slot = ~uint32_t(0);/**< Index of the member in the guild's aegis::role_index */
     };
 
     /// Get the nickname of this user
@@ -67,8 +86,7 @@ public:
     std::string get_username() const noexcept
     {
         std::shared_lock<shared_mutex> l(_m);
-        std::string _username = _name;
-        return std::move(_username);
+        return _name.value();
     }
 
     /// Get the discriminator of this user
@@ -87,8 +105,7 @@ public:
     std::string get_avatar() const noexcept
     {
         std::shared_lock<shared_mutex> l(_m);
-        std::string t_avatar = _avatar;
-        return std::move(t_avatar);
+        return _avatar.value();
     }
 
     /// Check whether user is a bot
@@ -114,15 +131,27 @@ public:
     * @returns string of member mention
     */
     AEGIS_DECL std::string get_mention() const noexcept;
-    /// Get the member owned guild information object
+    /// Get the guild specific information of this user
     /**
      * @param guild_id The snowflake for the guild
-     * @returns Pointer to the member owned guild information object
+     * @throws aegis::exception Thrown if the user is not a member of the guild
+     * @returns Reference to the guild information object
      */
-    AEGIS_DECL guild_info & get_guild_info(snowflake guild_id) noexcept;
+    AEGIS_DECL guild_info & get_guild_info(snowflake guild_id);
 
-    AEGIS_DECL guild_info & get_guild_info_nolock(snowflake guild_id) noexcept;
+    /// Get the guild specific information of this user - caller must lock user._m
+    /**
+     * @param guild_id The snowflake for the guild
+     * @throws aegis::exception Thrown if the user is not a member of the guild
+     * @returns Reference to the guild information object
+     */
+    AEGIS_DECL guild_info & get_guild_info_nolock(snowflake guild_id);
 
+    /// Get the guild specific information of this user
+    /**
+     * @param guild_id The snowflake for the guild
+     * @returns Pointer to the guild information object or nullptr if not a member
+     */
     AEGIS_DECL guild_info * get_guild_info_nocreate(snowflake guild_id) const noexcept;
 
     /// Get the full name (username\#discriminator) of this user
@@ -180,6 +209,7 @@ public:
 private:
     friend class core;
     friend class guild;
+    friend class snapshot;
     friend class gateway::objects::message;
 
     AEGIS_DECL void _load_data(gateway::objects::user mbr);
@@ -187,12 +217,13 @@ private:
     snowflake _member_id = 0;
     snowflake _dm_id = 0;
     presence::user_status _status = presence::user_status::Offline; /**< Member _status */
-    std::string _name; /**< Username of member */
+    interned_string _name; /**< Username of member */
     uint16_t _discriminator = 0; /**< 4 digit discriminator (1-9999) */
-    std::string _avatar; /**< Hash of member avatar */
+    interned_string _avatar; /**< Hash of member avatar */
     bool _is_bot = false; /**< true if member is a bot */
     bool _mfa_enabled = false; /**< true if member has Two-factor authentication enabled */
-    std::vector<std::unique_ptr<guild_info>> guilds; /**< Vector of snowflakes to member owned guild information */
+    small_vector<guild_info *, 2> guilds; /**< Guild information of each guild this user is in. Owned by the guilds */
+    std::atomic<int64_t> _last_seen{ 0 }; /**< Steady clock seconds of the last event referring to this user */
     mutable shared_mutex _m;
 
     /// requires the caller to handle locking
@@ -201,22 +232,25 @@ private:
     /// does not lock the member object
     AEGIS_DECL void _load_nolock(guild * _guild, const json & obj, shards::shard * _shard, bool self_add = true, bool guild_lock = true);
 
-    /// requires the caller to handle locking
-    AEGIS_DECL guild_info & _join(snowflake guild_id);
+    /// does not lock the member object
+    AEGIS_DECL guild_info * _find_guild_info(snowflake guild_id) const noexcept;
 
-    /// requires the caller to handle locking
-    AEGIS_DECL guild_info & _join_nolock(snowflake guild_id);
+    /// locks the member object, and the guild if guild_lock is set
+    AEGIS_DECL guild_info & _join(guild * _guild, bool guild_lock = true);
+
+    /// does not lock the member object. Locks the guild if guild_lock is set
+    AEGIS_DECL guild_info & _join_nolock(guild * _guild, bool guild_lock = true);
 
-    /// remove this member from the specified guild
+    /// forget the guild information of the specified guild. The guild frees it
     void leave(snowflake guild_id)
     {
         std::unique_lock<shared_mutex> l(mtx());
-        guilds.erase(std::find_if(std::begin(guilds), std::end(guilds), [&guild_id](const std::unique_ptr<guild_info> & gi)
+        auto it = std::find_if(std::begin(guilds), std::end(guilds), [&guild_id](const guild_info * gi)
         {
-            if (gi->id == guild_id)
-                return true;
-            return false;
-        }));
+            return gi->id == guild_id;
+        });
+        if (it != std::end(guilds))
+            guilds.erase(it);
     }
 };
 
@@ -0,0 +1,103 @@
+//
+// event_queue_test.cpp
+// ********************
+//
+// Copyright (c) 2019 Sharon W (sharon at aegis dot gg)
+//
+// Distributed under the MIT License. (See accompanying file LICENSE)
+//
+
+#include "aegis/shards/event_queue.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+using aegis::shards::event_queue;
+using aegis::shards::event_policy;
+using aegis::shards::event_priority;
+using aegis::shards::event_traits;
+
+namespace
+{
+
+int failures = 0;
+
+void check(bool cond, const char * what)
+{
+    if (cond)
+        return;
+    std::fprintf(stderr, "FAILED: %s\n", what);
+    ++failures;
+}
+
+event_traits traits(event_policy policy, event_priority priority)
+{
+    event_traits t;
+    t.policy = policy;
+    t.priority = priority;
+    return t;
+}
+
+std::vector<std::string> drain(event_queue & q)
+{
+    std::vector<std::string> res;
+    event_queue::entry e;
+    while (q.pop(e))
+        res.push_back(e.type);
+    return res;
+}
+
+// a member removal must not run before a chunk of the same guild that still lists the member
+void member_remove_waits_for_chunk()
+{
+    event_queue q;
+    q.push("GUILD_MEMBERS_CHUNK", nlohmann::json::object(), traits(event_policy::keep, event_priority::low), 1);
+    q.push("GUILD_MEMBER_REMOVE", nlohmann::json::object(), traits(event_policy::keep, event_priority::normal), 1);
+    const auto order = drain(q);
+    check(order == std::vector<std::string>({ "GUILD_MEMBERS_CHUNK", "GUILD_MEMBER_REMOVE" }), "chunk before member remove");
+}
+
+void member_remove_waits_for_presence()
+{
+    event_queue q;
+    q.push("PRESENCE_UPDATE", nlohmann::json::object(), traits(event_policy::coalesce, event_priority::low), 1, { 1, 5 });
+    q.push("GUILD_MEMBER_REMOVE", nlohmann::json::object(), traits(event_policy::keep, event_priority::normal), 1);
+    const auto order = drain(q);
+    check(order == std::vector<std::string>({ "PRESENCE_UPDATE", "GUILD_MEMBER_REMOVE" }), "presence before member remove");
+}
+
+// low events of other guilds do not hold normal events back
+void other_guilds_are_not_blocked()
+{
+    event_queue q;
+    q.push("GUILD_MEMBERS_CHUNK", nlohmann::json::object(), traits(event_policy::keep, event_priority::low), 2);
+    q.push("GUILD_MEMBER_REMOVE", nlohmann::json::object(), traits(event_policy::keep, event_priority::normal), 1);
+    q.push("MESSAGE_CREATE", nlohmann::json::object(), traits(event_policy::keep, event_priority::high), 3);
+    const auto order = drain(q);
+    check(order == std::vector<std::string>({ "MESSAGE_CREATE", "GUILD_MEMBER_REMOVE", "GUILD_MEMBERS_CHUNK" }), "priorities across guilds");
+}
+
+// low events still wait for earlier normal events of their guild
+void chunk_waits_for_guild_create()
+{
+    event_queue q;
+    q.push("GUILD_CREATE", nlohmann::json::object(), traits(event_policy::keep, event_priority::normal), 1);
+    q.push("GUILD_MEMBERS_CHUNK", nlohmann::json::object(), traits(event_policy::keep, event_priority::low), 1);
+    q.push("GUILD_MEMBER_REMOVE", nlohmann::json::object(), traits(event_policy::keep, event_priority::normal), 1);
+    const auto order = drain(q);
+    check(order == std::vector<std::string>({ "GUILD_CREATE", "GUILD_MEMBERS_CHUNK", "GUILD_MEMBER_REMOVE" }), "guild create, chunk, member remove");
+}
+
+}
+
+int main()
+{
+    member_remove_waits_for_chunk();
+    member_remove_waits_for_presence();
+    other_guilds_are_not_blocked();
+    chunk_waits_for_guild_create();
+    if (failures == 0)
+        std::puts("event_queue: all passed");
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}